@@ -35,6 +35,7 @@ from insanity.test import Test
 from insanity.dbustools import unwrap
 from insanity.log import error, warning, debug, info, exception
 import insanity.utils as utils
+import insanity.samplering as samplering
 import gobject
 import re
 
@@ -65,7 +66,8 @@ class DBusTest(Test, dbus.service.Object):
     __test_extra_infos__ = {
     "subprocess-return-code":"The exit value returned by the subprocess",
     "subprocess-spawn-time":"How long it took to spawn the subprocess (in milliseconds)",
-    "cpu-load" : "CPU load in percent (can exceed 100% on multi core systems)" # TODO: move to C
+    "cpu-load" : "CPU load in percent (can exceed 100% on multi core systems)", # TODO: move to C
+    "dropped-samples" : "How many samples the test could not emit because the runner did not keep up"
     }
 
     __test_arguments__ = {
@@ -127,16 +129,14 @@ class DBusTest(Test, dbus.service.Object):
         self._bus_address = bus_address
 
         self._remote_tearing_down = False
+        self._torndown = False
+        # set while the process is being terminated at teardown
+        self._terminating = False
 
         if self._testrun:
-            sid = self._testrun.connect("new-remote-test",
-                                        self._newRemoteTest)
-            self._newremotetestsid = sid
-            sid = self._testrun.connect("removed-remote-test",
-                                        self._removedRemoteTest)
-            self._testrunremovedtestsigid = sid
+            self._testrun.addRemoteTest(self)
         self._process = None
-        self._processpollid = 0
+        self._processwatchid = 0
         self._remoteinstance = None
         # return code from subprocess
         self._returncode = None
@@ -150,6 +150,12 @@ class DBusTest(Test, dbus.service.Object):
         self._subprocessspawntime = 0
         self._subprocessconnecttime = 0
         self._pid = 0
+        # (binary path, environment) when running as a reusable worker
+        self._workerkey = None
+        # shared memory the test emits samples to, if it declares any
+        self._samplering = None
+        self._samplespollid = 0
+        self._samplesfile = None
         
     # Test class overrides
 
@@ -161,6 +167,9 @@ class DBusTest(Test, dbus.service.Object):
         if Test.setUp(self) == False:
             return False
 
+        useworker = self._useLauncher("worker")
+        uselauncher = self._useLauncher("zygote") or self._useLauncher("host")
+
         # get the remote launcher
         pargs = self._preargs
         pargs.extend(self.get_remote_launcher_args())
@@ -170,6 +179,9 @@ class DBusTest(Test, dbus.service.Object):
 
         self._environ["PRIVATE_DBUS_ADDRESS"] = self._bus_address
         info("Setting PRIVATE_DBUS_ADDRESS : %r" % self._bus_address)
+        if self._testrun.isPeerToPeer():
+            # the address is the TestRun's own server, not a bus
+            self._environ["PRIVATE_DBUS_PEER"] = "1"
         info("bus:%r" % self._bus)
 
         self._prepareArguments()
@@ -178,6 +190,25 @@ class DBusTest(Test, dbus.service.Object):
             print("Setting PRIVATE_DBUS_ADDRESS : %r" % self._bus_address)
             time.sleep(5)
 
+        if useworker:
+            # processes can only be shared if they run with the same environment
+            self._workerkey = (pargs[0], tuple(sorted(self._environ.items())))
+            pargs.append("--worker")
+            worker = self._testrun.takeWorker(self._workerkey)
+            if worker:
+                return self._resetWorker(*worker)
+
+        if uselauncher:
+            key = (pargs[0], tuple(sorted(self._environ.items())))
+            self._subprocessspawntime = time.time()
+            l = self._testrun.getLauncherProcess(key, self._environ, cwd)
+            l.newInstance(self.uuid, self._launcherInstanceCb,
+                          self._launcherInstanceErrCb)
+            return True
+
+        return self._spawnProcess(pargs, shell, cwd)
+
+    def _spawnProcess(self, pargs, shell, cwd):
         # spawn the other process
         info("opening %r" % pargs)
         info("cwd %s" % cwd)
@@ -198,8 +229,9 @@ class DBusTest(Test, dbus.service.Object):
         debug("Subprocess created successfully [pid:%d]", self._pid)
 
         self.validateChecklistItem("dbus-process-spawned")
-        # add a poller for the proces
-        self._processpollid = gobject.timeout_add(500, self._pollSubProcess)
+        # get told when the process exits
+        self._processwatchid = utils.watch_process(self._process,
+                                                   self._subProcessExited)
         # Don't forget to set a timeout for waiting for the connection
         return True
 
@@ -211,35 +243,59 @@ class DBusTest(Test, dbus.service.Object):
 
     def tearDown(self):
         info("uuid:%s", self.uuid)
+        if self._terminating:
+            debug("already tearing down, waiting for the process to exit")
+            return
+        self._torndown = True
+        process = None
         # FIXME : tear down the other process gracefully
         #    by first sending it the termination remote signal
         #    and then checking it's killed
         try:
             self.callRemoteTearDown()
         finally:
+            self._closeSamples()
             if self._testrun:
-                if self._newremotetestsid:
-                    self._testrun.disconnect(self._newremotetestsid)
-                    self._newremotetestsid = 0
-                if self._testrunremovedtestsigid:
-                    self._testrun.disconnect(self._testrunremovedtestsigid)
-                    self._testrunremovedtestsigid = 0
-            if self._processpollid:
-                gobject.source_remove(self._processpollid)
-                self._processpollid = 0
-            if self._process:
-                # double check it hasn't actually exited
-                # give the test up to one second to exit
-                if self._returncode is None:
-                    self._returncode = utils.kill_process (self._process)
+                self._testrun.removeRemoteTest(self)
+            if self._processwatchid:
+                utils.unwatch_process(self._process, self._processwatchid)
+                self._processwatchid = 0
+            if self._process and self._workerkey and self._returncode is None:
+                # still healthy, keep it for the next test instance
+                self._testrun.releaseWorker(self._workerkey, self._process,
+                                            self.uuid)
+                self._process = None
+                self.validateChecklistItem("subprocess-exited-normally")
+            elif self._process and getattr(self._process, "shared", False) \
+                    and self._returncode is None:
+                # the host carries on with its other instances
+                self._process = None
+                self.validateChecklistItem("subprocess-exited-normally")
+            else:
+                process = self._process
                 self._process = None
-            if not self._returncode is None:
-                info("Process returned %d", self._returncode)
-                self.extraInfo("subprocess-return-code", self._returncode)
-            self.validateChecklistItem("subprocess-exited-normally", self._returncode == 0)
 
+        if process and self._returncode is None:
+            # give the test a moment to exit before terminating it,
+            # without holding up the other tests meanwhile
+            self._terminating = True
+            utils.terminate_process(process, self._subProcessTerminated)
+        else:
+            self._checkReturnCode()
+            Test.tearDown(self)
+
+    def _subProcessTerminated(self, returncode):
+        self._terminating = False
+        self._returncode = returncode
+        self._checkReturnCode()
         Test.tearDown(self)
 
+    def _checkReturnCode(self):
+        if not self._returncode is None:
+            info("Process returned %d", self._returncode)
+            self.extraInfo("subprocess-return-code", self._returncode)
+        self.validateChecklistItem("subprocess-exited-normally", self._returncode == 0)
+
     def stop(self):
         info("uuid:%s", self.uuid)
         self.callRemoteStop()
@@ -257,32 +313,104 @@ class DBusTest(Test, dbus.service.Object):
         """
         raise NotImplementedError
 
-    ## Subprocess polling
-    def _pollSubProcess(self):
-        info("polling subprocess %r", self.uuid)
-        if not self._process:
-            info("process left, stopping looping")
+    ## Worker and zygote processes
+    def _useLauncher(self, launcher):
+        # monitors wrapping the process (gdb, valgrind) need a fresh one
+        if not self._testrun or self._testrun.getLauncher() != launcher:
             return False
-        res = self._process.poll()
-        # None means the process hasn't terminated yet
-        if res == None:
-            info("process hasn't stopped yet")
-            return True
+        if self._preargs:
+            return False
+        modes = getattr(self._metadata, "__test_launch_modes__", None) or []
+        return launcher in modes
+
+    def _launcherInstanceCb(self, process):
+        shared = getattr(process, "shared", False)
+        if self._torndown:
+            info("process %d arrived after teardown", process.pid)
+            if not shared:
+                utils.terminate_process(process)
+            return
+        debug("Subprocess launched successfully [pid:%d]", process.pid)
+        self._process = process
+        self._pid = process.pid
+        self.validateChecklistItem("dbus-process-spawned")
+        self._processwatchid = utils.watch_process(process,
+                                                   self._subProcessExited)
+
+    def _launcherInstanceErrCb(self, exc):
+        error("Failed to launch test process : %s", exc)
+        if self._torndown:
+            return
+        self.validateChecklistItem("dbus-process-spawned", False)
+        self.tearDown()
+
+    def _resetWorker(self, process, olduuid):
+        info("reusing worker %d (was %s)", process.pid, olduuid)
+        self._subprocessspawntime = time.time()
+        self._process = process
+        self._pid = process.pid
+        rname = "net.gstreamer.Insanity.Test.Test%s" % olduuid
+        rpath = "/net/gstreamer/Insanity/Test/Test%s" % olduuid
+        try:
+            remote = dbus.Interface(self._testrun.getRemoteObject(rname, rpath),
+                                    "net.gstreamer.Insanity.Test")
+            # the worker will show up under our uuid once reset
+            remote.remoteReset(self.uuid,
+                               reply_handler=self._voidRemoteResetCallBackHandler,
+                               error_handler=self._voidRemoteResetErrBackHandler)
+        except:
+            exception("Could not reset worker %d", process.pid)
+            return self._respawnWorker()
+        # dbus-process-spawned is only validated once the reset is done,
+        # as a new worker may have to be spawned instead
+        self._processwatchid = utils.watch_process(process,
+                                                   self._subProcessExited)
+        return True
+
+    def _respawnWorker(self):
+        if self._processwatchid:
+            utils.unwatch_process(self._process, self._processwatchid)
+            self._processwatchid = 0
+        if self._process:
+            utils.terminate_process(self._process)
+            self._process = None
+        pargs = self.get_remote_launcher_args() + ["--worker"]
+        return self._spawnProcess(pargs, False,
+                                  self._testrun.getWorkingDirectory())
+
+    ## Subprocess watching
+    def _subProcessExited(self, returncode):
         # Positive value is the return code of the terminated
         #   process
         # Negative values means the process was killed by signal
-        info("subprocess returned %r" % res)
-        self._returncode = res
+        info("subprocess %r returned %r", self.uuid, returncode)
+        self._returncode = returncode
         self._process = None
-        self._processpollid = 0
+        self._processwatchid = 0
         self.stop()
-        return False
-
 
     ## void handlers for remote DBUS calls
     def _voidRemoteCallBackHandler(self):
         pass
 
+    def _voidRemoteResetCallBackHandler(self, success):
+        if self._torndown:
+            return
+        if success:
+            self.validateChecklistItem("dbus-process-spawned")
+            return
+        warning("Worker %d refused to reset, spawning a new one", self._pid)
+        if not self._respawnWorker():
+            self.tearDown()
+
+    def _voidRemoteResetErrBackHandler(self, exc):
+        if self._torndown:
+            return
+        warning("Failed to reset worker %d (%s), spawning a new one",
+                self._pid, exc)
+        if not self._respawnWorker():
+            self.tearDown()
+
     def _voidRemoteSetUpCallBackHandler(self, success):
         if success:
             self.ping()
@@ -339,10 +467,47 @@ class DBusTest(Test, dbus.service.Object):
         args = dict((k, v) for k, v in self.args.items() if (k in self.getFullArgumentList() and self.getFullArgumentList()[k]["global"] == True))
         args = self._parse_test_arguments(args)
 
+        if self._metadata.getFullSampleList() and hasattr(dbus.types, "UnixFd"):
+            # the sample ring is passed as an extra argument
+            self._samplering = samplering.SampleRing()
+            fd = dbus.types.UnixFd(self._samplering.fileno())
+            self._remoteinstance.remoteSetUp(args, self.getOutputFiles(), fd,
+                                             signature="a{sv}a{ss}h",
+                                             reply_handler=self._voidRemoteSetUpCallBackHandler,
+                                             error_handler=self._voidRemoteSetUpErrBackHandler)
+            self._samplespollid = gobject.timeout_add(100, self._drainSamples)
+            return
+
         self._remoteinstance.remoteSetUp(args, self.getOutputFiles(),
                                          reply_handler=self._voidRemoteSetUpCallBackHandler,
                                          error_handler=self._voidRemoteSetUpErrBackHandler)
 
+    def _drainSamples(self):
+        samples = self._samplering.drain()
+        path = self._outputfiles.get("samples-file")
+        if samples and path:
+            if not self._samplesfile:
+                self._samplesfile = open(path, "a")
+            for timestamp, label, value in samples:
+                self._samplesfile.write("%d,%s,%r\n" % (timestamp, label, value))
+        return True
+
+    def _closeSamples(self):
+        if self._samplespollid:
+            gobject.source_remove(self._samplespollid)
+            self._samplespollid = 0
+        if not self._samplering:
+            return
+        self._drainSamples()
+        dropped = self._samplering.getDropped()
+        if dropped:
+            self.extraInfo("dropped-samples", dropped)
+        if self._samplesfile:
+            self._samplesfile.close()
+            self._samplesfile = None
+        self._samplering.close()
+        self._samplering = None
+
     def callRemoteStart(self):
         # call remote instance "remoteStart()"
         if not self._remoteinstance:
@@ -395,12 +560,25 @@ class DBusTest(Test, dbus.service.Object):
         info("%s", self.uuid)
         self.ping()
 
-    ## DBUS Signals for proxies
+    def _remoteResultBatchCb(self, results):
+        info("%s %d results", self.uuid, len(results))
+        for kind, label, value in results:
+            if kind == "checklist":
+                validate, desc = value
+                self._remoteValidateChecklistItemCb(label, validate, desc)
+            elif kind == "extra-info":
+                self._remoteExtraInfoCb(label, value)
+            elif kind == "ping":
+                self._remotePingCb()
+            else:
+                warning("%s unknown result kind %r", self.uuid, kind)
 
-    def _newRemoteTest(self, testrun, uuid):
-        if not uuid == self.uuid:
-            return
+    ## DBUS Signals for proxies
 
+    def remoteAppeared(self):
+        """
+        Called by the TestRun when our remote counterpart has shown up.
+        """
         info("%s our remote counterpart has started", self.uuid)
         self.validateChecklistItem("dbus-process-connected")
         self._subprocessconnecttime = time.time()
@@ -413,7 +591,7 @@ class DBusTest(Test, dbus.service.Object):
         rname = "net.gstreamer.Insanity.Test.Test%s" % self.uuid
         rpath = "/net/gstreamer/Insanity/Test/Test%s" % self.uuid
         # get the proxy object to our counterpart
-        remoteobj = self._bus.get_object(rname, rpath)
+        remoteobj = self._testrun.getRemoteObject(rname, rpath)
         debug("Got remote runner object %r" % remoteobj)
         # call createTestInstance()
         remoterunner = dbus.Interface(remoteobj,
@@ -432,15 +610,17 @@ class DBusTest(Test, dbus.service.Object):
                                                    self._remoteExtraInfoCb)
             self._remoteinstance.connect_to_signal("remotePingSignal",
                                                    self._remotePingCb)
+            self._remoteinstance.connect_to_signal("remoteResultBatchSignal",
+                                                   self._remoteResultBatchCb)
             self.callRemoteSetUp()
         except:
             exception("Exception raised when creating remote instance !")
             self.stop()
 
-    def _removedRemoteTest(self, testrun, uuid):
-        if not uuid == self.uuid:
-            return
-
+    def remoteRemoved(self):
+        """
+        Called by the TestRun when our remote counterpart has gone away.
+        """
         info("%s our remote counterpart has left", self.uuid)
         # abort if the test hasn't actually finished
         self._remoteinstance = None
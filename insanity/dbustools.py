@@ -34,6 +34,7 @@ D-Bus convenience methods and classes
 #
 
 from dbus.bus import BusConnection
+from dbus.server import Server
 from dbus.mainloop.glib import DBusGMainLoop
 import tempfile
 import subprocess
@@ -115,6 +116,19 @@ def get_private_bus_address():
         private_bus = BusConnection(private_bus_address, mainloop=gml)
     return private_bus_address
 
+def create_peer_server():
+    """
+    Create a D-Bus server that test instances can connect to directly,
+    without going through the private dbus daemon.
+
+    The connections it gets are reported to the callables in its
+    on_connection_added and on_connection_removed lists.
+    """
+    address = "unix:tmpdir=%s" % tempfile.gettempdir()
+    debug("Creating peer-to-peer server on %s" % address)
+    gml = DBusGMainLoop()
+    return Server(address, mainloop=gml)
+
 def unwrap(x):
     """Hack to unwrap D-Bus values, so that they're easier to read when
     printed."""
@@ -34,6 +34,7 @@ import imp
 import gobject
 gobject.threads_init()
 from insanity.log import debug, exception
+import insanity.utils as utils
 
 def _tupletostr(atup):
     return ".".join([str(x) for x in atup])
@@ -44,10 +45,7 @@ def _tupletostr(atup):
 #   env variablse
 #   pluggable env retrievers
 #   Application should be able to add information of its own
-def _pollSubProcess(process, resfile, callback):
-    res = process.poll()
-    if res == None:
-        return True
+def _subProcessExited(returncode, resfile, callback):
     # get dictionnary from resultfile
     try:
         wmf = open(resfile, "rb")
@@ -59,7 +57,6 @@ def _pollSubProcess(process, resfile, callback):
         resdict = {}
     # call callback with dictionnary
     callback(resdict)
-    return False
 
 def collectEnvironment(environ, callback):
     """
@@ -91,7 +88,7 @@ def collectEnvironment(environ, callback):
         os.remove(respath)
         callback({})
     else:
-        gobject.timeout_add(500, _pollSubProcess, proc, respath, callback)
+        utils.watch_process(proc, _subProcessExited, respath, callback)
 
 def _getGObjectEnvironment():
     d = {}
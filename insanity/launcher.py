@@ -0,0 +1,222 @@
+# GStreamer QA system
+#
+#       launcher.py
+#
+# Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+"""
+Launcher processes
+
+A launcher is a test binary started with --zygote or --host. It loads
+and connects to the private bus once, then provides a new test instance
+whenever it is asked for one, which saves the cost of starting the
+binary (and loading the plugin registry) for each instance:
+* a zygote forks a new process for each instance,
+* a host runs all its instances in its own process.
+"""
+
+import subprocess
+import weakref
+import dbus
+from insanity.log import error, warning, debug, info, exception
+import insanity.utils as utils
+
+LAUNCHER_NAME = "net.gstreamer.Insanity.Launcher.Launcher"
+LAUNCHER_PATH = "/net/gstreamer/Insanity/Launcher/Launcher"
+LAUNCHER_INTERFACE = "net.gstreamer.Insanity.Launcher"
+
+class Launcher(object):
+    """
+    A running launcher process for a given test binary.
+
+    Requests made before the launcher has shown up on the bus are
+    queued until it does.
+    """
+
+    mode = None
+
+    def __init__(self, testrun, path, env, cwd):
+        self.uuid = utils.acquire_uuid()
+        self._testrun = testrun
+        self._launcher = None
+        self._pending = []
+        pargs = [path, "--run", "--" + self.mode, "--dbus-uuid=" + self.uuid]
+        info("opening %s %r", self.mode, pargs)
+        self.process = subprocess.Popen(pargs, env=env, cwd=cwd)
+        utils.watch_process(self.process, self._processExited)
+
+    def isAlive(self):
+        return self.process.returncode is None
+
+    def launcherAppeared(self):
+        """
+        Called by the TestRun once the launcher is on the bus.
+        """
+        info("%s %s is ready", self.mode, self.uuid)
+        remoteobj = self._testrun.getRemoteObject(LAUNCHER_NAME + self.uuid,
+                                                  LAUNCHER_PATH + self.uuid)
+        self._launcher = dbus.Interface(remoteobj, LAUNCHER_INTERFACE)
+        self._connectSignals()
+        pending = self._pending
+        self._pending = []
+        for uuid, callback, errback in pending:
+            self._request(uuid, callback, errback)
+
+    def newInstance(self, uuid, callback, errback):
+        """
+        Asks for a new test instance, which will register on the bus
+        with the given uuid.
+
+        callback is called with a process-like object (with pid,
+        returncode and poll()) once done, errback with the exception
+        if that failed.
+        """
+        if self._launcher:
+            self._request(uuid, callback, errback)
+        else:
+            self._pending.append((uuid, callback, errback))
+
+    def stop(self):
+        info("stopping %s %s", self.mode, self.uuid)
+        if self.isAlive():
+            utils.terminate_process(self.process)
+        utils.release_uuid(self.uuid)
+
+    def _connectSignals(self):
+        pass
+
+    def _processExited(self, returncode):
+        info("%s %s exited with %r", self.mode, self.uuid, returncode)
+
+    def _request(self, uuid, callback, errback):
+        raise NotImplementedError
+
+class ZygoteProcess(object):
+    """
+    A test process forked by a Zygote.
+
+    It has the parts of subprocess.Popen the tests use: pid, returncode
+    and poll(). As the process is not our child, the zygote tells when
+    it exits.
+    """
+
+    def __init__(self, pid):
+        self.pid = pid
+        self.returncode = None
+
+    def poll(self):
+        return self.returncode
+
+class Zygote(Launcher):
+    """
+    A zygote, forking a new process for each test instance.
+    """
+
+    mode = "zygote"
+
+    def __init__(self, *args, **kwargs):
+        Launcher.__init__(self, *args, **kwargs)
+        # pid => ZygoteProcess
+        self._children = {}
+        # pid => returncode, for children which exited before the
+        # reply to remoteFork came
+        self._exited = {}
+
+    def _connectSignals(self):
+        self._launcher.connect_to_signal("remoteChildExitSignal",
+                                         self._remoteChildExitCb)
+
+    def _request(self, uuid, callback, errback):
+        def reply(pid):
+            child = ZygoteProcess(int(pid))
+            debug("zygote %s forked %d for %s", self.uuid, child.pid, uuid)
+            callback(child)
+            if child.pid in self._exited:
+                utils.process_exited(child, self._exited.pop(child.pid))
+            else:
+                self._children[child.pid] = child
+        self._launcher.remoteFork(uuid, reply_handler=reply,
+                                  error_handler=errback)
+
+    def _remoteChildExitCb(self, pid, returncode):
+        child = self._children.pop(int(pid), None)
+        if child:
+            utils.process_exited(child, int(returncode))
+        else:
+            self._exited[int(pid)] = int(returncode)
+
+    def _processExited(self, returncode):
+        Launcher._processExited(self, returncode)
+        # the status of the remaining children is gone with the zygote
+        children = self._children
+        self._children = {}
+        for child in children.itervalues():
+            warning("Lost the status of %d with the zygote", child.pid)
+            utils.process_exited(child, -1)
+
+class HostedProcess(object):
+    """
+    A test instance running inside a Host.
+
+    It has the parts of subprocess.Popen the tests use, describing the
+    host process. It must not be killed, as the host carries on with
+    its other instances, and the host tells when it exits.
+    """
+
+    shared = True
+
+    def __init__(self, host):
+        self.pid = host.process.pid
+        self.returncode = None
+
+    def poll(self):
+        return self.returncode
+
+class Host(Launcher):
+    """
+    A host, running test instances side by side in its own process.
+    """
+
+    mode = "host"
+
+    def __init__(self, *args, **kwargs):
+        Launcher.__init__(self, *args, **kwargs)
+        # the instances the tests still hold
+        self._instances = weakref.WeakSet()
+
+    def _processExited(self, returncode):
+        Launcher._processExited(self, returncode)
+        instances = list(self._instances)
+        self._instances.clear()
+        for instance in instances:
+            utils.process_exited(instance, returncode)
+
+    def _request(self, uuid, callback, errback):
+        def reply(success):
+            if not success:
+                errback(Exception("host %s could not create an instance" % self.uuid))
+                return
+            debug("host %s created instance %s", self.uuid, uuid)
+            instance = HostedProcess(self)
+            if self.isAlive():
+                self._instances.add(instance)
+            else:
+                instance.returncode = self.process.returncode
+            callback(instance)
+        self._launcher.remoteCreateInstance(uuid, reply_handler=reply,
+                                            error_handler=errback)
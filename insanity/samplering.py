@@ -0,0 +1,146 @@
+# GStreamer QA system
+#
+#       samplering.py
+#
+# Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+"""
+Shared memory ring of samples
+
+Tests report high frequency data with insanity_test_emit_sample(),
+which writes fixed size records to memory shared with the runner
+instead of sending D-Bus signals. The runner creates the ring, hands
+its file descriptor to the test at remoteSetUp, and reads the records
+back as they are published.
+
+The layout must match the one in lib/insanity/insanitytest.c:
+* a 192 bytes header, with three 64 bytes lines:
+  - magic, version, record size, capacity (uint32 each)
+  - head, dropped (uint64 each), written by the test
+  - tail (uint64), written by the runner
+* capacity records of 64 bytes: seq (uint64, position + 1 once the
+  record is published), timestamp (int64, monotonic microseconds),
+  value (double), label (40 bytes, zero terminated)
+
+Python has no atomic loads or stores, so the runner side relies on the
+ordering of plain memory accesses of x86 and x86-64: a record's seq is
+read before the rest of it, and loads are not reordered with older
+loads, so a published seq means its payload is there too. The same goes
+for the records being read before tail is written back. On weakly
+ordered CPUs, like ARM, this is not guaranteed.
+"""
+
+import os
+import mmap
+import struct
+import ctypes
+import tempfile
+from insanity.log import debug
+
+MAGIC = 0x52534e49
+VERSION = 1
+HEADER_SIZE = 192
+RECORD_SIZE = 64
+DROPPED_OFFSET = 72
+TAIL_OFFSET = 128
+
+_header = struct.Struct("=IIII")
+_u64 = struct.Struct("=Q")
+# a record after its seq
+_payload = struct.Struct("=qd40s")
+
+def _create_fd(size):
+    # prefer an anonymous memfd, which never touches the file system
+    try:
+        memfd_create = ctypes.CDLL(None, use_errno=True).memfd_create
+    except AttributeError:
+        memfd_create = None
+    fd = -1
+    if memfd_create:
+        fd = memfd_create("insanity-samples", 0)
+    if fd < 0:
+        shmdir = "/dev/shm"
+        if not os.path.isdir(shmdir):
+            shmdir = None
+        fd, path = tempfile.mkstemp(prefix="insanity-samples-", dir=shmdir)
+        os.unlink(path)
+    os.ftruncate(fd, size)
+    return fd
+
+class SampleRing(object):
+    """
+    A ring of samples, read by the runner.
+    """
+
+    def __init__(self, capacity=4096):
+        """
+        capacity : number of records, must be a power of two
+        """
+        assert capacity and not capacity & (capacity - 1)
+        self.capacity = capacity
+        size = HEADER_SIZE + capacity * RECORD_SIZE
+        self._fd = _create_fd(size)
+        self._map = mmap.mmap(self._fd, size)
+        _header.pack_into(self._map, 0, MAGIC, VERSION, RECORD_SIZE, capacity)
+        self._tail = 0
+        debug("Created sample ring of %d records", capacity)
+
+    def fileno(self):
+        """
+        Returns the file descriptor to hand to the test.
+        """
+        return self._fd
+
+    def drain(self):
+        """
+        Returns the published samples not read yet, as a list of
+        (timestamp, label, value) tuples, timestamps being in
+        microseconds.
+        """
+        samples = []
+        tail = self._tail
+        while True:
+            offset = HEADER_SIZE + (tail & (self.capacity - 1)) * RECORD_SIZE
+            # seq first, see the module docs
+            seq = _u64.unpack_from(self._map, offset)[0]
+            if seq != tail + 1:
+                break
+            timestamp, value, label = _payload.unpack_from(self._map,
+                                                           offset + 8)
+            samples.append((timestamp, label.split("\0", 1)[0], value))
+            tail += 1
+        if tail != self._tail:
+            # hands the records back to the test
+            self._tail = tail
+            _u64.pack_into(self._map, TAIL_OFFSET, tail)
+        return samples
+
+    def getDropped(self):
+        """
+        Returns how many samples the test could not write because the
+        ring was full.
+        """
+        return _u64.unpack_from(self._map, DROPPED_OFFSET)[0]
+
+    def close(self):
+        if self._map:
+            self._map.close()
+            self._map = None
+        if self._fd >= 0:
+            os.close(self._fd)
+            self._fd = -1
@@ -543,6 +543,62 @@ class DBStorage(DataStorage, AsyncStorage):
             res = tmp
         return res
 
+    def getTestDurations(self, testtype, limit=1000):
+        """
+        Returns the durations of the last 'limit' iterations of the given
+        test type, as a list of (arguments dictionnary, seconds).
+
+        The duration of an iteration is its run-duration extra info when
+        the test reports it, else its test-iteration-duration. An instance
+        may run several iterations with different arguments, so its
+        test-total-duration is not used.
+        """
+        ttid = self._getTestTypeID(testtype)
+        if ttid == None:
+            return []
+        # an iteration has at most both durations
+        searchstr = """
+        SELECT test.id, testclassinfo_extrainfo_dict.name,
+        test_extrainfo_dict.intvalue
+        FROM test, test_extrainfo_dict, testclassinfo_extrainfo_dict
+        WHERE test.type=? AND test.ismonitor=0 AND
+        test_extrainfo_dict.containerid=test.id AND
+        test_extrainfo_dict.name=testclassinfo_extrainfo_dict.id AND
+        testclassinfo_extrainfo_dict.name IN ('run-duration', 'test-iteration-duration') AND
+        test_extrainfo_dict.intvalue IS NOT NULL
+        ORDER BY test.id DESC LIMIT ?"""
+        # nanoseconds and milliseconds
+        scales = { "run-duration" : 1e-9, "test-iteration-duration" : 1e-3 }
+        durations = {}
+        for testid, name, value in self._FetchAll(searchstr, (ttid, 2 * limit)):
+            if testid in durations and name != "run-duration":
+                continue
+            if not testid in durations and len(durations) >= limit:
+                continue
+            durations[testid] = value * scales[name]
+        if not durations:
+            return []
+
+        # the arguments of all those iterations, in one query
+        argsearch = """
+        SELECT test.id, testclassinfo_arguments_dict.name,
+        test_arguments_dict.intvalue, test_arguments_dict.txtvalue
+        FROM test, test_arguments_dict, testclassinfo_arguments_dict
+        WHERE test.type=? AND test.ismonitor=0 AND test.id>=? AND
+        test_arguments_dict.containerid=test.id AND
+        test_arguments_dict.name=testclassinfo_arguments_dict.id"""
+        arguments = dict([(testid, {}) for testid in durations])
+        for testid, n, iv, tv in self._FetchAll(argsearch,
+                                                (ttid, min(durations))):
+            if not testid in arguments:
+                continue
+            if iv != None:
+                arguments[testid][n] = iv
+            else:
+                arguments[testid][n] = tv
+        return [(arguments[testid], duration)
+                for testid, duration in durations.iteritems()]
+
     # Methods to be implemented in subclasses
     # DBAPI implementation specific
 
@@ -130,7 +130,9 @@ class Test(gobject.GObject):
         "test-setup-duration" :
         "How long it took to setup the test (in milliseconds) for asynchronous tests",
         "test-total-duration" :
-        "How long it took to run the entire test (in milliseconds)"
+        "How long it took to run the entire test (in milliseconds)",
+        "test-iteration-duration" :
+        "How long it took to run this iteration of the test (in milliseconds)"
         }
     """
     Dictionnary of extra information this test can produce.
@@ -235,6 +237,7 @@ class Test(gobject.GObject):
         # time at which events started
         self._asyncstarttime = 0
         self._teststarttime = 0
+        self._iterationstarttime = 0
         # time at which the timeouts should occur,
         # we store this in order to modify timeouts while
         # running
@@ -416,6 +419,9 @@ class Test(gobject.GObject):
             self._testtimeoutid = 0
             notimeout = True
         self.validateChecklistItem("no-timeout", notimeout)
+        if self._iterationstarttime:
+            self.extraInfo("test-iteration-duration",
+                           int((time.time() - self._iterationstarttime) * 1000))
         self.iteration_checklist[self._iteration] = self._checklist
         self.iteration_extrainfo[self._iteration] = self._extrainfo
         self.iteration_outputfiles[self._iteration] = self._outputfiles
@@ -431,6 +437,7 @@ class Test(gobject.GObject):
         # if we were doing async setup, remove asyncsetup timeout
         self._stopping = False
         self._iteration = self._iteration + 1
+        self._iterationstarttime = time.time()
 
         # Upon first start, we save checklist, etc so they can be copied
         # as base for each successive iteration, while keeping the state
@@ -483,9 +490,13 @@ class Test(gobject.GObject):
         # check for valid checkitem
         if not checkitem in self._possiblechecklist:
             return
-        # check to see if we don't already have it
-        if checkitem in dict(self._checklist):
-            return
+        # an item passes only if every result for it passed: a failure
+        # replaces an earlier pass, anything else is already known
+        previous = dict(self._checklist).get(checkitem)
+        if previous is not None:
+            if validated or not previous:
+                return
+            self._checklist.remove((checkitem, True))
         self._checklist.append((checkitem, bool(validated)))
 
         if not validated:
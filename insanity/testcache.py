@@ -0,0 +1,190 @@
+# GStreamer QA system
+#
+#       testcache.py
+#
+# Copyright (c) 2012, Vincent Penquerc'h <vincent@collabora.co.uk>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+"""
+On-disk cache of test metadata, shared by all programs scanning for tests
+"""
+
+import os
+import json
+import struct
+import tempfile
+import threading
+import Queue
+from insanity.log import info, warning
+from insanity.testmetadata import probe_metadata, read_elf_section, ProbeError, \
+     library_unchanged
+
+# bump when the format of the cache changes
+CACHE_VERSION = 2
+
+# most tests which are probed at once
+MAX_PROBES = 8
+
+def get_cache_filename():
+    cache_home = os.environ.get('XDG_CACHE_HOME')
+    if not cache_home:
+        cache_home = os.path.join(os.path.expanduser('~'), '.cache')
+    return os.path.join(cache_home, 'insanity', 'tests.json')
+
+def read_build_id(filename):
+    """
+    Returns the GNU build id of an ELF file as an hex string, or None.
+    """
+    note = read_elf_section(filename, '.note.gnu.build-id')
+    if not note or len(note) < 12:
+        return None
+    namesz, descsz, notetype = struct.unpack('=III', note[:12])
+    start = 12 + ((namesz + 3) & ~3)
+    return note[start:start + descsz].encode('hex') or None
+
+def get_identity(filename):
+    """
+    Returns what identifies a given build of a test binary, or None if
+    the file cannot be read. A rebuilt test may keep the same size and,
+    within the resolution of the file system, the same mtime, but its
+    build id changes.
+    """
+    try:
+        st = os.stat(filename)
+    except OSError:
+        return None
+    return [st.st_ino, st.st_size, st.st_mtime, read_build_id(filename)]
+
+class TestCache:
+    """
+    Maps test binaries to their metadata, or to None for files which
+    are not tests, so that only new or rebuilt binaries are probed.
+    """
+
+    def __init__(self, filename=None):
+        self.filename = filename or get_cache_filename()
+        self.entries = {}
+        self.changed = False
+        self.load()
+
+    def load(self):
+        try:
+            f = open(self.filename)
+            try:
+                data = json.load(f)
+            finally:
+                f.close()
+        except (IOError, ValueError):
+            return
+        if data.get("version") != CACHE_VERSION:
+            info('Ignoring test cache %s from another version', self.filename)
+            return
+        self.entries = data.get("tests", {})
+
+    def save(self):
+        """
+        Writes the cache if it changed. Several programs may share it, so
+        it is replaced atomically, and the last one to save wins.
+        """
+        if not self.changed:
+            return
+        directory = os.path.dirname(self.filename)
+        try:
+            if not os.path.isdir(directory):
+                os.makedirs(directory)
+            fd, tmpname = tempfile.mkstemp(dir=directory, prefix='.tests-')
+            f = os.fdopen(fd, 'w')
+            try:
+                json.dump({"version": CACHE_VERSION, "tests": self.entries}, f)
+            finally:
+                f.close()
+            os.rename(tmpname, self.filename)
+            self.changed = False
+        except (IOError, OSError), e:
+            warning('Failed to write test cache %s: %s', self.filename, e)
+
+    def lookup(self, filename, identity):
+        """
+        Returns (found, metadata) for the given build of a file. Metadata
+        is also stale once the libinsanity it came from changed, as most
+        of it comes from the library.
+        """
+        entry = self.entries.get(filename)
+        if entry == None or entry["identity"] != identity:
+            return (False, None)
+        metadata = entry["metadata"]
+        if metadata and library_unchanged(metadata) == False:
+            return (False, None)
+        return (True, metadata)
+
+    def store(self, filename, identity, metadata):
+        self.entries[filename] = {"identity": identity, "metadata": metadata}
+        self.changed = True
+
+    def probe(self, filenames):
+        """
+        Returns a dictionary mapping each file to its metadata, or None if
+        it is not a test. Files not in the cache are probed in parallel,
+        with at most MAX_PROBES at once. Files which could not be probed
+        are left out, and not cached, so they are probed again next time.
+        """
+        results = {}
+        misses = Queue.Queue()
+        lock = threading.Lock()
+
+        for filename in filenames:
+            identity = get_identity(filename)
+            if identity == None:
+                continue
+            found, metadata = self.lookup(filename, identity)
+            if found:
+                results[filename] = metadata
+            else:
+                misses.put((filename, identity))
+
+        def probe_misses():
+            while True:
+                try:
+                    filename, identity = misses.get_nowait()
+                except Queue.Empty:
+                    return
+                try:
+                    metadata = probe_metadata(filename)
+                except ProbeError, e:
+                    warning('%s, will probe it again next time', e)
+                    continue
+                lock.acquire()
+                try:
+                    results[filename] = metadata
+                    self.store(filename, identity, metadata)
+                finally:
+                    lock.release()
+
+        threads = [threading.Thread(target=probe_misses)
+                   for n in range(min(MAX_PROBES, misses.qsize()))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        # forget about files which are gone
+        for filename in self.entries.keys():
+            if not os.path.exists(filename):
+                del self.entries[filename]
+                self.changed = True
+
+        return results
@@ -25,82 +25,210 @@ Test metadata class
 
 import os
 import sys
+import errno
 import subprocess
 import signal
+import threading
 import json
+import struct
 from insanity.log import error, warning, debug, info, exception
 
+# ELF section test binaries may embed their metadata in, see tests/Makefile.am
+METADATA_SECTION = '.insanity_metadata'
+
+def read_elf_section(filename, name):
+    """
+    Returns the contents of the named section of an ELF file, or None
+    if the file is not ELF or does not have such a section.
+    """
+    try:
+        f = open(filename, 'rb')
+    except IOError:
+        return None
+    try:
+        try:
+            ident = f.read(16)
+            if len(ident) < 16 or ident[:4] != '\x7fELF':
+                return None
+            if ord(ident[4]) == 1:
+                header_format, section_format = 'HHIIIIIHHHHHH', 'IIIIIIIIII'
+            elif ord(ident[4]) == 2:
+                header_format, section_format = 'HHIQQQIHHHHHH', 'IIQQQQIIQQ'
+            else:
+                return None
+            order = ord(ident[5]) == 1 and '<' or '>'
+            header_format = order + header_format
+            section_format = order + section_format
+
+            header = struct.unpack(header_format,
+                f.read(struct.calcsize(header_format)))
+            shoff, shentsize, shnum, shstrndx = header[5], header[10], header[11], header[12]
+            if shoff == 0 or shnum == 0 or shstrndx >= shnum:
+                return None
+
+            f.seek(shoff)
+            table = f.read(shentsize * shnum)
+            size = struct.calcsize(section_format)
+            # (name offset, file offset, size) of each section
+            sections = []
+            for n in range(shnum):
+                s = struct.unpack(section_format,
+                    table[n * shentsize:n * shentsize + size])
+                sections.append((s[0], s[4], s[5]))
+
+            f.seek(sections[shstrndx][1])
+            names = f.read(sections[shstrndx][2])
+            for name_offset, offset, size in sections:
+                end = names.find('\0', name_offset)
+                if names[name_offset:end] == name:
+                    f.seek(offset)
+                    return f.read(size)
+            return None
+        except (struct.error, IOError, IndexError):
+            return None
+    finally:
+        f.close()
+
+class ProbeError(Exception):
+    """
+    Raised when a possible test could not be probed this time, as when it
+    timed out on a loaded machine, so whether it is a test is not known.
+    """
+    pass
+
+def library_unchanged(metadata):
+    """
+    Returns whether the libinsanity build the given metadata came from
+    is still in place, or None if the metadata does not tell which one
+    it was. Most of the metadata comes from the library rather than from
+    the test, and goes stale when the library changes.
+    """
+    library = metadata.get("__library__")
+    if not isinstance(library, dict) or not "filename" in library:
+        return None
+    try:
+        st = os.stat(library["filename"])
+    except OSError:
+        return False
+    return (st.st_size == library.get("size")
+            and int(st.st_mtime) == library.get("mtime"))
+
+def read_embedded_metadata(filename):
+    """
+    Returns the metadata embedded in the test binary at build time,
+    or None if there is none, or if it came from another build of
+    libinsanity than the one it would find now, in which case the test
+    must be run.
+    """
+    data = read_elf_section(filename, METADATA_SECTION)
+    if data == None:
+        return None
+    try:
+        metadata = json.loads(data.rstrip('\0'))
+    except Exception,e:
+        info('Exception loading embedded JSON metadata (%s)', e)
+        return None
+    if not library_unchanged(metadata):
+        info('Metadata embedded in %s is from another libinsanity', filename)
+        return None
+    info('Read metadata embedded in %s', filename)
+    return metadata
+
+def run_for_metadata(filename, timeout=5):
+    """
+    Runs a possible test to get its metadata. The process is killed if
+    it does not exit within timeout seconds. This does not rely on
+    signals, so it may be called from any thread.
+
+    Returns None if it is not a test, and raises ProbeError if that could
+    not be told: the file could not be run for a reason other than not
+    being executable, it timed out, or it was killed.
+    """
+    info ('Running %s, which might be a test', filename)
+    try:
+        process = subprocess.Popen([filename, '--insanity-metadata'],
+            stdin = None, stdout = subprocess.PIPE, stderr = subprocess.PIPE,
+            universal_newlines=True, preexec_fn = os.setsid,
+            # probes run in parallel, and must not keep each other's
+            # pipes open
+            close_fds = True)
+    except OSError, e:
+        if e.errno in (errno.EACCES, errno.ENOEXEC):
+            info('Cannot execute %s (%s), not a test', filename, e)
+            return None
+        raise ProbeError('Failed to run %s (%s)' % (filename, e))
+
+    # kills any children too, which would keep the output open
+    timed_out = []
+    def timeout_handler():
+        timed_out.append(True)
+        try:
+            os.killpg(process.pid, signal.SIGKILL)
+        except OSError:
+            pass
+
+    timer = threading.Timer(timeout, timeout_handler)
+    timer.start()
+    try:
+        output = process.communicate()[0]
+    finally:
+        timer.cancel()
+    if timed_out:
+        raise ProbeError('Timeout running possible test %r' % filename)
+    if process.returncode < 0:
+        raise ProbeError('Possible test %r was killed by signal %d'
+                         % (filename, -process.returncode))
+
+    lines = output.split('\n', 1)
+    if len(lines) < 2 or not 'Insanity test metadata:' in lines[0]:
+        info('No magic, not a test')
+        return None
+
+    try:
+        metadata = json.loads(lines[1]);
+    except Exception,e:
+        info('Exception loading JSON metadata (%s), not a test', e)
+        return None
+    return metadata
+
+def probe_metadata(filename):
+    """
+    Returns the metadata of a test binary, or None if it is not a test.
+    Raises ProbeError if this could not be told this time.
+    """
+    if not "insanity-test-" in filename:
+        return None
+    metadata = read_embedded_metadata(filename)
+    if metadata == None:
+        metadata = run_for_metadata(filename)
+    if metadata == None:
+        return None
+    if not metadata:
+        info('Empty metadata, not a test')
+        return None
+    if not "__name__" in metadata or not "__description__" in metadata:
+        info('Partial metadata, probably a broken or obsolete test')
+        return None
+    return metadata
+
 class TestMetadata():
     """
     Gathers metadata from a test binary, which can then be used
     by other code without instanciating the test object.
+
+    If metadata is given, as from a cache, the binary is not probed.
     """
 
-    def __init__(self, filename, *args, **kwargs):
-        if not self.probe_test (filename):
+    def __init__(self, filename, metadata=None, *args, **kwargs):
+        if metadata == None:
+            metadata = probe_metadata(filename)
+        if metadata == None:
             raise Exception ('Not a test')
+        self.load_metadata(filename, metadata)
 
-    def probe_test(self, filename):
-        if not "insanity-test-" in filename:
-            return False
-        info ('Running %s, which might be a test', filename)
-        try:
-            process = subprocess.Popen([filename, '--insanity-metadata'],
-                stdin = None, stdout = subprocess.PIPE, stderr = subprocess.PIPE,
-                universal_newlines=True)
-        except Exception,e:
-            info('Exception running process (%s), not a test', e)
-            return False
-        if process == None:
-            info('Failed to create process, not a test')
-            return False
-        if process.stdin:
-            process.stdin.close()
-        if process.stderr:
-            process.stderr.close()
-
-        def timeout_handler(signum, frame):
-            raise Exception()
- 
-        old_handler = signal.signal(signal.SIGALRM, timeout_handler) 
-        signal.alarm(5)
-
-        lines=""
-        try:
-            line=process.stdout.readline()
-            if not line or not 'Insanity test metadata:\n' in line:
-                 info('No magic, not a test')
-                 process.stdout.close()
-                 return False
-            line=process.stdout.readline()
-            while line:
-                lines = lines + line
-                line = process.stdout.readline()
-        except:
-            process.stdout.close()
-            signal.signal(signal.SIGALRM, old_handler)
-            exception("Timeout running possible test '%r'", filename)
-            return FALSE
-        signal.signal(signal.SIGALRM, old_handler)
-        signal.alarm(0)
-
-        process.stdout.close()
-
-        try:
-            metadata = json.loads(lines);
-        except Exception,e:
-            info('Exception loading JSON metadata (%s), not a test', e)
-            return False
-        if not metadata:
-            info('Empty metadata, not a test')
-            return False
-        if not "__name__" in metadata or not "__description__" in metadata:
-            info('Partial metadata, probably a broken or obsolete test')
-            return False
-
-        # TODO: need to wait at most a second or so, then kill any process that's not dead yet
-        #kill_process(process)
+    def load_metadata(self, filename, metadata):
         self.__test_filename__ = os.path.abspath(filename)
+        self.__test_metadata__ = metadata
         self.__test_name__ = self.get_metadata (metadata, "__name__")
         self.__test_description__ = self.get_metadata (metadata, "__description__")
         self.__test_full_description__ = self.get_metadata (metadata, "__full_description__")
@@ -108,6 +236,8 @@ class TestMetadata():
         self.__test_output_files__ = self.get_metadata (metadata, "__output_files__")
         self.__test_checklist__ = self.get_metadata (metadata, "__checklist__")
         self.__test_extra_infos__ = self.get_metadata (metadata, "__extra_infos__")
+        self.__test_samples__ = self.get_metadata (metadata, "__samples__")
+        self.__test_launch_modes__ = self.get_metadata (metadata, "__launch_modes__") or ["spawn"]
         info('It is a valid test')
 
         mod = sys.modules["insanity.dbustest"]
@@ -115,7 +245,6 @@ class TestMetadata():
         # get class
         cls = mod.__dict__.get("DBusTest")
         self.__test_class__ = cls
-        return True
 
     def get_metadata(self, metadata, key):
         if not key in metadata:
@@ -172,5 +301,16 @@ class TestMetadata():
         dc = self.__test_class__.getClassFullOutputFilesList()
         if self.__test_output_files__ != None:
             dc.update(self.__test_output_files__)
+        if self.__test_samples__:
+            # written by the runner from the sample ring
+            dc["samples-file"] = {
+                "description": "Samples emitted by the test, one per line as: time in microseconds,label,value",
+                "global": True}
         return dc
 
+    def getFullSampleList(self):
+        """
+        Returns the full list of samples with descriptions.
+        """
+        return self.__test_samples__ or {}
+
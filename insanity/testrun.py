@@ -40,11 +40,15 @@ import time
 import dbus.gobject_service
 import tempfile
 import os
+import heapq
+import multiprocessing
 from insanity.log import error, warning, debug, info
 from insanity.test import Test, PythonDBusTest
 from insanity.arguments import Arguments
 import insanity.environment as environment
 import insanity.dbustools as dbustools
+import insanity.utils as utils
+import insanity.launcher as launcher
 
 ##
 ## TODO/FIXME
@@ -53,6 +57,57 @@ import insanity.dbustools as dbustools
 ##   This will be needed to run test with different environments
 ##   WITHOUT having to restart the daemon.
 
+class _Batch(object):
+    """
+    A test with its arguments and monitors, run by one or more instances
+    """
+    def __init__(self, test, arguments, monitors, maxinstances):
+        self.test = test
+        self.arguments = arguments
+        self.monitors = monitors
+        self.maxinstances = maxinstances
+        # instances currently running
+        self.running = 0
+        self.failed = False
+
+class _PlannedArguments(object):
+    """
+    The arguments of a batch in a fixed order, each with its predicted
+    duration. Can be used in place of the batch's Arguments.
+    """
+    def __init__(self, planned):
+        # list of (duration, arguments), longest first
+        self.planned = planned
+        self.position = 0
+
+    def __iter__(self):
+        return self
+
+    def next(self):
+        if self.position >= len(self.planned):
+            raise StopIteration
+        self.position += 1
+        return self.planned[self.position - 1][1]
+
+    def __len__(self):
+        return len(self.planned)
+
+    def current(self):
+        return self.position
+
+    def nextDuration(self):
+        return self.planned[self.position][0]
+
+def _argumentsFingerprint(arguments, names):
+    """
+    Identifies a combination of arguments, only using those in names
+    """
+    return tuple(sorted([(k, unicode(v)) for k, v in arguments.iteritems()
+                         if k in names]))
+
+def _mean(values):
+    return sum(values) / len(values)
+
 class TestRun(gobject.GObject):
     """
     A TestRun is the execution of one or more tests/scenarios with various
@@ -91,6 +146,7 @@ class TestRun(gobject.GObject):
 
         # new-remote-test (uuid)
         #  emitted when a new test has appeared on the private bus
+        #  (tests added with addRemoteTest() are told directly)
         "new-remote-test" : (gobject.SIGNAL_RUN_LAST,
                              gobject.TYPE_NONE,
                              (gobject.TYPE_STRING, )),
@@ -99,11 +155,28 @@ class TestRun(gobject.GObject):
                                  (gobject.TYPE_STRING, ))
         }
 
-    def __init__(self, maxnbtests=1, workingdir=None, env=None, clientid=None):
+    def __init__(self, maxnbtests=None, workingdir=None, env=None, clientid=None,
+                 launcher="spawn", peer=False, schedule="submission"):
         """
-        maxnbtests : Maximum number of tests to run simultaneously in each batch.
+        maxnbtests : Maximum number of test instances to run simultaneously,
+                     over all batches (default : the number of CPUs)
         workingdir : Working directory (default : getcwd() + /workingdir/)
         env : extra environment variables
+        launcher : how remote test processes are started:
+          "spawn" : a new process for every test instance
+          "worker" : reuse idle processes of the same test binary when
+                     the test supports it
+          "zygote" : fork processes from a preloaded instance of the test
+                     binary when the test supports it
+          "host" : run instances side by side in one process of the test
+                   binary when the test supports it
+        peer : if True, remote test processes connect straight to this
+               TestRun instead of going through the private bus
+        schedule : the order arguments of the tests are run in:
+          "submission" : the order the tests were added in
+          "duration" : longest first, as predicted from the durations of
+                       previous runs found in the storage, so that long
+                       tests do not start last and delay the end of the run
         """
         gobject.GObject.__init__(self)
         # dbus
@@ -111,18 +184,43 @@ class TestRun(gobject.GObject):
         self._bus_address = None
         self._dbusobject = None
         self._dbusiface = None
+        # peer-to-peer server, and the connection each object path
+        # was announced on
+        self._peer = peer
+        self._server = None
+        self._peerconnections = []
+        self._peers = {}
         self._setupPrivateBus()
 
-        self._tests = [] # list of (test, arguments, monitors)
+        self._tests = [] # list of _Batch, in the order they were added
+        # running or starting instance => _Batch
+        self._instancebatches = {}
+        self._schedulingid = None
+        self._schedule = schedule
+        self._predictedmakespan = None
         self._storage = None
         self._currenttest = None
         self._currentmonitors = None
         self._currentarguments = None
         self._runninginstances = []
+        if not maxnbtests:
+            try:
+                maxnbtests = multiprocessing.cpu_count()
+            except NotImplementedError:
+                maxnbtests = 1
         self._maxnbtests = maxnbtests
         self._starttime = None
         self._stoptime = None
         self._clientid = clientid
+        self._launcher = launcher
+        # idle worker processes, keyed by test binary and environment :
+        # key => list of (process, uuid of the last test it ran)
+        self._workers = {}
+        # zygotes and hosts, keyed by test binary and environment
+        self._launchers = {}
+        # tests waiting for or talking to their remote counterpart :
+        # uuid => test
+        self._remotetests = {}
         # disambiguation
         # _environment are the environment information
         # _environ are the environment variables (env)
@@ -159,7 +257,7 @@ class TestRun(gobject.GObject):
         """
         self._storage = storage
 
-    def addTest(self, test, arguments, monitors=None):
+    def addTest(self, test, arguments, monitors=None, maxinstances=None):
         """
         Adds test with the given arguments (or generator) and monitors
         to the list of tests to be run
@@ -167,6 +265,11 @@ class TestRun(gobject.GObject):
         monitors are a list of tuples containing:
         * the monitor class
         * (optional) the arguments to use on that monitor
+
+        Several instances of the test may run at once, each with its
+        own arguments. maxinstances limits how many instances of that
+        test run at once over all its batches, for tests which cannot
+        run many times side by side.
         """
         #if not isinstance(test, type) and not issubclass(test, Test):
         #    raise TypeError("Given test is not a Test object !")
@@ -177,7 +280,7 @@ class TestRun(gobject.GObject):
             arguments = Arguments(**arguments)
         elif not isinstance(arguments, Arguments):
             raise TypeError("Test arguments need to be of type Arguments or dict")
-        self._tests.append((test, arguments, monitors))
+        self._tests.append(_Batch(test, arguments, monitors, maxinstances))
 
     def getEnvironment(self):
         """
@@ -197,18 +300,72 @@ class TestRun(gobject.GObject):
                                          "org.freedesktop.DBus")
         self._dbusiface.connect_to_signal("NameOwnerChanged",
                                           self._dbusNameOwnerChangedSignal)
+        if self._peer:
+            self._setupPeerServer()
+
+    def _setupPeerServer(self):
+        # the private bus is still used by the client, only the test
+        # traffic goes through the server
+        self._server = dbustools.create_peer_server()
+        self._server.on_connection_added.append(self._peerConnectionAdded)
+        self._server.on_connection_removed.append(self._peerConnectionRemoved)
+        self._bus_address = self._server.address
+        info("Listening for tests on %s", self._bus_address)
+
+    def _peerConnectionAdded(self, conn):
+        self._peerconnections.append(conn)
+        # there are no bus names on a peer connection, objects announce
+        # their path themselves
+        conn.add_signal_receiver(
+            lambda path: self._peerObjectChanged(conn, path, True),
+            "remoteConnectedSignal", path_keyword="path")
+        conn.add_signal_receiver(
+            lambda path: self._peerObjectChanged(conn, path, False),
+            "remoteDisconnectedSignal", path_keyword="path")
+
+    def _peerConnectionRemoved(self, conn):
+        if conn in self._peerconnections:
+            self._peerconnections.remove(conn)
+        for path, c in self._peers.items():
+            if c is conn:
+                self._peerObjectChanged(conn, path, False)
+
+    def _peerObjectChanged(self, conn, path, connected):
+        info("path:%s, connected:%r" % (path, connected))
+        if connected:
+            self._peers[path] = conn
+        elif self._peers.pop(path, None) is None:
+            return
+        # same as the bus name the object would have on the bus
+        self._remoteNameChanged(path[1:].replace("/", "."), connected)
 
     def _dbusNameOwnerChangedSignal(self, name, oldowner, newowner):
-        # we only care about connections named net.gstreamer.Insanity.Test.xxx
         info("name:%s , oldowner:%s, newowner:%s" % (name, oldowner, newowner))
+        if newowner == "":
+            self._remoteNameChanged(name, False)
+        elif oldowner == "":
+            self._remoteNameChanged(name, True)
+
+    def _remoteNameChanged(self, name, appeared):
+        # we only care about connections named net.gstreamer.Insanity.Test.xxx
+        # and net.gstreamer.Insanity.Launcher.xxx
+        if name.startswith(launcher.LAUNCHER_NAME):
+            if appeared:
+                self._launcherAppeared(name[len(launcher.LAUNCHER_NAME):])
+            return
         if not name.startswith("net.gstreamer.Insanity.Test.Test"):
             return
         # extract uuid
         uuid = name.rsplit('.Test', 1)[-1]
-        if newowner == "":
-            self.emit("removed-remote-test", uuid)
-        elif oldowner == "":
+        test = self._remotetests.get(uuid)
+        if appeared:
+            if test:
+                test.remoteAppeared()
             self.emit("new-remote-test", uuid)
+        else:
+            if test:
+                test.remoteRemoved()
+            self.emit("removed-remote-test", uuid)
 
     def _collectEnvironment(self):
         """
@@ -222,7 +379,9 @@ class TestRun(gobject.GObject):
         self.emit("start")
         self._starttime = int(time.time())
         self._storage.startNewTestRun(self, self._clientid)
-        self._runNextBatch()
+        if self._schedule == "duration":
+            self._planBatches()
+        self._scheduleTests()
 
     def _singleTestStart(self, test, iteration):
         info("test %r started (%d)", test, iteration)
@@ -241,21 +400,159 @@ class TestRun(gobject.GObject):
         # FIXME : Improvement : disconnect all signals from that test
         if test in self._runninginstances:
             self._runninginstances.remove(test)
+        batch = self._instancebatches.pop(test, None)
+        if batch:
+            batch.running -= 1
         self._storage.newTestFinished(self, test)
-        self._runNextBatch()
+        # may be emitted from within test.run()
+        self._queueScheduling()
 
     def _singleTestCheck(self, test, check, validate):
         pass
 
-    def _runNext(self):
-        """ Run the next test+arg+monitor combination """
-        if len(self._runninginstances) >= self._maxnbtests:
-            warning("We were already running the max number of tests")
-            return False
+    def _batchHasArguments(self, batch):
+        return batch.arguments.current() < len(batch.arguments)
+
+    def _runningInstancesOf(self, test):
+        return sum([batch.running for batch in self._tests
+                    if batch.test is test])
 
-        # grab the next arguments
-        testclass = self._currenttest
-        monitors = self._currentmonitors
+    def _nextBatch(self):
+        """
+        Returns the first batch which has arguments left and room for
+        another instance, or None. When planned by duration, returns the
+        one whose next arguments are predicted to take longest instead.
+        """
+        best = None
+        for batch in self._tests:
+            if batch.failed or not self._batchHasArguments(batch):
+                continue
+            if batch.maxinstances and \
+                    self._runningInstancesOf(batch.test) >= batch.maxinstances:
+                continue
+            if not isinstance(batch.arguments, _PlannedArguments):
+                return batch
+            if best == None or batch.arguments.nextDuration() > \
+                    best.arguments.nextDuration():
+                best = batch
+        return best
+
+    def _getPastDurations(self, test):
+        """
+        Returns the durations of previous runs of the given test, by
+        arguments fingerprint.
+        """
+        if not hasattr(self._storage, "getTestDurations"):
+            return {}
+        names = test.getFullArgumentList().keys()
+        durations = {}
+        try:
+            past = self._storage.getTestDurations(test.__test_name__)
+        except Exception, e:
+            warning("Could not get past durations of %s: %s",
+                    test.__test_name__, e)
+            return {}
+        for arguments, duration in past:
+            fingerprint = _argumentsFingerprint(arguments, names)
+            durations.setdefault(fingerprint, []).append(duration)
+        return durations
+
+    def _planBatches(self):
+        """
+        Predicts the duration of all arguments of all batches from past
+        runs, and orders the arguments of each batch longest first.
+
+        Arguments never run before are predicted to take as long as the
+        average run of the same test, or of all tests if the test was
+        never run either.
+        """
+        plans = []
+        known = []
+        for batch in self._tests:
+            past = self._getPastDurations(batch.test)
+            testmean = None
+            if past:
+                testmean = _mean([_mean(d) for d in past.values()])
+                known.append(testmean)
+            names = batch.test.getFullArgumentList().keys()
+            planned = []
+            for arguments in iter(batch.arguments):
+                durations = past.get(_argumentsFingerprint(arguments, names))
+                planned.append([durations and _mean(durations) or testmean,
+                                arguments])
+            plans.append(planned)
+
+        fallback = known and _mean(known) or 1.0
+        allplanned = []
+        for batch, planned in zip(self._tests, plans):
+            for entry in planned:
+                if entry[0] == None:
+                    entry[0] = fallback
+            # stable, so equal durations keep their order
+            planned.sort(key=lambda entry: entry[0], reverse=True)
+            batch.arguments = _PlannedArguments([tuple(e) for e in planned])
+            allplanned.extend([entry[0] for entry in planned])
+
+        # the greedy schedule, longest first on the least busy slot,
+        # ignoring the per test instance limits
+        slots = [0.0] * self._maxnbtests
+        for duration in sorted(allplanned, reverse=True):
+            heapq.heappush(slots, heapq.heappop(slots) + duration)
+        self._predictedmakespan = max(slots)
+        info("Planned %d test iterations, predicted to take %.1fs",
+             len(allplanned), self._predictedmakespan)
+
+    def getMakespan(self):
+        """
+        Returns the predicted and actual durations of the run in seconds,
+        either of which may be None if not known (yet).
+        """
+        actual = None
+        if self._starttime != None and self._stoptime != None:
+            actual = self._stoptime - self._starttime
+        return (self._predictedmakespan, actual)
+
+    def _queueScheduling(self):
+        if self._schedulingid is None:
+            self._schedulingid = gobject.idle_add(self._scheduleTests)
+
+    def _scheduleTests(self):
+        """
+        Fills the free slots with instances drawn from all the pending
+        batches. Instances of a batch share its arguments, and each one
+        takes the next arguments when it starts an iteration, so a batch
+        is spread over as many instances as there are free slots.
+        """
+        self._schedulingid = None
+        while len(self._runninginstances) < self._maxnbtests:
+            batch = self._nextBatch()
+            if batch is None:
+                break
+            self._runNext(batch)
+
+        # forget batches whose last instance is done
+        self._tests = [batch for batch in self._tests
+                       if batch.running > 0 or
+                       (not batch.failed and self._batchHasArguments(batch))]
+        if len(self._tests) == 0 and len(self._runninginstances) == 0:
+            info("No more tests batch to run, we're done")
+            self._stopLaunchers()
+            self._stoptime = int(time.time())
+            self._storage.endTestRun(self)
+            self._running = False
+            predicted, actual = self.getMakespan()
+            if predicted != None:
+                info("Test run took %ds, predicted %.1fs", actual, predicted)
+            self.emit("done")
+        return False
+
+    def _runNext(self, batch):
+        """ Run a new instance of the given batch """
+        testclass = batch.test
+        monitors = batch.monitors
+        self._currenttest = batch.test
+        self._currentmonitors = batch.monitors
+        self._currentarguments = batch.arguments
 
         # create test with arguments
         kwargs={}
@@ -263,7 +560,7 @@ class TestRun(gobject.GObject):
         test = PythonDBusTest(testrun=self, bus=self._bus,
                          bus_address=self._bus_address,
                          metadata = testclass,
-                         test_arguments = self._currentarguments,
+                         test_arguments = batch.arguments,
                          **kwargs)
 #        test = testclass(testrun=self, bus=self._bus,
 #                         bus_address=self._bus_address,
@@ -277,49 +574,29 @@ class TestRun(gobject.GObject):
         test.connect("done", self._singleTestDone)
         test.connect("check", self._singleTestCheck)
 
+        batch.running += 1
+        self._instancebatches[test] = batch
+
         # start test
         allok = test.run()
         if allok:
             # add instance to running tests
             self._runninginstances.append(test)
+        else:
+            # as before, a batch whose instance cannot be run is skipped
+            warning("Failed to run test %r, skipping its batch", testclass)
+            batch.failed = True
+            if self._instancebatches.pop(test, None):
+                batch.running -= 1
 
-        warning("Just added a test %d/%d", len(self._runninginstances), self._maxnbtests)
-        # if we can still create a new test, call ourself again
-        if len(self._runninginstances) < self._maxnbtests:
-            warning("still more test to run (current:%d/max:%d)",
-                    len(self._runninginstances), self._maxnbtests)
-            gobject.idle_add(self._runNextBatch)
-        return False
-
-    def _runNextBatch(self):
-        """ Runs the next test batch """
-        if len(self._tests) == 0:
-            # if nothing left, stop
-            info("No more tests batch to run, we're done")
-            self._stoptime = int(time.time())
-            self._storage.endTestRun(self)
-            self._running = False
-            self.emit("done")
-            return False
-
-        info("Getting next test batch")
-        # pop out the next batch
-        test, args, monitors = self._tests.pop(0)
-        self._currenttest = test
-        self._currentmonitors = monitors
-        self._currentarguments = args
-
-        info("Current test : %r" % test)
-        info("Current monitors : %r" % monitors)
-        info("Current arguments : %r" % args)
-
-        # and run the first one of that batch
-        self._runNext()
-        return False
+        info("Running %d/%d tests", len(self._runninginstances),
+             self._maxnbtests)
+        return allok
 
     def getCurrentBatchPosition(self):
         """
-        Returns the position (index) in the current batch.
+        Returns the position (index) in the batch the last instance was
+        started from.
         """
         if self._currentarguments:
             return self._currentarguments.current()
@@ -327,12 +604,109 @@ class TestRun(gobject.GObject):
 
     def getCurrentBatchLength(self):
         """
-        Returns the size of the current batch.
+        Returns the size of the batch the last instance was started from.
         """
         if self._currentarguments:
             return len(self._currentarguments)
         return 0
 
+    def addRemoteTest(self, test):
+        """
+        Have test told when the remote counterpart with its uuid
+        appears or goes away, through its remoteAppeared() and
+        remoteRemoved() methods.
+        """
+        self._remotetests[test.uuid] = test
+
+    def removeRemoteTest(self, test):
+        """
+        Stop telling test about its remote counterpart.
+        """
+        if self._remotetests.get(test.uuid) is test:
+            del self._remotetests[test.uuid]
+
+    def isPeerToPeer(self):
+        """
+        Returns True if remote test processes connect straight to this
+        TestRun instead of going through the private bus.
+        """
+        return self._peer
+
+    def getRemoteObject(self, name, path):
+        """
+        Returns a proxy for the remote object with the given bus name
+        and object path, from the private bus or from the peer
+        connection it was announced on.
+        """
+        if self._peer:
+            return self._peers[path].get_object(None, path)
+        return self._bus.get_object(name, path)
+
+    def getLauncher(self):
+        """
+        Returns how remote test processes are started ("spawn", "worker",
+        "zygote", "host").
+        """
+        return self._launcher
+
+    def takeWorker(self, key):
+        """
+        Returns an idle worker process for the given key (test binary
+        and environment) as a (process, uuid) tuple, or None if there
+        are none left alive.
+        """
+        workers = self._workers.get(key, [])
+        while workers:
+            process, uuid = workers.pop()
+            if process.returncode is None:
+                return (process, uuid)
+            info("Worker %d for %s has exited", process.pid, key[0])
+        return None
+
+    def releaseWorker(self, key, process, uuid):
+        """
+        Gives back a worker process once its test instance is done with it.
+        uuid is the one the worker is currently registered with.
+        """
+        if process.returncode is not None:
+            return
+        self._workers.setdefault(key, []).append((process, uuid))
+
+    def getLauncherProcess(self, key, env, cwd):
+        """
+        Returns the zygote or host (depending on the launcher used) for
+        the given key (test binary and environment), starting it if there
+        is none running yet.
+        """
+        l = self._launchers.get(key)
+        if l is None or not l.isAlive():
+            if l:
+                warning("%s for %s has exited, starting a new one",
+                        l.mode, key[0])
+                l.stop()
+            if self._launcher == "zygote":
+                l = launcher.Zygote(self, key[0], env, cwd)
+            else:
+                l = launcher.Host(self, key[0], env, cwd)
+            self._launchers[key] = l
+        return l
+
+    def _launcherAppeared(self, uuid):
+        for l in self._launchers.itervalues():
+            if l.uuid == uuid:
+                l.launcherAppeared()
+                return
+
+    def _stopLaunchers(self):
+        for key, workers in self._workers.iteritems():
+            for process, uuid in workers:
+                info("Stopping worker %d for %s", process.pid, key[0])
+                utils.terminate_process(process)
+        self._workers = {}
+        for l in self._launchers.itervalues():
+            l.stop()
+        self._launchers = {}
+
     def getWorkingDirectory(self):
         """
         Returns the currently configured working directory for this
@@ -25,15 +25,17 @@ Miscellaneous utility functions and classes
 """
 
 import os
-import time
+import itertools
 import signal
 import subprocess
 import imp
 import urllib
 from random import randint
 import gzip
+import gobject
 from insanity.log import info, exception
 from insanity.testmetadata import TestMetadata
+from insanity.testcache import TestCache
 
 __uuids = []
 __tests = []
@@ -96,55 +98,149 @@ def list_available_scenarios():
     #return get_valid_subclasses(Scenario)
     return [] # hmm, need to look up how a scenario is different from a large test
 
-def kill_process(process):
-    tries = 10
-    returncode = None
-    while returncode is None and not tries == 0:
-        time.sleep(0.1)
-        returncode = process.poll()
-        tries -= 1
-        if returncode is None:
-            info("Process isn't done yet, terminating it")
-            os.kill(process.pid, signal.SIGTERM)
-            time.sleep(1)
-            returncode = process.poll()
-        if returncode is None:
-            info("Process did not terminate, killing it")
-            os.kill(process.pid, signal.SIGKILL)
-            time.sleep(1)
-            returncode = process.poll()
-        if returncode is None:
+__watchids = itertools.count(1)
+
+def _status_to_returncode(status):
+    # same convention as subprocess.Popen.returncode
+    if os.WIFSIGNALED(status):
+        return -os.WTERMSIG(status)
+    return os.WEXITSTATUS(status)
+
+def _process_watchers(process):
+    watchers = getattr(process, "_exitwatchers", None)
+    if watchers is None:
+        watchers = process._exitwatchers = {}
+        if isinstance(process, subprocess.Popen) and process.returncode is None:
+            # a single child watch per process, which reaps it
+            def child_exited(pid, status):
+                process_exited(process, _status_to_returncode(status))
+            gobject.child_watch_add(process.pid, child_exited)
+    return watchers
+
+def _notify_exit(process, watchid):
+    watcher = getattr(process, "_exitwatchers", {}).pop(watchid, None)
+    if watcher:
+        callback, args = watcher
+        callback(process.returncode, *args)
+    return False
+
+def watch_process(process, callback, *args):
+    """
+    Calls callback(returncode, *args) from the main loop once the given
+    process exits. Returns an id which can be given to unwatch_process.
+
+    Our own children are watched by GLib, which reaps them as soon as
+    they exit: from then on their status is in returncode, and poll()
+    must not be called on them anymore. Other process-like objects, like
+    instances forked by a zygote, are told about by their launcher,
+    which calls process_exited.
+    """
+    watchid = __watchids.next()
+    _process_watchers(process)[watchid] = (callback, args)
+    if process.returncode is not None:
+        gobject.idle_add(_notify_exit, process, watchid)
+    return watchid
+
+def unwatch_process(process, watchid):
+    """
+    Stops watching a process, the callback given to watch_process for
+    watchid will not be called.
+    """
+    getattr(process, "_exitwatchers", {}).pop(watchid, None)
+
+def process_exited(process, returncode):
+    """
+    Sets the returncode of an exited process and calls the callbacks
+    watching it.
+    """
+    if process.returncode is None:
+        process.returncode = returncode
+    for watchid in sorted(getattr(process, "_exitwatchers", {}).keys()):
+        _notify_exit(process, watchid)
+
+class _ProcessTerminator(object):
+
+    def __init__(self, process, callback, grace, timeout):
+        self._process = process
+        self._callback = callback
+        self._timeout = timeout
+        self._signals = [signal.SIGTERM, signal.SIGKILL]
+        self._watchid = watch_process(process, self._exited)
+        self._timeoutid = gobject.timeout_add(int(grace * 1000),
+                                              self._escalate)
+
+    def _escalate(self):
+        self._timeoutid = 0
+        if not self._signals:
             # Probably turned into zombie process, something is
             # really broken...
-            info("Process did not exit after SIGKILL")
-    return returncode
-
+            info("Process %d did not exit after SIGKILL", self._process.pid)
+            unwatch_process(self._process, self._watchid)
+            self._watchid = 0
+            self._finish(None)
+            return False
+        sig = self._signals.pop(0)
+        if sig == signal.SIGTERM:
+            info("Process %d isn't done yet, terminating it", self._process.pid)
+        else:
+            info("Process %d did not terminate, killing it", self._process.pid)
+        try:
+            os.kill(self._process.pid, sig)
+        except OSError:
+            # exited in the meantime, the watch will tell
+            pass
+        self._timeoutid = gobject.timeout_add(int(self._timeout * 1000),
+                                              self._escalate)
+        return False
 
-def scan_directory_for_tests(directory):
+    def _exited(self, returncode):
+        self._watchid = 0
+        if self._timeoutid:
+            gobject.source_remove(self._timeoutid)
+            self._timeoutid = 0
+        self._finish(returncode)
 
-    source_ext = [t[0] for t in imp.get_suffixes() if t[2] == imp.PY_SOURCE]
-    import_names = []
+    def _finish(self, returncode):
+        if self._callback:
+            self._callback(returncode)
 
-    for dirpath, dirnames, filenames in os.walk(directory):
+def terminate_process(process, callback=None, grace=0.1, timeout=1):
+    """
+    Stops a process without blocking the main loop.
 
-        for filename in filenames:
-            fullname = os.path.join(dirpath, filename)
-            try:
-                tm = TestMetadata (fullname)
-                import_names.append(tm)
-            except Exception, e:
-                info ( 'Exception: %s' % e)
-                pass
+    The process is given grace seconds to exit by itself, then sent
+    SIGTERM and, if it still runs timeout seconds later, SIGKILL.
+    callback is then called with its return code, or with None if it
+    did not even exit timeout seconds after SIGKILL.
+    """
+    _ProcessTerminator(process, callback, grace, timeout)
 
-        #for dirname in dirnames:
-        #    for ext in source_ext:
-        #        if os.path.exists(os.path.join(dirpath, dirname, "__init__%s" % (ext,))):
-        #            import_names.append(dirname)
+def scan_directory_for_tests(directory):
+    """
+    Returns the metadata of the tests in the given directory. Metadata
+    is cached on disk between runs, and only new or rebuilt tests are
+    probed.
+    """
+    filenames = []
+    for filename in sorted(os.listdir(directory)):
+        fullname = os.path.abspath(os.path.join(directory, filename))
+        # only tests are probed, see TestMetadata
+        if "insanity-test-" in filename and os.path.isfile(fullname):
+            filenames.append(fullname)
 
-        # Don't descent to subdirectories:
-        break
+    cache = TestCache()
+    metadata = cache.probe(filenames)
+    cache.save()
 
-    return import_names
+    tests = []
+    for filename in filenames:
+        if metadata.get(filename) == None:
+            continue
+        try:
+            tests.append(TestMetadata (filename, metadata[filename]))
+        except Exception, e:
+            info ( 'Exception: %s' % e)
+    return tests
 
 def scan_for_tests(directory = None):
     if directory == None:
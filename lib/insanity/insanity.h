@@ -26,6 +26,7 @@
 #include <insanity/insanitydefs.h>
 #include <insanity/insanitytest.h>
 #include <insanity/insanitythreadedtest.h>
+#include <insanity/insanityparalleltest.h>
 
 #endif
 
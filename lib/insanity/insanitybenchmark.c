@@ -0,0 +1,232 @@
+/* Insanity QA system
+
+       insanitybenchmark.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* Statistics over the iterations of a standalone benchmark run.
+
+   Every numeric extra info is collected once per measured iteration.
+   The median and median absolute deviation are computed over all the
+   values, the mean and standard deviation only over the values which
+   are not outliers, that is those whose modified z-score,
+   0.6745 * |x - median| / MAD, is at most 3.5. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUTLIER_Z_SCORE 3.5
+
+struct _Benchmark
+{
+  /* label -> GArray of doubles */
+  GHashTable *metrics;
+  /* the labels, in the order they were first recorded */
+  GPtrArray *labels;
+};
+
+typedef struct
+{
+  guint samples;
+  guint outliers;
+  double mean;
+  double stddev;
+  double median;
+  double mad;
+  double min;
+  double max;
+} BenchmarkSummary;
+
+Benchmark *
+benchmark_new (void)
+{
+  Benchmark *benchmark;
+
+  benchmark = g_slice_new (Benchmark);
+  benchmark->metrics = g_hash_table_new_full (&g_str_hash, &g_str_equal,
+      &g_free, (GDestroyNotify) & g_array_unref);
+  benchmark->labels = g_ptr_array_new ();
+  return benchmark;
+}
+
+void
+benchmark_free (Benchmark * benchmark)
+{
+  g_ptr_array_free (benchmark->labels, TRUE);
+  g_hash_table_destroy (benchmark->metrics);
+  g_slice_free (Benchmark, benchmark);
+}
+
+void
+benchmark_record (Benchmark * benchmark, const char *label, double value)
+{
+  GArray *values;
+  char *key;
+
+  values = g_hash_table_lookup (benchmark->metrics, label);
+  if (!values) {
+    key = g_strdup (label);
+    values = g_array_new (FALSE, FALSE, sizeof (double));
+    g_hash_table_insert (benchmark->metrics, key, values);
+    g_ptr_array_add (benchmark->labels, key);
+  }
+  g_array_append_val (values, value);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+
+  return (da > db) - (da < db);
+}
+
+/* values must be sorted */
+static double
+sorted_median (const double *values, guint n)
+{
+  if (n % 2)
+    return values[n / 2];
+  return (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static gboolean
+is_outlier (double x, double median, double mad)
+{
+  /* with a null MAD, anything away from the median is an outlier */
+  if (mad == 0)
+    return x != median;
+  return 0.6745 * fabs (x - median) / mad > OUTLIER_Z_SCORE;
+}
+
+static void
+summarize (GArray * values, BenchmarkSummary * summary)
+{
+  double *sorted, *deviations, x, sum = 0, sum2 = 0;
+  guint n = values->len, i, kept = 0;
+
+  memset (summary, 0, sizeof (*summary));
+  summary->samples = n;
+  if (n == 0)
+    return;
+
+  sorted = g_new (double, n);
+  memcpy (sorted, values->data, n * sizeof (double));
+  qsort (sorted, n, sizeof (double), &compare_doubles);
+  summary->min = sorted[0];
+  summary->max = sorted[n - 1];
+  summary->median = sorted_median (sorted, n);
+
+  deviations = g_new (double, n);
+  for (i = 0; i < n; ++i)
+    deviations[i] = fabs (sorted[i] - summary->median);
+  qsort (deviations, n, sizeof (double), &compare_doubles);
+  summary->mad = sorted_median (deviations, n);
+  g_free (deviations);
+
+  for (i = 0; i < n; ++i) {
+    x = sorted[i];
+    if (is_outlier (x, summary->median, summary->mad)) {
+      summary->outliers++;
+      continue;
+    }
+    sum += x;
+    sum2 += x * x;
+    kept++;
+  }
+  g_free (sorted);
+
+  summary->mean = sum / kept;
+  if (kept > 1)
+    summary->stddev = sqrt (MAX (0, (sum2 - sum * sum / kept) / (kept - 1)));
+}
+
+static void
+append_json_double (GString * s, double value)
+{
+  char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (isfinite (value))
+    g_string_append (s, g_ascii_dtostr (buffer, sizeof (buffer), value));
+  else
+    g_string_append (s, "null");
+}
+
+/* Writes a JSON report with a summary of each metric, and its values
+   in the order of the iterations */
+gboolean
+benchmark_write_report (Benchmark * benchmark, FILE * out,
+    const char *test_name, guint iterations, guint warmup)
+{
+  static const char *const fields[] = {
+    "mean", "stddev", "median", "mad", "min", "max"
+  };
+  BenchmarkSummary summary;
+  double stats[G_N_ELEMENTS (fields)];
+  GString *s;
+  GArray *values;
+  const char *label;
+  guint n, i;
+  gboolean ret;
+
+  s = g_string_new ("{\n  \"test\": ");
+  json_append_string (s, test_name);
+  g_string_append_printf (s, ",\n  \"iterations\": %u,\n  \"warmup\": %u,\n"
+      "  \"metrics\": {", iterations, warmup);
+
+  for (n = 0; n < benchmark->labels->len; ++n) {
+    label = g_ptr_array_index (benchmark->labels, n);
+    values = g_hash_table_lookup (benchmark->metrics, label);
+    summarize (values, &summary);
+    stats[0] = summary.mean;
+    stats[1] = summary.stddev;
+    stats[2] = summary.median;
+    stats[3] = summary.mad;
+    stats[4] = summary.min;
+    stats[5] = summary.max;
+
+    g_string_append (s, n ? ",\n    " : "\n    ");
+    json_append_string (s, label);
+    g_string_append_printf (s, ": {\"samples\": %u, \"outliers\": %u",
+        summary.samples, summary.outliers);
+    for (i = 0; i < G_N_ELEMENTS (fields); ++i) {
+      g_string_append_printf (s, ", \"%s\": ", fields[i]);
+      append_json_double (s, stats[i]);
+    }
+    g_string_append (s, ", \"values\": [");
+    for (i = 0; i < values->len; ++i) {
+      if (i)
+        g_string_append (s, ", ");
+      append_json_double (s, g_array_index (values, double, i));
+    }
+    g_string_append (s, "]}");
+  }
+  g_string_append (s, "\n  }\n}\n");
+
+  ret = fwrite (s->str, s->len, 1, out) == 1;
+  g_string_free (s, TRUE);
+  return ret;
+}
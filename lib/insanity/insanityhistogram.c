@@ -0,0 +1,185 @@
+/* Insanity QA system
+
+       insanityhistogram.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* Log-bucketed histograms, in the spirit of HdrHistogram.
+
+   Values below 2 * HISTOGRAM_SUB_BUCKETS each have their own bucket.
+   Above that, every power of two is split into HISTOGRAM_SUB_BUCKETS
+   buckets of equal width, so a value is known within about 3% whatever
+   its magnitude, with a fixed number of buckets covering all of guint64.
+
+   Recording only does atomic operations on one of HISTOGRAM_SHARDS
+   copies of the histogram, picked from the current thread, so threads
+   recording at the same time mostly do not touch the same cache lines.
+   The shards are merged when summarizing. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#include <string.h>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_SHARDS 8
+
+typedef struct
+{
+  guint64 min;
+  guint64 max;
+  gint buckets[HISTOGRAM_BUCKETS];
+} HistogramShard;
+
+struct _Histogram
+{
+  HistogramShard shards[HISTOGRAM_SHARDS];
+};
+
+static guint
+bucket_index (guint64 value)
+{
+  guint e;
+
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+    return value;
+
+  /* position of the highest bit, then the next HISTOGRAM_SUB_BUCKET_BITS
+     bits select the sub bucket */
+  e = g_bit_storage (value) - 1;
+  return (e - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_SUB_BUCKETS
+      + (value >> (e - HISTOGRAM_SUB_BUCKET_BITS));
+}
+
+/* The highest value that goes in a given bucket */
+static guint64
+bucket_value (guint index)
+{
+  guint e;
+  guint64 m;
+
+  if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+    return index;
+
+  e = index / HISTOGRAM_SUB_BUCKETS - 1 + HISTOGRAM_SUB_BUCKET_BITS;
+  m = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  return ((m + 1) << (e - HISTOGRAM_SUB_BUCKET_BITS)) - 1;
+}
+
+static void
+reset_shard (HistogramShard * shard)
+{
+  memset (shard->buckets, 0, sizeof (shard->buckets));
+  shard->min = G_MAXUINT64;
+  shard->max = 0;
+}
+
+Histogram *
+histogram_new (void)
+{
+  Histogram *histogram;
+  int n;
+
+  histogram = g_malloc (sizeof (Histogram));
+  for (n = 0; n < HISTOGRAM_SHARDS; ++n)
+    reset_shard (&histogram->shards[n]);
+  return histogram;
+}
+
+void
+histogram_free (Histogram * histogram)
+{
+  g_free (histogram);
+}
+
+void
+histogram_record (Histogram * histogram, guint64 value)
+{
+  HistogramShard *shard;
+  guintptr thread;
+  guint64 old;
+
+  thread = (guintptr) g_thread_self ();
+  shard = &histogram->shards[(thread / 64) % HISTOGRAM_SHARDS];
+
+  g_atomic_int_inc (&shard->buckets[bucket_index (value)]);
+
+  old = __atomic_load_n (&shard->min, __ATOMIC_RELAXED);
+  while (value < old && !__atomic_compare_exchange_n (&shard->min, &old,
+          value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  old = __atomic_load_n (&shard->max, __ATOMIC_RELAXED);
+  while (value > old && !__atomic_compare_exchange_n (&shard->max, &old,
+          value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Merges the shards into summary, and empties the histogram. Values
+   should not be recorded meanwhile. */
+void
+histogram_summarize (Histogram * histogram, HistogramSummary * summary)
+{
+  static const guint64 quantiles[] = { 500, 900, 990, 999 };
+  guint64 *percentiles[] = {
+    &summary->p50, &summary->p90, &summary->p99, &summary->p999
+  };
+  guint64 *counts, seen;
+  guint b, q;
+  int n;
+
+  counts = g_new0 (guint64, HISTOGRAM_BUCKETS);
+  memset (summary, 0, sizeof (*summary));
+  summary->min = G_MAXUINT64;
+
+  for (n = 0; n < HISTOGRAM_SHARDS; ++n) {
+    HistogramShard *shard = &histogram->shards[n];
+
+    for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+      counts[b] += (guint) shard->buckets[b];
+      summary->count += (guint) shard->buckets[b];
+    }
+    summary->min = MIN (summary->min, shard->min);
+    summary->max = MAX (summary->max, shard->max);
+    reset_shard (shard);
+  }
+
+  if (summary->count == 0) {
+    summary->min = 0;
+    g_free (counts);
+    return;
+  }
+
+  /* a percentile is the highest value of the bucket where the count
+     of values reaches that fraction of the total */
+  seen = 0;
+  q = 0;
+  for (b = 0; b < HISTOGRAM_BUCKETS && q < G_N_ELEMENTS (quantiles); ++b) {
+    seen += counts[b];
+    while (q < G_N_ELEMENTS (quantiles)
+        && seen * 1000 >= quantiles[q] * summary->count) {
+      *percentiles[q] = CLAMP (bucket_value (b), summary->min, summary->max);
+      ++q;
+    }
+  }
+
+  g_free (counts);
+}
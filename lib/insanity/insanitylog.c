@@ -0,0 +1,382 @@
+/* Insanity QA system
+
+       insanitylog.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* Asynchronous log writer.
+
+   Logging threads never write to the output themselves, nor take a lock
+   in the common case. Each thread formats its records into a chunk of
+   memory of its own, and pushes them on a lock-free stack. A writer
+   thread takes the whole stack at once, and writes the records out in
+   the order they were logged, either as text or in the binary format
+   below. A chunk is freed once all its records have been written and
+   its thread has moved on to a new chunk.
+
+   The binary format is native endian: the 8 bytes of LOG_MAGIC, then
+   one LogRecordHeader per record, followed by the category, file and
+   message, each zero terminated. bin/insanity-logformat turns it back
+   into text. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#include <string.h>
+
+#if GLIB_CHECK_VERSION(2,31,0)
+#define USE_NEW_GLIB_MUTEX_API
+#endif
+
+#define LOG_CHUNK_SIZE (64 * 1024)
+#define LOG_MAGIC "INSLOG\0\1"
+
+#define SECOND ((guint64)1000000)
+#define TIME_FORMAT "u:%02u:%02u.%09u"
+#define TIME_ARGS(t) \
+        (guint) (((guint64)(t)) / (SECOND * 60 * 60)), \
+        (guint) ((((guint64)(t)) / (SECOND * 60)) % 60), \
+        (guint) ((((guint64)(t)) / SECOND) % 60), \
+        (guint) (((guint64)(t)) % SECOND)
+
+static const char *const log_level_names[] = {
+  "none", "info", "debug", "spam"
+};
+
+typedef struct _LogChunk LogChunk;
+typedef struct _LogRecord LogRecord;
+
+typedef struct
+{
+  guint32 size;                 /* of the header and strings */
+  guint32 level;
+  guint64 time;                 /* since the test started, in microseconds */
+  guint64 thread;
+  guint32 line;
+  guint32 padding;
+} LogRecordHeader;
+
+struct _LogRecord
+{
+  LogRecord *next;
+  LogChunk *chunk;
+  LogRecordHeader header;
+  /* category, file and message follow */
+};
+
+struct _LogChunk
+{
+  gint refcount;                /* one per unwritten record, plus its thread's */
+  gsize used;
+  char data[LOG_CHUNK_SIZE];
+};
+
+struct _LogWriter
+{
+  FILE *out;
+  gboolean binary;
+
+  /* pushed by any thread, taken by the writer thread */
+  LogRecord *queue;
+
+  GThread *thread;
+#ifdef USE_NEW_GLIB_MUTEX_API
+  GMutex lock;
+  GCond cond;
+#else
+  GMutex *lock;
+  GCond *cond;
+#endif
+  gboolean busy;
+  gboolean stop;
+};
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+#define WLOCK(w) g_mutex_lock(&(w)->lock)
+#define WUNLOCK(w) g_mutex_unlock(&(w)->lock)
+#define WWAIT(w) g_cond_wait(&(w)->cond, &(w)->lock)
+#define WSIGNAL(w) g_cond_broadcast(&(w)->cond)
+#else
+#define WLOCK(w) g_mutex_lock((w)->lock)
+#define WUNLOCK(w) g_mutex_unlock((w)->lock)
+#define WWAIT(w) g_cond_wait((w)->cond, (w)->lock)
+#define WSIGNAL(w) g_cond_broadcast((w)->cond)
+#endif
+
+static void
+unref_chunk (gpointer data)
+{
+  LogChunk *chunk = data;
+
+  if (chunk && g_atomic_int_dec_and_test (&chunk->refcount))
+    g_free (chunk);
+}
+
+/* the chunk the current thread formats its records into */
+#ifdef USE_NEW_GLIB_MUTEX_API
+static GPrivate current_chunk = G_PRIVATE_INIT (unref_chunk);
+
+#define GET_CHUNK() ((LogChunk *) g_private_get (&current_chunk))
+#define SET_CHUNK(c) g_private_replace (&current_chunk, (c))
+#else
+static GPrivate *current_chunk = NULL;
+
+static gpointer
+create_chunk_key (gpointer data)
+{
+  (void) data;
+  current_chunk = g_private_new (&unref_chunk);
+  return NULL;
+}
+
+#define GET_CHUNK() ((LogChunk *) g_private_get (current_chunk))
+#define SET_CHUNK(c) G_STMT_START { \
+  unref_chunk (g_private_get (current_chunk)); \
+  g_private_set (current_chunk, (c)); \
+} G_STMT_END
+#endif
+
+static LogChunk *
+new_chunk (void)
+{
+  LogChunk *chunk;
+
+  chunk = g_malloc (sizeof (LogChunk));
+  chunk->refcount = 1;
+  chunk->used = 0;
+  SET_CHUNK (chunk);
+  return chunk;
+}
+
+static void
+write_record (LogWriter * writer, LogRecord * record)
+{
+  const char *category, *file, *message;
+
+  if (writer->binary) {
+    fwrite (&record->header, record->header.size, 1, writer->out);
+    return;
+  }
+
+  category = (const char *) (record + 1);
+  file = category + strlen (category) + 1;
+  message = file + strlen (file) + 1;
+  fprintf (writer->out, "%" TIME_FORMAT "\t%p\t%s\t%s\t%s:%u\t%s",
+      TIME_ARGS (record->header.time),
+      (gpointer) (guintptr) record->header.thread,
+      log_level_names[record->header.level], category, file,
+      record->header.line, message);
+}
+
+/* Writes out the records pushed so far, only one thread may do so */
+static void
+write_records (LogWriter * writer)
+{
+  LogRecord *records, *reversed, *next;
+
+  /* only one thread takes records off the stack, so it is safe to
+     grab it whole */
+  do {
+    records = g_atomic_pointer_get (&writer->queue);
+  } while (!g_atomic_pointer_compare_and_exchange (&writer->queue, records,
+          NULL));
+
+  /* the most recent record is on top */
+  reversed = NULL;
+  while (records) {
+    next = records->next;
+    records->next = reversed;
+    reversed = records;
+    records = next;
+  }
+
+  for (records = reversed; records; records = next) {
+    next = records->next;
+    write_record (writer, records);
+    unref_chunk (records->chunk);
+  }
+  fflush (writer->out);
+}
+
+static gpointer
+log_writer_thread (gpointer data)
+{
+  LogWriter *writer = data;
+
+  WLOCK (writer);
+  while (TRUE) {
+    while (!g_atomic_pointer_get (&writer->queue) && !writer->stop)
+      WWAIT (writer);
+    if (!g_atomic_pointer_get (&writer->queue))
+      break;
+    writer->busy = TRUE;
+    WUNLOCK (writer);
+
+    write_records (writer);
+
+    WLOCK (writer);
+    writer->busy = FALSE;
+    WSIGNAL (writer);
+  }
+  WUNLOCK (writer);
+
+  return NULL;
+}
+
+LogWriter *
+log_writer_new (FILE * out, gboolean binary)
+{
+  LogWriter *writer;
+
+#ifndef USE_NEW_GLIB_MUTEX_API
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, &create_chunk_key, NULL);
+#endif
+
+  writer = g_slice_new0 (LogWriter);
+  writer->out = out;
+  writer->binary = binary;
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_init (&writer->lock);
+  g_cond_init (&writer->cond);
+#else
+  writer->lock = g_mutex_new ();
+  writer->cond = g_cond_new ();
+#endif
+
+  if (binary)
+    fwrite (LOG_MAGIC, sizeof (LOG_MAGIC) - 1, 1, out);
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+  writer->thread = g_thread_new ("insanity_log", &log_writer_thread, writer);
+#else
+  writer->thread = g_thread_create (&log_writer_thread, writer, TRUE, NULL);
+#endif
+
+  return writer;
+}
+
+/* Waits until everything logged so far has been written out */
+void
+log_writer_flush (LogWriter * writer)
+{
+  WLOCK (writer);
+  while (g_atomic_pointer_get (&writer->queue) || writer->busy)
+    WWAIT (writer);
+  WUNLOCK (writer);
+}
+
+void
+log_writer_free (LogWriter * writer)
+{
+  WLOCK (writer);
+  writer->stop = TRUE;
+  WSIGNAL (writer);
+  WUNLOCK (writer);
+  g_thread_join (writer->thread);
+
+  /* write out anything pushed after the thread last looked, callers
+     make sure nothing is logged from now on */
+  write_records (writer);
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_clear (&writer->lock);
+  g_cond_clear (&writer->cond);
+#else
+  g_mutex_free (writer->lock);
+  g_cond_free (writer->cond);
+#endif
+  g_slice_free (LogWriter, writer);
+}
+
+void
+log_writer_logv (LogWriter * writer, guint64 time, guint level,
+    const char *category, const char *file, unsigned int line,
+    const char *format, va_list args)
+{
+  LogChunk *chunk;
+  LogRecord *record, *head;
+  gsize category_len, file_len, avail, size;
+  char *message;
+  int len;
+  va_list args2;
+
+  category_len = strlen (category) + 1;
+  file_len = strlen (file) + 1;
+
+  chunk = GET_CHUNK ();
+  if (!chunk)
+    chunk = new_chunk ();
+
+  /* start a new chunk if the category and file (and some of the message)
+     do not fit anymore, or if the message turns out not to fit */
+  while (TRUE) {
+    avail = LOG_CHUNK_SIZE - chunk->used;
+    if (avail >= sizeof (LogRecord) + category_len + file_len + 256
+        || chunk->used == 0) {
+      record = (LogRecord *) (chunk->data + chunk->used);
+      message = (char *) (record + 1) + category_len + file_len;
+      avail -= message - (char *) record;
+      G_VA_COPY (args2, args);
+      len = g_vsnprintf (message, avail, format, args2);
+      va_end (args2);
+      if (len < 0)
+        len = 0;
+      /* a message bigger than a whole chunk is truncated */
+      if ((gsize) len < avail || chunk->used == 0)
+        break;
+    }
+    chunk = new_chunk ();
+  }
+
+  if ((gsize) len >= avail)
+    len = avail - 1;
+  memcpy (record + 1, category, category_len);
+  memcpy ((char *) (record + 1) + category_len, file, file_len);
+
+  size = sizeof (LogRecordHeader) + category_len + file_len + len + 1;
+  record->chunk = chunk;
+  record->header.size = size;
+  record->header.level = level;
+  record->header.time = time;
+  record->header.thread = (guintptr) g_thread_self ();
+  record->header.line = line;
+  record->header.padding = 0;
+
+  /* keep records aligned */
+  chunk->used += (G_STRUCT_OFFSET (LogRecord, header) + size + 7) & ~7;
+  g_atomic_int_inc (&chunk->refcount);
+
+  do {
+    head = g_atomic_pointer_get (&writer->queue);
+    record->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&writer->queue, head,
+          record));
+
+  /* the writer only sleeps when there is nothing left to write */
+  if (!head) {
+    WLOCK (writer);
+    WSIGNAL (writer);
+    WUNLOCK (writer);
+  }
+}
@@ -0,0 +1,117 @@
+/* Insanity QA system
+
+       insanitymemory.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* Memory footprint of the process, from /proc and the C library.
+   Every function returns FALSE where the information is not available,
+   all sizes are in bytes. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_MALLINFO2
+#include <malloc.h>
+#endif
+
+/* Finds a "Name:   1234 kB" line */
+static gboolean
+find_kb_field (const char *contents, const char *name, guint64 * bytes)
+{
+  const char *line;
+  gsize len = strlen (name);
+
+  for (line = contents; line; line = strchr (line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (!strncmp (line, name, len) && line[len] == ':') {
+      *bytes = g_ascii_strtoull (line + len + 1, NULL, 10) * 1024;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+gboolean
+memory_read_status (MemoryStatus * status)
+{
+  char *contents;
+  gboolean ret;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return FALSE;
+  ret = find_kb_field (contents, "VmRSS", &status->rss)
+      && find_kb_field (contents, "VmHWM", &status->hwm);
+  g_free (contents);
+  return ret;
+}
+
+/* Makes VmHWM start again from the current RSS, needs Linux 4.0 */
+gboolean
+memory_reset_peak (void)
+{
+  FILE *f;
+  gboolean ret;
+
+  f = fopen ("/proc/self/clear_refs", "w");
+  if (!f)
+    return FALSE;
+  ret = fputs ("5", f) >= 0;
+  if (fclose (f))
+    ret = FALSE;
+  return ret;
+}
+
+/* The proportional set size counts shared pages divided by the number
+   of processes sharing them, so it adds up over the processes of a run */
+gboolean
+memory_read_pss (guint64 * pss)
+{
+  char *contents;
+  gboolean ret;
+
+  if (!g_file_get_contents ("/proc/self/smaps_rollup", &contents, NULL, NULL))
+    return FALSE;
+  ret = find_kb_field (contents, "Pss", pss);
+  g_free (contents);
+  return ret;
+}
+
+gboolean
+memory_read_heap_in_use (guint64 * bytes)
+{
+#ifdef USE_MALLINFO2
+  struct mallinfo2 info;
+
+  info = mallinfo2 ();
+  *bytes = info.uordblks + info.hblkhd;
+  return TRUE;
+#else
+  (void) bytes;
+  return FALSE;
+#endif
+}
@@ -0,0 +1,543 @@
+/* Insanity QA system
+
+       insanityparalleltest.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+/**
+ * SECTION:insanityparalleltest
+ * @short_description: Parallel Test
+ * @see_also: #InsanityTest, #InsanityThreadedTest
+ *
+ * A parallel test runs its test signal in several worker threads at
+ * once, to measure how the code under test scales. The number of
+ * workers is set with the workers argument, and defaults to one per CPU.
+ *
+ * The test is done once the test signal has returned in every worker,
+ * so handlers must not call insanity_test_done themselves.
+ *
+ * Checklist items may be validated from any worker, and only pass if
+ * they pass in all of them. Extra infos declared with
+ * insanity_parallel_test_add_extra_info are set by each worker with
+ * insanity_parallel_test_set_extra_info, and reported as their sum,
+ * minimum and maximum over the workers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYSCONF
+#include <unistd.h>
+#endif
+
+#include "insanityparalleltest.h"
+#include "insanityprivate.h"
+
+#if GLIB_CHECK_VERSION(2,31,0)
+#define USE_NEW_GLIB_MUTEX_API
+#endif
+
+static guint test_signal;
+
+G_DEFINE_TYPE (InsanityParallelTest, insanity_parallel_test,
+    INSANITY_TYPE_TEST);
+
+typedef struct
+{
+  /* G_TYPE_INT64, G_TYPE_UINT64 or G_TYPE_DOUBLE once set */
+  GType type;
+  union
+  {
+    gint64 i;
+    guint64 u;
+    double d;
+  } sum, min, max;
+} AggregatedInfo;
+
+struct _InsanityParallelTestPrivateData
+{
+  GThread **threads;
+  guint nthreads;
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+  GMutex lock;
+  GCond cond;
+#else
+  GMutex *lock;
+  GCond *cond;
+#endif
+  /* bumped at each start, workers run once per generation */
+  guint generation;
+  guint remaining;
+  /* bumped at teardown, workers of an older pool quit: those still
+     running the test then, usually after a timeout, exit on their own */
+  guint pool;
+
+  /* label -> AggregatedInfo */
+  GHashTable *extra_infos;
+};
+
+typedef struct
+{
+  InsanityParallelTest *test;
+  guint index;
+  guint generation;             /* the last one this worker ran */
+  guint pool;
+} Worker;
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+#define LOCK(test) g_mutex_lock(&(test)->priv->lock)
+#define UNLOCK(test) g_mutex_unlock(&(test)->priv->lock)
+#define WAIT(test) g_cond_wait(&(test)->priv->cond, &(test)->priv->lock)
+#define SIGNAL(test) g_cond_broadcast(&(test)->priv->cond)
+#else
+#define LOCK(test) g_mutex_lock((test)->priv->lock)
+#define UNLOCK(test) g_mutex_unlock((test)->priv->lock)
+#define WAIT(test) g_cond_wait((test)->priv->cond, (test)->priv->lock)
+#define SIGNAL(test) g_cond_broadcast((test)->priv->cond)
+#endif
+
+static guint
+get_cpu_count (void)
+{
+#if GLIB_CHECK_VERSION(2,36,0)
+  return g_get_num_processors ();
+#elif defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+static void
+set_aggregated_info (InsanityParallelTest * test, const char *label,
+    const char *suffix, GType type, gint64 i, guint64 u, double d)
+{
+  GValue value = { 0 };
+  char *name;
+
+  name = suffix ? g_strdup_printf ("%s-%s", label, suffix) : g_strdup (label);
+  g_value_init (&value, type);
+  if (type == G_TYPE_INT64)
+    g_value_set_int64 (&value, i);
+  else if (type == G_TYPE_UINT64)
+    g_value_set_uint64 (&value, u);
+  else
+    g_value_set_double (&value, d);
+  insanity_test_set_extra_info (INSANITY_TEST (test), name, &value);
+  g_value_unset (&value);
+  g_free (name);
+}
+
+/* Called from the last worker to finish, once the others are idle */
+static void
+report_aggregated_infos (InsanityParallelTest * test)
+{
+  GHashTableIter it;
+  gpointer label, value;
+  AggregatedInfo *info;
+
+  g_hash_table_iter_init (&it, test->priv->extra_infos);
+  while (g_hash_table_iter_next (&it, &label, &value)) {
+    info = value;
+    if (info->type == G_TYPE_INVALID)
+      continue;
+    set_aggregated_info (test, label, NULL, info->type, info->sum.i,
+        info->sum.u, info->sum.d);
+    set_aggregated_info (test, label, "min", info->type, info->min.i,
+        info->min.u, info->min.d);
+    set_aggregated_info (test, label, "max", info->type, info->max.i,
+        info->max.u, info->max.d);
+    info->type = G_TYPE_INVALID;
+  }
+}
+
+/* Workers hold a reference to the test, as they may outlive teardown */
+static gpointer
+test_thread_func (gpointer data)
+{
+  Worker *worker = data;
+  InsanityParallelTest *test = worker->test;
+  gboolean last;
+
+  LOCK (test);
+  while (TRUE) {
+    while (test->priv->generation == worker->generation
+        && test->priv->pool == worker->pool)
+      WAIT (test);
+    if (test->priv->pool != worker->pool)
+      break;
+    worker->generation = test->priv->generation;
+    UNLOCK (test);
+
+    g_signal_emit (test, test_signal, 0, worker->index);
+
+    LOCK (test);
+    if (test->priv->pool != worker->pool)
+      break;
+    last = --test->priv->remaining == 0;
+    if (last) {
+      UNLOCK (test);
+      report_aggregated_infos (test);
+      insanity_test_done (INSANITY_TEST (test));
+      LOCK (test);
+    }
+  }
+  UNLOCK (test);
+
+  g_object_unref (test);
+  g_slice_free (Worker, worker);
+  return NULL;
+}
+
+static gboolean
+start_workers (InsanityParallelTest * test)
+{
+  GValue workers = { 0 };
+  Worker *worker;
+  guint n;
+
+  insanity_test_get_argument (INSANITY_TEST (test), "workers", &workers);
+  test->priv->nthreads = g_value_get_uint (&workers);
+  g_value_unset (&workers);
+  if (test->priv->nthreads == 0)
+    test->priv->nthreads = get_cpu_count ();
+
+  test->priv->threads = g_new0 (GThread *, test->priv->nthreads);
+  for (n = 0; n < test->priv->nthreads; ++n) {
+    worker = g_slice_new (Worker);
+    worker->test = g_object_ref (test);
+    worker->index = n;
+    worker->generation = test->priv->generation;
+    worker->pool = test->priv->pool;
+    test->priv->threads[n] =
+#if GLIB_CHECK_VERSION(2,31,2)
+        g_thread_new ("insanity_worker", test_thread_func, worker);
+#else
+        g_thread_create (test_thread_func, worker, TRUE, NULL);
+#endif
+    if (!test->priv->threads[n]) {
+      g_object_unref (test);
+      g_slice_free (Worker, worker);
+      test->priv->nthreads = n;
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Joins the workers if they are idle, and lets them go otherwise: a
+   test which timed out must still be able to report */
+static void
+stop_workers (InsanityParallelTest * test)
+{
+  gboolean running;
+  guint n;
+
+  if (!test->priv->threads)
+    return;
+
+  LOCK (test);
+  running = test->priv->remaining > 0;
+  test->priv->pool++;
+  test->priv->remaining = 0;
+  SIGNAL (test);
+  UNLOCK (test);
+
+  for (n = 0; n < test->priv->nthreads; ++n) {
+    if (!running)
+      g_thread_join (test->priv->threads[n]);
+#if GLIB_CHECK_VERSION(2,32,0)
+    else
+      g_thread_unref (test->priv->threads[n]);
+#endif
+  }
+  g_free (test->priv->threads);
+  test->priv->threads = NULL;
+  test->priv->nthreads = 0;
+}
+
+static gboolean
+insanity_parallel_test_start (InsanityTest * itest)
+{
+  InsanityParallelTest *test = INSANITY_PARALLEL_TEST (itest);
+  gboolean busy;
+
+  LOCK (test);
+  busy = test->priv->remaining > 0;
+  UNLOCK (test);
+  if (busy)
+    return FALSE;
+
+  if (!INSANITY_TEST_CLASS (insanity_parallel_test_parent_class)->start (itest))
+    return FALSE;
+
+  if (!test->priv->threads && !start_workers (test)) {
+    stop_workers (test);
+    return FALSE;
+  }
+
+  LOCK (test);
+  test->priv->remaining = test->priv->nthreads;
+  test->priv->generation++;
+  SIGNAL (test);
+  UNLOCK (test);
+
+  return TRUE;
+}
+
+static void
+insanity_parallel_test_teardown (InsanityTest * itest)
+{
+  InsanityParallelTest *test = INSANITY_PARALLEL_TEST (itest);
+
+  stop_workers (test);
+
+  INSANITY_TEST_CLASS (insanity_parallel_test_parent_class)->teardown (itest);
+}
+
+static void
+insanity_parallel_test_finalize (GObject * gobject)
+{
+  InsanityParallelTest *test = INSANITY_PARALLEL_TEST (gobject);
+
+  stop_workers (test);
+  g_hash_table_destroy (test->priv->extra_infos);
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_clear (&test->priv->lock);
+  g_cond_clear (&test->priv->cond);
+#else
+  g_mutex_free (test->priv->lock);
+  g_cond_free (test->priv->cond);
+#endif
+
+  G_OBJECT_CLASS (insanity_parallel_test_parent_class)->finalize (gobject);
+}
+
+static void
+insanity_parallel_test_init (InsanityParallelTest * test)
+{
+  InsanityParallelTestPrivateData *priv = G_TYPE_INSTANCE_GET_PRIVATE (test,
+      INSANITY_TYPE_PARALLEL_TEST, InsanityParallelTestPrivateData);
+  GValue vdef = { 0 };
+
+  test->priv = priv;
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->cond);
+#else
+  priv->lock = g_mutex_new ();
+  priv->cond = g_cond_new ();
+#endif
+  priv->extra_infos =
+      g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free, &g_free);
+
+  g_value_init (&vdef, G_TYPE_UINT);
+  g_value_set_uint (&vdef, 0);
+  insanity_test_add_argument (INSANITY_TEST (test), "workers",
+      "Number of worker threads running the test at once",
+      "0 for one per CPU", TRUE, &vdef);
+  g_value_unset (&vdef);
+}
+
+static void
+insanity_parallel_test_class_init (InsanityParallelTestClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  InsanityTestClass *test_class = INSANITY_TEST_CLASS (klass);
+
+  gobject_class->finalize = &insanity_parallel_test_finalize;
+  test_class->start = &insanity_parallel_test_start;
+  test_class->teardown = &insanity_parallel_test_teardown;
+
+  g_type_class_add_private (klass, sizeof (InsanityParallelTestPrivateData));
+
+  test_signal = g_signal_new ("test",
+      G_TYPE_FROM_CLASS (gobject_class),
+      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_HOOKS,
+      G_STRUCT_OFFSET (InsanityParallelTestClass, test),
+      NULL, NULL, g_cclosure_marshal_VOID__UINT, G_TYPE_NONE /* return_type */ ,
+      1, G_TYPE_UINT);
+}
+
+/**
+ * insanity_parallel_test_new:
+ * @name: the short name of the test.
+ * @description: a one line description of the test.
+ * @full_description: (allow-none): an optional longer description of the test.
+ *
+ * This function creates a new parallel test with the given properties.
+ *
+ * Parallel tests create a pool of worker threads at the first start, and
+ * the test signal is called in every one of them at each start, with the
+ * index of the worker. The workers are joined at teardown, or left to
+ * exit on their own if they are still running the test.
+ *
+ * Returns: (transfer full): a new #InsanityParallelTest instance.
+ */
+InsanityParallelTest *
+insanity_parallel_test_new (const char *name, const char *description,
+    const char *full_description)
+{
+  InsanityParallelTest *test;
+
+  g_return_val_if_fail (name != NULL, NULL);
+  g_return_val_if_fail (check_valid_label (name), NULL);
+  g_return_val_if_fail (description != NULL, NULL);
+
+  if (full_description)
+    test = g_object_new (INSANITY_TYPE_PARALLEL_TEST,
+        "name", name, "description", description, "full-description",
+        full_description, NULL);
+  else
+    test = g_object_new (INSANITY_TYPE_PARALLEL_TEST,
+        "name", name, "description", description, NULL);
+
+  return test;
+}
+
+/**
+ * insanity_parallel_test_add_extra_info:
+ * @test: a #InsanityParallelTest instance to operate on.
+ * @label: the new extra info's label
+ * @description: a one line description of that extra info
+ *
+ * This function adds a numeric extra info declaration to the test, which
+ * is aggregated over the workers. It is reported as @label for the sum of
+ * the values set by the workers, and as @label-min and @label-max.
+ */
+void
+insanity_parallel_test_add_extra_info (InsanityParallelTest * test,
+    const char *label, const char *description)
+{
+  char *name, *desc;
+
+  g_return_if_fail (INSANITY_IS_PARALLEL_TEST (test));
+  g_return_if_fail (label != NULL);
+  g_return_if_fail (check_valid_label (label));
+  g_return_if_fail (g_hash_table_lookup (test->priv->extra_infos,
+          label) == NULL);
+  g_return_if_fail (description != NULL);
+
+  desc = g_strdup_printf ("%s (sum over workers)", description);
+  insanity_test_add_extra_info (INSANITY_TEST (test), label, desc);
+  g_free (desc);
+
+  name = g_strdup_printf ("%s-min", label);
+  desc = g_strdup_printf ("%s (lowest over workers)", description);
+  insanity_test_add_extra_info (INSANITY_TEST (test), name, desc);
+  g_free (desc);
+  g_free (name);
+
+  name = g_strdup_printf ("%s-max", label);
+  desc = g_strdup_printf ("%s (highest over workers)", description);
+  insanity_test_add_extra_info (INSANITY_TEST (test), name, desc);
+  g_free (desc);
+  g_free (name);
+
+  g_hash_table_insert (test->priv->extra_infos, g_strdup (label),
+      g_new0 (AggregatedInfo, 1));
+}
+
+/**
+ * insanity_parallel_test_set_extra_info:
+ * @test: a #InsanityParallelTest to operate on
+ * @label: the label of the extra info
+ * @data: the value of the extra info for the calling worker
+ *
+ * Sets the value of an extra info for the calling worker. Each worker
+ * should set it once per iteration. Extra infos declared with
+ * insanity_parallel_test_add_extra_info must be integers or doubles,
+ * and are reported when all workers are done. Other extra infos are
+ * passed on to insanity_test_set_extra_info.
+ */
+void
+insanity_parallel_test_set_extra_info (InsanityParallelTest * test,
+    const char *label, const GValue * data)
+{
+  AggregatedInfo *info;
+  GType type;
+  gint64 i = 0;
+  guint64 u = 0;
+  double d = 0;
+
+  g_return_if_fail (INSANITY_IS_PARALLEL_TEST (test));
+  g_return_if_fail (label != NULL);
+  g_return_if_fail (G_IS_VALUE (data));
+
+  info = g_hash_table_lookup (test->priv->extra_infos, label);
+  if (!info) {
+    insanity_test_set_extra_info (INSANITY_TEST (test), label, data);
+    return;
+  }
+
+  switch (G_VALUE_TYPE (data)) {
+    case G_TYPE_INT:
+      type = G_TYPE_INT64;
+      i = g_value_get_int (data);
+      break;
+    case G_TYPE_INT64:
+      type = G_TYPE_INT64;
+      i = g_value_get_int64 (data);
+      break;
+    case G_TYPE_UINT:
+      type = G_TYPE_UINT64;
+      u = g_value_get_uint (data);
+      break;
+    case G_TYPE_UINT64:
+      type = G_TYPE_UINT64;
+      u = g_value_get_uint64 (data);
+      break;
+    case G_TYPE_DOUBLE:
+      type = G_TYPE_DOUBLE;
+      d = g_value_get_double (data);
+      break;
+    default:
+      g_critical ("Extra info %s is not numeric\n", label);
+      return;
+  }
+
+  LOCK (test);
+  if (info->type == G_TYPE_INVALID) {
+    info->type = type;
+    if (type == G_TYPE_INT64)
+      info->sum.i = info->min.i = info->max.i = i;
+    else if (type == G_TYPE_UINT64)
+      info->sum.u = info->min.u = info->max.u = u;
+    else
+      info->sum.d = info->min.d = info->max.d = d;
+  } else if (info->type != type) {
+    g_critical ("Extra info %s set with different types\n", label);
+  } else if (type == G_TYPE_INT64) {
+    info->sum.i += i;
+    info->min.i = MIN (info->min.i, i);
+    info->max.i = MAX (info->max.i, i);
+  } else if (type == G_TYPE_UINT64) {
+    info->sum.u += u;
+    info->min.u = MIN (info->min.u, u);
+    info->max.u = MAX (info->max.u, u);
+  } else {
+    info->sum.d += d;
+    info->min.d = MIN (info->min.d, d);
+    info->max.d = MAX (info->max.d, d);
+  }
+  UNLOCK (test);
+}
@@ -0,0 +1,87 @@
+/* Insanity QA system
+
+       insanityparalleltest.h
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INSANITY_PARALLEL_TEST_H_GUARD
+#define INSANITY_PARALLEL_TEST_H_GUARD
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <insanity/insanitydefs.h>
+#include <insanity/insanitytest.h>
+
+G_BEGIN_DECLS
+
+typedef struct _InsanityParallelTest InsanityParallelTest;
+typedef struct _InsanityParallelTestClass InsanityParallelTestClass;
+typedef struct _InsanityParallelTestPrivateData InsanityParallelTestPrivateData;
+
+/**
+ * InsanityParallelTest:
+ *
+ * The opaque #InsanityParallelTest data structure.
+ */
+struct _InsanityParallelTest {
+  InsanityTest parent;
+
+  /*< private >*/
+  InsanityParallelTestPrivateData *priv;
+
+  gpointer _insanity_reserved[INSANITY_PADDING];
+};
+
+/**
+ * InsanityParallelTestClass:
+ * @parent_class: the parent class structure
+ * @test: Run the test in one of the worker threads
+ *
+ * Insanity parallel test class. Override the vmethods to customize
+ * functionality.
+ */
+struct _InsanityParallelTestClass
+{
+  InsanityTestClass parent_class;
+
+  void (*test) (InsanityParallelTest *test, guint worker);
+
+  /*< private >*/
+  gpointer _insanity_reserved[INSANITY_PADDING];
+};
+
+InsanityParallelTest *insanity_parallel_test_new(const char *name, const char *description, const char *full_description);
+
+void insanity_parallel_test_add_extra_info(InsanityParallelTest *test, const char *label, const char *description);
+void insanity_parallel_test_set_extra_info(InsanityParallelTest *test, const char *label, const GValue *data);
+
+/* Handy macros */
+#define INSANITY_TYPE_PARALLEL_TEST                (insanity_parallel_test_get_type ())
+#define INSANITY_PARALLEL_TEST(obj)                (G_TYPE_CHECK_INSTANCE_CAST ((obj), INSANITY_TYPE_PARALLEL_TEST, InsanityParallelTest))
+#define INSANITY_PARALLEL_TEST_CLASS(c)            (G_TYPE_CHECK_CLASS_CAST ((c), INSANITY_TYPE_PARALLEL_TEST, InsanityParallelTestClass))
+#define INSANITY_IS_PARALLEL_TEST(obj)             (G_TYPE_CHECK_INSTANCE_TYPE ((obj), INSANITY_TYPE_PARALLEL_TEST))
+#define INSANITY_IS_PARALLEL_TEST_CLASS(c)         (G_TYPE_CHECK_CLASS_TYPE ((c), INSANITY_TYPE_PARALLEL_TEST))
+#define INSANITY_PARALLEL_TEST_GET_CLASS(obj)      (G_TYPE_INSTANCE_GET_CLASS ((obj), INSANITY_TYPE_PARALLEL_TEST, InsanityParallelTestClass))
+
+GType insanity_parallel_test_get_type (void);
+
+G_END_DECLS
+
+#endif
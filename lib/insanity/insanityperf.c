@@ -0,0 +1,254 @@
+/* Insanity QA system
+
+       insanityperf.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* Performance counters, with perf_event_open.
+
+   Counters are opened for every thread of the process, as listed in
+   /proc/self/task, and summed, so threads which already run when the
+   counters start (streaming threads, the library's own worker threads)
+   are counted along with the calling one. Each counter also follows the
+   threads created afterwards by the thread it was opened for. Threads
+   created while the counters are being opened, by a thread which does
+   not have its counters yet, are missed.
+
+   The hardware counters of a thread are opened as one group so they
+   are scheduled together, which keeps ratios like instructions per
+   cycle meaningful even when the PMU is multiplexed. Where there is no
+   PMU to count with, as in most virtual machines, software counters
+   are used instead. Only user space is counted, which unprivileged
+   processes are allowed to do by default, except by the task clock,
+   which ignores exclude_kernel and counts the time spent in the kernel
+   too. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#ifdef USE_PERF_EVENTS
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define MAX_PERF_COUNTERS 8
+
+typedef struct
+{
+  guint32 type;
+  guint64 config;
+  const char *label;
+} PerfEvent;
+
+#ifdef USE_PERF_EVENTS
+static const PerfEvent hardware_events[] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "perf-cycles"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "perf-instructions"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "perf-branch-misses"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "perf-cache-misses"},
+};
+
+static const PerfEvent software_events[] = {
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "perf-task-clock"},
+};
+
+/* only when there are no hardware counters */
+static const PerfEvent fallback_events[] = {
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+      "perf-context-switches"},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "perf-cpu-migrations"},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "perf-page-faults"},
+};
+#endif
+
+struct _PerfCounters
+{
+  /* the events counted, and whether they are in the hardware group */
+  guint n;
+  const PerfEvent *events[MAX_PERF_COUNTERS];
+  gboolean grouped[MAX_PERF_COUNTERS];
+  /* n fds for each thread, -1 where the event could not be opened */
+  GArray *fds;
+};
+
+#ifdef USE_PERF_EVENTS
+static int
+open_event (const PerfEvent * event, pid_t tid, int group_fd)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = event->type;
+  attr.config = event->config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return syscall (__NR_perf_event_open, &attr, tid, -1, group_fd, 0);
+}
+
+/* Picks the events which can be opened for the calling thread, in a
+   group if group is TRUE, and keeps their fds */
+static void
+select_events (PerfCounters * counters, pid_t tid, const PerfEvent * events,
+    guint n, gboolean group)
+{
+  int leader = -1, fd;
+  guint i;
+
+  for (i = 0; i < n && counters->n < MAX_PERF_COUNTERS; ++i) {
+    fd = open_event (&events[i], tid, leader);
+    if (fd < 0)
+      continue;
+    if (group && leader < 0)
+      leader = fd;
+    counters->events[counters->n] = &events[i];
+    counters->grouped[counters->n] = group;
+    counters->n++;
+    g_array_append_val (counters->fds, fd);
+  }
+}
+
+/* Opens the selected events for another thread */
+static void
+open_thread_events (PerfCounters * counters, pid_t tid)
+{
+  int leader = -1, fd;
+  guint i;
+
+  for (i = 0; i < counters->n; ++i) {
+    fd = open_event (counters->events[i], tid,
+        counters->grouped[i] ? leader : -1);
+    if (counters->grouped[i] && leader < 0)
+      leader = fd;
+    g_array_append_val (counters->fds, fd);
+  }
+}
+#endif
+
+/* Opens and starts the counters, returns NULL if none could be opened */
+PerfCounters *
+perf_counters_start (void)
+{
+#ifdef USE_PERF_EVENTS
+  PerfCounters *counters;
+  pid_t self, tid;
+  GDir *dir;
+  const char *name;
+  guint i;
+  int fd;
+
+  counters = g_slice_new0 (PerfCounters);
+  counters->fds = g_array_new (FALSE, FALSE, sizeof (int));
+
+  self = syscall (__NR_gettid);
+  select_events (counters, self, hardware_events,
+      G_N_ELEMENTS (hardware_events), TRUE);
+  if (counters->n == 0)
+    select_events (counters, self, fallback_events,
+        G_N_ELEMENTS (fallback_events), FALSE);
+  select_events (counters, self, software_events,
+      G_N_ELEMENTS (software_events), FALSE);
+
+  if (counters->n == 0) {
+    g_array_free (counters->fds, TRUE);
+    g_slice_free (PerfCounters, counters);
+    return NULL;
+  }
+
+  dir = g_dir_open ("/proc/self/task", 0, NULL);
+  if (dir) {
+    while ((name = g_dir_read_name (dir))) {
+      tid = atoi (name);
+      if (tid > 0 && tid != self)
+        open_thread_events (counters, tid);
+    }
+    g_dir_close (dir);
+  }
+
+  for (i = 0; i < counters->fds->len; ++i) {
+    fd = g_array_index (counters->fds, int, i);
+    if (fd >= 0)
+      ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  return counters;
+#else
+  return NULL;
+#endif
+}
+
+/* Stops the counters, and calls func (if not NULL) with the label and
+   value of each, summed over all threads */
+void
+perf_counters_stop (PerfCounters * counters, PerfCounterFunc func,
+    gpointer user_data)
+{
+#ifdef USE_PERF_EVENTS
+  guint64 values[3];            /* value, time enabled, time running */
+  guint64 total;
+  gboolean counted;
+  guint i, n;
+  int fd;
+
+  for (n = 0; n < counters->fds->len; ++n) {
+    fd = g_array_index (counters->fds, int, n);
+    if (fd >= 0)
+      ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  for (i = 0; i < counters->n; ++i) {
+    total = 0;
+    counted = FALSE;
+    for (n = i; n < counters->fds->len; n += counters->n) {
+      fd = g_array_index (counters->fds, int, n);
+      if (fd < 0)
+        continue;
+      if (func && read (fd, values, sizeof (values)) == sizeof (values)
+          && values[2] > 0) {
+        /* scale up if the counter had to share the PMU */
+        if (values[2] < values[1])
+          values[0] = (guint64) ((double) values[0] * values[1] / values[2]);
+        total += values[0];
+        counted = TRUE;
+      }
+      close (fd);
+    }
+    if (counted)
+      (*func) (counters->events[i]->label, total, user_data);
+  }
+
+  g_array_free (counters->fds, TRUE);
+  g_slice_free (PerfCounters, counters);
+#else
+  (void) counters;
+  (void) func;
+  (void) user_data;
+#endif
+}
@@ -24,10 +24,86 @@
 #define INSANITY_PRIVATE_H_GUARD
 
 #include <glib.h>
+#include <stdio.h>
+#include <stdarg.h>
 
 G_BEGIN_DECLS
 
 gboolean check_valid_label (const char *label);
+void json_append_string (GString * s, const char *str);
+
+/* Asynchronous log writer, see insanitylog.c */
+typedef struct _LogWriter LogWriter;
+
+LogWriter *log_writer_new (FILE * out, gboolean binary);
+void log_writer_flush (LogWriter * writer);
+void log_writer_free (LogWriter * writer);
+void log_writer_logv (LogWriter * writer, guint64 time, guint level,
+    const char *category, const char *file, unsigned int line,
+    const char *format, va_list args);
+
+/* Log-bucketed histograms, see insanityhistogram.c */
+typedef struct _Histogram Histogram;
+
+typedef struct
+{
+  guint64 count;
+  guint64 min;
+  guint64 max;
+  guint64 p50;
+  guint64 p90;
+  guint64 p99;
+  guint64 p999;
+} HistogramSummary;
+
+Histogram *histogram_new (void);
+void histogram_free (Histogram * histogram);
+void histogram_record (Histogram * histogram, guint64 value);
+void histogram_summarize (Histogram * histogram, HistogramSummary * summary);
+
+/* Per thread CPU usage, see insanitythreadusage.c */
+typedef struct _ThreadUsage ThreadUsage;
+typedef struct _ThreadSnapshot ThreadSnapshot;
+
+ThreadUsage *thread_usage_new (void);
+void thread_usage_free (ThreadUsage * usage);
+void thread_usage_reset (ThreadUsage * usage);
+void thread_usage_sample (ThreadUsage * usage);
+ThreadSnapshot *thread_usage_read (void);
+void thread_usage_add (ThreadUsage * usage, ThreadSnapshot * snapshot);
+void thread_snapshot_free (ThreadSnapshot * snapshot);
+char *thread_usage_report (ThreadUsage * usage);
+
+/* Memory footprint, see insanitymemory.c */
+typedef struct
+{
+  guint64 rss;
+  guint64 hwm;
+} MemoryStatus;
+
+gboolean memory_read_status (MemoryStatus * status);
+gboolean memory_reset_peak (void);
+gboolean memory_read_pss (guint64 * pss);
+gboolean memory_read_heap_in_use (guint64 * bytes);
+
+/* Performance counters, see insanityperf.c */
+typedef struct _PerfCounters PerfCounters;
+typedef void (*PerfCounterFunc) (const char *label, guint64 value,
+    gpointer user_data);
+
+PerfCounters *perf_counters_start (void);
+void perf_counters_stop (PerfCounters * counters, PerfCounterFunc func,
+    gpointer user_data);
+
+/* Benchmark statistics, see insanitybenchmark.c */
+typedef struct _Benchmark Benchmark;
+
+Benchmark *benchmark_new (void);
+void benchmark_free (Benchmark * benchmark);
+void benchmark_record (Benchmark * benchmark, const char *label,
+    double value);
+gboolean benchmark_write_report (Benchmark * benchmark, FILE * out,
+    const char *test_name, guint iterations, guint warmup);
 
 G_END_DECLS
 
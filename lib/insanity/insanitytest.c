@@ -32,6 +32,13 @@
 #include "config.h"
 #endif
 
+#ifdef USE_LIBRARY_IDENTITY
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
 #include "insanitytest.h"
 #include "insanityprivate.h"
 
@@ -53,6 +60,30 @@
 #include <sys/resource.h>
 #endif
 
+#ifdef USE_CLOCK_GETTIME
+#include <time.h>
+#endif
+
+#ifdef USE_ZYGOTE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
+
+/* the ring is handed over as a file descriptor, which needs libdbus
+   to support unix fd passing */
+#if defined (USE_SAMPLE_RING) && !defined (DBUS_TYPE_UNIX_FD)
+#undef USE_SAMPLE_RING
+#endif
+
+#ifdef USE_SAMPLE_RING
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define TEST_TIMEOUT (15)
 
 enum
@@ -72,18 +103,6 @@ static guint teardown_signal;
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
 /* Taken and adapted from GStreamer */
-#define SECOND ((guint64)1000000)
-#define TIME_FORMAT "u:%02u:%02u.%09u"
-#define TIME_ARGS(t) \
-        (guint) (((guint64)(t)) / (SECOND * 60 * 60)), \
-        (guint) ((((guint64)(t)) / (SECOND * 60)) % 60), \
-        (guint) ((((guint64)(t)) / SECOND) % 60), \
-        (guint) (((guint64)(t)) % SECOND)
-
-static const char *const log_level_names[] = {
-  "none", "info", "debug", "spam"
-};
-
 #if GLIB_CHECK_VERSION(2,31,0)
 #define USE_NEW_GLIB_MUTEX_API
 #endif
@@ -95,17 +114,115 @@ typedef enum RunLevel
   rl_started
 } RunLevel;
 
+/* sample labels, with their terminating zero */
+#define SAMPLE_LABEL_SIZE 40
+
+#ifdef USE_SAMPLE_RING
+/* Sample ring: shared memory set up by the runner, where tests write
+   samples with no system call or lock. Any thread of the test may claim
+   a record by moving head forward, and publishes it by setting its seq
+   once it is filled in. The runner reads the published records from
+   tail and moves tail forward. Samples are dropped if the ring is full.
+   The layout is shared with insanity/samplering.py. */
+#define SAMPLE_RING_MAGIC 0x52534e49    /* "INSR" */
+#define SAMPLE_RING_VERSION 1
+
+typedef struct
+{
+  guint32 magic;
+  guint32 version;
+  guint32 record_size;
+  guint32 capacity;             /* in records, a power of two */
+  guint8 padding0[48];
+
+  /* written by the test */
+  guint64 head;
+  guint64 dropped;
+  guint8 padding1[48];
+
+  /* written by the runner */
+  guint64 tail;
+  guint8 padding2[56];
+} SampleRingHeader;
+
+typedef struct
+{
+  guint64 seq;                  /* position in the ring + 1 once published */
+  gint64 timestamp;             /* monotonic time, in microseconds */
+  gdouble value;
+  char label[SAMPLE_LABEL_SIZE];
+} SampleRecord;
+#endif
+
+/* The values of all arguments for an iteration, indexed by handle.
+   Never modified once published, so it can be read without the lock. */
+typedef struct _ArgSnapshot
+{
+  guint n;
+  GValue *values;
+} ArgSnapshot;
+
 struct _InsanityTestPrivateData
 {
   DBusConnection *conn;
+  GMainContext *context;
+  GMainLoop *loop;
 #ifdef USE_CPU_LOAD
   struct timeval start;
   struct rusage rusage;
+  struct rusage iteration_rusage;
 #endif
+  /* monotonic times in nanoseconds, for the per phase timings */
+  guint64 iteration_start;
+  guint64 done_time;
+  ThreadUsage *thread_usage;
+  GSource *sampling_source;
+  guint64 iteration_rss;
+  guint64 peak_rss;
+  gboolean peak_rss_reset;
+  PerfCounters *perf_counters;
+
+  /* standalone benchmark mode */
+  Benchmark *benchmark;
+  gboolean benchmark_collecting;
   char *name;
+  char *bus_name;
   GHashTable *args;
+  /* handle -> label, as owned by test_arguments */
+  GPtrArray *arg_labels;
+  ArgSnapshot *arg_snapshot;
+  /* the previous snapshot, which readers may still be using */
+  ArgSnapshot *retired_arg_snapshot;
   int cpu_load;
   gboolean exit;
+  /* worker mode: the test allows it, and runs as one */
+  gboolean reusable;
+  gboolean worker;
+  char *next_uuid;
+
+  /* connected straight to the runner rather than to a bus */
+  gboolean peer;
+
+  /* mapped sample ring, if the runner sent one at setup */
+  gpointer sample_ring;
+  gsize sample_ring_size;
+  /* threads currently writing to the ring, which stays mapped until
+     they are done with it */
+  volatile gint sample_emitters;
+
+  /* zygote mode: pids of the forked children still running */
+  gboolean zygote;
+  char *fork_uuid;
+  GHashTable *children;
+  GSource *children_source;
+
+  /* host mode: instances by object path, or the host of an instance */
+  gboolean hosting;
+  GHashTable *instances;
+  InsanityTest *host;
+  InsanityTestFactory factory;
+  gpointer factory_data;
+  GDestroyNotify factory_notify;
   GHashTable *filename_cache;
   char *tmpdir;
   gboolean keep_unnamed_output_files;
@@ -122,10 +239,24 @@ struct _InsanityTestPrivateData
 #endif
   gboolean standalone;
   GHashTable *checklist_results;
+  /* handle -> label, as owned by test_checklist */
+  GPtrArray *checklist_labels;
+  /* handle -> CHECKLIST_* bits, set atomically by any thread */
+  volatile guint *checklist_states;
+  /* handle -> the bits last reported, under the lock */
+  guint *checklist_reported;
+  gint64 checklist_ping_time;
   RunLevel runlevel;
   gint iteration;
   InsanityLogLevel default_log_level;
   GHashTable *log_levels;
+  LogWriter *log_writer;
+  /* threads currently logging, the writer is kept until they are done
+     with it */
+  volatile gint log_emitters;
+  FILE *log_output;
+  char *log_filename;
+  gboolean log_binary;
   guint64 start_time;
 
   /* test metadata */
@@ -136,10 +267,20 @@ struct _InsanityTestPrivateData
   GHashTable *test_arguments;
   GHashTable *test_extra_infos;
   GHashTable *test_output_files;
+  GHashTable *test_samples;
+  GHashTable *test_histograms;
+  /* handle -> sample label, and label -> handle + 1 */
+  GPtrArray *sample_labels;
+  GHashTable *sample_handles;
 
   /* timeout for standalone mode */
   gint timeout;
   gint64 timeout_end_time;
+
+  /* results waiting to be sent in the next remoteResultBatchSignal */
+  GArray *pending_results;
+  gboolean pending_ping;
+  GSource *result_flush_source;
 };
 
 #ifdef USE_NEW_GLIB_MUTEX_API
@@ -212,14 +353,39 @@ typedef struct _Argument
   char *description;
   GValue default_value;
   char *full_description;
+  gint handle;
 } Argument;
 
 typedef struct _ChecklistItem
 {
   char *description;
   char *likely_error;
+  gint handle;
 } ChecklistItem;
 
+/* States of checklist items validated through handles */
+#define CHECKLIST_PASSED 1
+#define CHECKLIST_FAILED 2
+
+typedef enum
+{
+  RESULT_CHECKLIST,
+  RESULT_EXTRA_INFO
+} ResultKind;
+
+typedef struct _ResultRecord
+{
+  ResultKind kind;
+  char *label;
+  gboolean success;
+  char *description;
+  GValue value;
+} ResultRecord;
+
+/* Flush results when that many are pending, or after that many ms */
+#define RESULT_BATCH_SIZE 64
+#define RESULT_BATCH_INTERVAL 100
+
 typedef struct _OutputFileItem
 {
   char *description;
@@ -297,9 +463,26 @@ insanity_test_connect (InsanityTest * test, DBusConnection * conn,
     g_free (test->priv->name);
   test->priv->name =
       g_strdup_printf ("/net/gstreamer/Insanity/Test/Test%s", uuid);
+  if (test->priv->bus_name)
+    g_free (test->priv->bus_name);
+  test->priv->bus_name =
+      g_strdup_printf ("net.gstreamer.Insanity.Test.Test%s", uuid);
   UNLOCK (test);
 }
 
+static guint64
+monotonic_time_ns (void)
+{
+#ifdef USE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (guint64) 1000000000 + ts.tv_nsec;
+#else
+  return g_get_monotonic_time () * (guint64) 1000;
+#endif
+}
+
 static void
 insanity_test_record_start_time (InsanityTest * test)
 {
@@ -337,7 +520,7 @@ insanity_test_record_stop_time (InsanityTest * test)
 #define INTROSPECT_RESPONSE_TEMPLATE \
   "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\" " \
   "\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n" \
-  "<node name=\"/net/gstreamer/Insanity/Test/Test%s\">\n" \
+  "<node name=\"%s\">\n" \
   "  <interface name=\"org.freedesktop.DBus.Introspectable\">\n" \
   "    <method name=\"Introspect\">\n" \
   "      <arg name=\"xml_data\" direction=\"out\" type=\"s\" />\n" \
@@ -358,6 +541,10 @@ insanity_test_record_stop_time (InsanityTest * test)
   "    </method>\n" \
   "    <method name=\"remoteTearDown\">\n" \
   "    </method>\n" \
+  "    <method name=\"remoteReset\">\n" \
+  "      <arg name=\"success\" direction=\"out\" type=\"b\" />\n" \
+  "      <arg name=\"uuid\" direction=\"in\" type=\"s\" />\n" \
+  "    </method>\n" \
   "    <signal name=\"remoteDoneSignal\">\n" \
   "    </signal>\n" \
   "    <signal name=\"remoteValidateChecklistItemSignal\">\n" \
@@ -371,19 +558,52 @@ insanity_test_record_stop_time (InsanityTest * test)
   "    </signal>\n" \
   "    <signal name=\"remotePingSignal\">\n" \
   "    </signal>\n" \
+  "    <signal name=\"remoteResultBatchSignal\">\n" \
+  "      <arg name=\"results\" type=\"a(ssv)\" />\n" \
+  "    </signal>\n" \
+  "  </interface>\n" \
+  "</node>\n"
+
+#define INSANITY_LAUNCHER_INTERFACE "net.gstreamer.Insanity.Launcher"
+#define LAUNCHER_INTROSPECT_RESPONSE_TEMPLATE \
+  "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\" " \
+  "\"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n" \
+  "<node name=\"%s\">\n" \
+  "  <interface name=\"org.freedesktop.DBus.Introspectable\">\n" \
+  "    <method name=\"Introspect\">\n" \
+  "      <arg name=\"xml_data\" direction=\"out\" type=\"s\" />\n" \
+  "    </method>\n" \
+  "  </interface>\n" \
+  "  <interface name=\"" INSANITY_LAUNCHER_INTERFACE "\">\n" \
+  "    <method name=\"remoteFork\">\n" \
+  "      <arg name=\"uuid\" direction=\"in\" type=\"s\" />\n" \
+  "      <arg name=\"pid\" direction=\"out\" type=\"u\" />\n" \
+  "    </method>\n" \
+  "    <method name=\"remoteCreateInstance\">\n" \
+  "      <arg name=\"uuid\" direction=\"in\" type=\"s\" />\n" \
+  "      <arg name=\"success\" direction=\"out\" type=\"b\" />\n" \
+  "    </method>\n" \
+  "    <method name=\"remoteChildStatus\">\n" \
+  "      <arg name=\"pid\" direction=\"in\" type=\"u\" />\n" \
+  "      <arg name=\"exited\" direction=\"out\" type=\"b\" />\n" \
+  "      <arg name=\"returncode\" direction=\"out\" type=\"i\" />\n" \
+  "    </method>\n" \
+  "    <signal name=\"remoteChildExitSignal\">\n" \
+  "      <arg name=\"pid\" type=\"u\" />\n" \
+  "      <arg name=\"returncode\" type=\"i\" />\n" \
+  "    </signal>\n" \
   "  </interface>\n" \
   "</node>\n"
 
 static gboolean
-send_signal (DBusConnection * conn, const char *signal_name,
-    const char *path_name, int type, ...)
+send_signal (DBusConnection * conn, const char *interface,
+    const char *signal_name, const char *path_name, int type, ...)
 {
   DBusMessage *msg;
   dbus_uint32_t serial = 0;
   va_list ap;
 
-  msg =
-      dbus_message_new_signal (path_name, INSANITY_TEST_INTERFACE, signal_name);
+  msg = dbus_message_new_signal (path_name, interface, signal_name);
   if (NULL == msg) {
     g_error ("Message Null\n");
     return FALSE;
@@ -469,7 +689,8 @@ send_signal (DBusConnection * conn, const char *signal_name,
     dbus_message_unref (msg);
     return FALSE;
   }
-  dbus_connection_flush (conn);
+  /* No flush: the message is written out from the connection's watches
+     on the main context, see dbus_connection_setup_with_context */
 
   dbus_message_unref (msg);
 
@@ -481,6 +702,245 @@ fail:
   return FALSE;
 }
 
+static gboolean
+append_variant_value (DBusMessageIter * iter, const GValue * data)
+{
+  GType glib_type;
+  const char *dbus_type;
+  int dbus_type_id;
+  dbus_int32_t int32_value;
+  dbus_uint32_t uint32_value;
+  dbus_int64_t int64_value;
+  dbus_uint64_t uint64_value;
+  dbus_bool_t bool_value;
+  double double_value;
+  const char *string_value;
+  void *dataptr = NULL;
+  DBusMessageIter sub;
+
+  glib_type = G_VALUE_TYPE (data);
+  if (glib_type == G_TYPE_INT) {
+    int32_value = g_value_get_int (data);
+    dbus_type = "i";
+    dbus_type_id = DBUS_TYPE_INT32;
+    dataptr = &int32_value;
+  } else if (glib_type == G_TYPE_UINT) {
+    uint32_value = g_value_get_uint (data);
+    dbus_type = "u";
+    dbus_type_id = DBUS_TYPE_UINT32;
+    dataptr = &uint32_value;
+  } else if (glib_type == G_TYPE_INT64) {
+    int64_value = g_value_get_int64 (data);
+    dbus_type = "x";
+    dbus_type_id = DBUS_TYPE_INT64;
+    dataptr = &int64_value;
+  } else if (glib_type == G_TYPE_UINT64) {
+    uint64_value = g_value_get_uint64 (data);
+    dbus_type = "t";
+    dbus_type_id = DBUS_TYPE_UINT64;
+    dataptr = &uint64_value;
+  } else if (glib_type == G_TYPE_DOUBLE) {
+    double_value = g_value_get_double (data);
+    dbus_type = "d";
+    dbus_type_id = DBUS_TYPE_DOUBLE;
+    dataptr = &double_value;
+  } else if (glib_type == G_TYPE_BOOLEAN) {
+    bool_value = g_value_get_boolean (data) ? 1 : 0;
+    dbus_type = "b";
+    dbus_type_id = DBUS_TYPE_BOOLEAN;
+    dataptr = &bool_value;
+  } else if (glib_type == G_TYPE_STRING) {
+    string_value = g_value_get_string (data);
+    if (!string_value)
+      string_value = "";
+    dbus_type = "s";
+    dbus_type_id = DBUS_TYPE_STRING;
+    dataptr = &string_value;
+  } else {
+    /* Add more if needed, there doesn't seem to be a glib "glib to dbus" conversion public API,
+       but if I missed one, it could replace the above. */
+    return FALSE;
+  }
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_VARIANT, dbus_type,
+          &sub)) {
+    g_error ("Out Of Memory!\n");
+    return FALSE;
+  }
+  if (!dbus_message_iter_append_basic (&sub, dbus_type_id, dataptr)) {
+    g_error ("Out Of Memory!\n");
+    return FALSE;
+  }
+  if (!dbus_message_iter_close_container (iter, &sub)) {
+    g_error ("Out Of Memory!\n");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Appends one (ssv) record to a batch. A NULL record is a ping. */
+static void
+append_result_record (DBusMessageIter * array, const ResultRecord * r)
+{
+  DBusMessageIter record, variant, pair;
+  const char *kind, *label;
+
+  if (!r) {
+    kind = "ping";
+    label = "";
+  } else if (r->kind == RESULT_CHECKLIST) {
+    kind = "checklist";
+    label = r->label;
+  } else {
+    kind = "extra-info";
+    label = r->label;
+  }
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+          &record)
+      || !dbus_message_iter_append_basic (&record, DBUS_TYPE_STRING, &kind)
+      || !dbus_message_iter_append_basic (&record, DBUS_TYPE_STRING, &label)) {
+    g_error ("Out Of Memory!\n");
+    return;
+  }
+
+  if (!r) {
+    dbus_bool_t alive = TRUE;
+
+    if (!dbus_message_iter_open_container (&record, DBUS_TYPE_VARIANT, "b",
+            &variant)
+        || !dbus_message_iter_append_basic (&variant, DBUS_TYPE_BOOLEAN,
+            &alive)
+        || !dbus_message_iter_close_container (&record, &variant)) {
+      g_error ("Out Of Memory!\n");
+      return;
+    }
+  } else if (r->kind == RESULT_CHECKLIST) {
+    dbus_bool_t success = r->success ? 1 : 0;
+    const char *desc = r->description ? r->description : "";
+
+    if (!dbus_message_iter_open_container (&record, DBUS_TYPE_VARIANT, "(bs)",
+            &variant)
+        || !dbus_message_iter_open_container (&variant, DBUS_TYPE_STRUCT, NULL,
+            &pair)
+        || !dbus_message_iter_append_basic (&pair, DBUS_TYPE_BOOLEAN, &success)
+        || !dbus_message_iter_append_basic (&pair, DBUS_TYPE_STRING, &desc)
+        || !dbus_message_iter_close_container (&variant, &pair)
+        || !dbus_message_iter_close_container (&record, &variant)) {
+      g_error ("Out Of Memory!\n");
+      return;
+    }
+  } else {
+    append_variant_value (&record, &r->value);
+  }
+
+  if (!dbus_message_iter_close_container (array, &record)) {
+    g_error ("Out Of Memory!\n");
+  }
+}
+
+static void
+clear_results_unlocked (InsanityTest * test)
+{
+  GArray *results = test->priv->pending_results;
+  guint n;
+
+  for (n = 0; n < results->len; n++) {
+    ResultRecord *r = &g_array_index (results, ResultRecord, n);
+
+    g_free (r->label);
+    g_free (r->description);
+    if (G_IS_VALUE (&r->value))
+      g_value_unset (&r->value);
+  }
+  g_array_set_size (results, 0);
+  test->priv->pending_ping = FALSE;
+
+  if (test->priv->result_flush_source) {
+    g_source_destroy (test->priv->result_flush_source);
+    g_source_unref (test->priv->result_flush_source);
+    test->priv->result_flush_source = NULL;
+  }
+}
+
+/* Sends all pending results in a single remoteResultBatchSignal. The
+   message is only queued: the main loop writes it out, so this never
+   blocks on the bus while the test lock is held. */
+static void
+flush_results_unlocked (InsanityTest * test)
+{
+  GArray *results = test->priv->pending_results;
+  DBusMessage *msg;
+  DBusMessageIter iter, array;
+  dbus_uint32_t serial = 0;
+  guint n;
+
+  if (results->len == 0 && !test->priv->pending_ping) {
+    clear_results_unlocked (test);
+    return;
+  }
+
+  msg =
+      dbus_message_new_signal (test->priv->name, INSANITY_TEST_INTERFACE,
+      "remoteResultBatchSignal");
+  if (NULL == msg) {
+    g_error ("Message Null\n");
+    return;
+  }
+
+  dbus_message_iter_init_append (msg, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssv)",
+          &array)) {
+    g_error ("Out Of Memory!\n");
+  }
+  if (test->priv->pending_ping)
+    append_result_record (&array, NULL);
+  for (n = 0; n < results->len; n++)
+    append_result_record (&array, &g_array_index (results, ResultRecord, n));
+  if (!dbus_message_iter_close_container (&iter, &array)) {
+    g_error ("Out Of Memory!\n");
+  }
+
+  if (!dbus_connection_send (test->priv->conn, msg, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  dbus_message_unref (msg);
+
+  clear_results_unlocked (test);
+}
+
+static gboolean
+flush_results_timeout (gpointer data)
+{
+  InsanityTest *test = data;
+
+  LOCK (test);
+  flush_results_unlocked (test);
+  UNLOCK (test);
+
+  return FALSE;
+}
+
+static void
+queue_results_flush_unlocked (InsanityTest * test)
+{
+  GSource *source;
+
+  if (test->priv->pending_results->len >= RESULT_BATCH_SIZE
+      || !test->priv->context) {
+    flush_results_unlocked (test);
+    return;
+  }
+
+  if (!test->priv->result_flush_source) {
+    source = g_timeout_source_new (RESULT_BATCH_INTERVAL);
+    g_source_set_callback (source, &flush_results_timeout, test, NULL);
+    g_source_attach (source, test->priv->context);
+    test->priv->result_flush_source = source;
+  }
+}
+
 /* Only allow alphanumeric characters and dash */
 gboolean
 check_valid_label (const char *label)
@@ -504,6 +964,20 @@ check_valid_label (const char *label)
   return TRUE;
 }
 
+/* Appends str to s as a JSON string */
+void
+json_append_string (GString * s, const char *str)
+{
+  g_string_append_c (s, '"');
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\' || (guchar) * str < 0x20)
+      g_string_append_printf (s, "\\u%04x", (guchar) * str);
+    else
+      g_string_append_c (s, *str);
+  }
+  g_string_append_c (s, '"');
+}
+
 static gboolean
 check_valid_type (GType type)
 {
@@ -518,8 +992,8 @@ static void
 insanity_test_ping_unlocked (InsanityTest * test)
 {
   if (!test->priv->standalone) {
-    send_signal (test->priv->conn, "remotePingSignal", test->priv->name,
-        DBUS_TYPE_INVALID);
+    test->priv->pending_ping = TRUE;
+    queue_results_flush_unlocked (test);
   } else {
     test->priv->timeout_end_time =
         g_get_monotonic_time () + test->priv->timeout * G_TIME_SPAN_SECOND;
@@ -555,7 +1029,8 @@ insanity_test_validate_checklist_item (InsanityTest * test, const char *label,
      and do nothing if success is TRUE. This ends up doing a AND operation on all booleans
      passed for that checklist item (ie, a checklist item succeeds only if all calls to
      validate for that item succeed, and fails if any call to validate for that item fails). */
-  if (g_hash_table_lookup (test->priv->checklist_results, label) != NULL) {
+  if (g_hash_table_lookup_extended (test->priv->checklist_results, label,
+          NULL, NULL)) {
     if (success) {
       UNLOCK (test);
       return;
@@ -571,10 +1046,14 @@ insanity_test_validate_checklist_item (InsanityTest * test, const char *label,
           success ? "PASS" : "FAIL");
     }
   } else {
-    const char *desc = description ? description : "";
-    send_signal (test->priv->conn, "remoteValidateChecklistItemSignal",
-        test->priv->name, DBUS_TYPE_STRING, &label, DBUS_TYPE_BOOLEAN, &success,
-        DBUS_TYPE_STRING, &desc, DBUS_TYPE_INVALID);
+    ResultRecord r = { 0 };
+
+    r.kind = RESULT_CHECKLIST;
+    r.label = g_strdup (label);
+    r.success = success;
+    r.description = g_strdup (description);
+    g_array_append_val (test->priv->pending_results, r);
+    queue_results_flush_unlocked (test);
   }
 
   g_hash_table_insert (test->priv->checklist_results, g_strdup (label),
@@ -582,73 +1061,170 @@ insanity_test_validate_checklist_item (InsanityTest * test, const char *label,
   UNLOCK (test);
 }
 
+/* Reports the items validated through handles since the last time.
+   Called with the lock held. */
 static void
-insanity_test_set_extra_info_internal (InsanityTest * test, const char *label,
-    const GValue * data, gboolean locked)
+report_checklist_states_unlocked (InsanityTest * test)
 {
-  GType glib_type;
-  const char *dbus_type;
-  dbus_int32_t int32_value;
-  dbus_uint32_t uint32_value;
-  dbus_int64_t int64_value;
-  dbus_uint64_t uint64_value;
-  dbus_bool_t bool_value;
-  double double_value;
-  const char *string_value;
-  void *dataptr = NULL;
+  const char *label;
+  gboolean success;
+  guint n, state;
 
-  if (!locked)
-    LOCK (test);
+  for (n = 0; n < test->priv->checklist_labels->len; ++n) {
+    state = g_atomic_int_get (&test->priv->checklist_states[n]);
+    if (state == test->priv->checklist_reported[n])
+      continue;
+    test->priv->checklist_reported[n] = state;
+
+    /* same as insanity_test_validate_checklist_item, a pass does not
+       override an earlier result */
+    label = g_ptr_array_index (test->priv->checklist_labels, n);
+    success = !(state & CHECKLIST_FAILED);
+    if (success && g_hash_table_lookup_extended (test->priv->checklist_results,
+            label, NULL, NULL))
+      continue;
 
-  if (test->priv->standalone) {
-    char *s = g_strdup_value_contents (data);
-    insanity_test_printf (test, "Extra info: %s: %s\n", label, s);
-    g_free (s);
-    if (!locked)
-      UNLOCK (test);
-    return;
-  }
+    if (test->priv->standalone) {
+      insanity_test_printf (test, "checklist item: %s: %s\n", label,
+          success ? "PASS" : "FAIL");
+    } else {
+      ResultRecord r = { 0 };
 
-  glib_type = G_VALUE_TYPE (data);
-  if (glib_type == G_TYPE_INT) {
-    int32_value = g_value_get_int (data);
-    dbus_type = "i";
-    dataptr = &int32_value;
-  } else if (glib_type == G_TYPE_UINT) {
-    uint32_value = g_value_get_uint (data);
-    dbus_type = "u";
-    dataptr = &uint32_value;
-  } else if (glib_type == G_TYPE_INT64) {
-    int64_value = g_value_get_int64 (data);
-    dbus_type = "x";
-    dataptr = &int64_value;
-  } else if (glib_type == G_TYPE_UINT64) {
-    uint64_value = g_value_get_uint64 (data);
-    dbus_type = "t";
-    dataptr = &uint64_value;
-  } else if (glib_type == G_TYPE_DOUBLE) {
-    double_value = g_value_get_double (data);
-    dbus_type = "d";
-    dataptr = &double_value;
-  } else if (glib_type == G_TYPE_BOOLEAN) {
-    bool_value = g_value_get_boolean (data) ? 0 : 1;
-    dbus_type = "b";
-    dataptr = &bool_value;
-  } else if (glib_type == G_TYPE_STRING) {
-    string_value = g_value_get_string (data);
-    dbus_type = "s";
-    dataptr = &string_value;
-  } else {
-    /* Add more if needed, there doesn't seem to be a glib "glib to dbus" conversion public API,
-       but if I missed one, it could replace the above. */
+      r.kind = RESULT_CHECKLIST;
+      r.label = g_strdup (label);
+      r.success = success;
+      g_array_append_val (test->priv->pending_results, r);
+      queue_results_flush_unlocked (test);
+    }
+
+    g_hash_table_insert (test->priv->checklist_results, g_strdup (label),
+        (success ? ((gpointer) 1) : ((gpointer) 0)));
   }
+}
 
-  if (dataptr) {
-    send_signal (test->priv->conn, "remoteExtraInfoSignal", test->priv->name,
-        DBUS_TYPE_STRING, &label, DBUS_TYPE_VARIANT, dbus_type, dataptr,
-        DBUS_TYPE_INVALID);
-  } else {
-    char *s = g_strdup_value_contents (data);
+/**
+ * insanity_test_get_checklist_handle:
+ * @test: a #InsanityTest to operate on
+ * @label: the label of the checklist item
+ *
+ * Resolves a checklist item once, for use with
+ * insanity_test_validate_checklist_handle.
+ *
+ * Returns: a handle for the checklist item, or -1 if there is no such item.
+ */
+gint
+insanity_test_get_checklist_handle (InsanityTest * test, const char *label)
+{
+  ChecklistItem *i;
+
+  g_return_val_if_fail (INSANITY_IS_TEST (test), -1);
+  g_return_val_if_fail (label != NULL, -1);
+
+  i = g_hash_table_lookup (test->priv->test_checklist, label);
+  g_return_val_if_fail (i != NULL, -1);
+
+  return i->handle;
+}
+
+/**
+ * insanity_test_validate_checklist_handle:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_get_checklist_handle
+ * @success: whether the checklist item passed, or failed
+ *
+ * Declares a given checklist item as either passed, or failed, like
+ * insanity_test_validate_checklist_item, but cheaply enough to be called
+ * for every buffer from any thread. Validating an item again with the
+ * same result only costs an atomic read. Only changes are reported, and
+ * the test pings the runner at most once a second from here.
+ */
+void
+insanity_test_validate_checklist_handle (InsanityTest * test, gint handle,
+    gboolean success)
+{
+  volatile guint *state;
+  guint bit = success ? CHECKLIST_PASSED : CHECKLIST_FAILED;
+  gint64 now, last;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (handle >= 0
+      && (guint) handle < test->priv->checklist_labels->len);
+
+  state = &test->priv->checklist_states[handle];
+  if (!(g_atomic_int_get (state) & bit)
+      && !(g_atomic_int_or (state, bit) & bit)) {
+    LOCK (test);
+    insanity_test_ping_unlocked (test);
+    report_checklist_states_unlocked (test);
+    UNLOCK (test);
+    return;
+  }
+
+  now = g_get_monotonic_time ();
+  last = __atomic_load_n (&test->priv->checklist_ping_time, __ATOMIC_RELAXED);
+  if (now - last >= G_TIME_SPAN_SECOND
+      && __atomic_compare_exchange_n (&test->priv->checklist_ping_time, &last,
+          now, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    insanity_test_ping (test);
+}
+
+static void
+record_benchmark_value (InsanityTest * test, const char *label,
+    const GValue * data)
+{
+  double value;
+
+  switch (G_VALUE_TYPE (data)) {
+    case G_TYPE_INT:
+      value = g_value_get_int (data);
+      break;
+    case G_TYPE_UINT:
+      value = g_value_get_uint (data);
+      break;
+    case G_TYPE_INT64:
+      value = g_value_get_int64 (data);
+      break;
+    case G_TYPE_UINT64:
+      value = g_value_get_uint64 (data);
+      break;
+    case G_TYPE_DOUBLE:
+      value = g_value_get_double (data);
+      break;
+    default:
+      return;
+  }
+  benchmark_record (test->priv->benchmark, label, value);
+}
+
+static void
+insanity_test_set_extra_info_internal (InsanityTest * test, const char *label,
+    const GValue * data, gboolean locked)
+{
+  ResultRecord r = { 0 };
+
+  if (!locked)
+    LOCK (test);
+
+  if (test->priv->standalone) {
+    char *s = g_strdup_value_contents (data);
+    insanity_test_printf (test, "Extra info: %s: %s\n", label, s);
+    g_free (s);
+    if (test->priv->benchmark_collecting)
+      record_benchmark_value (test, label, data);
+    if (!locked)
+      UNLOCK (test);
+    return;
+  }
+
+  if (check_valid_type (G_VALUE_TYPE (data))) {
+    r.kind = RESULT_EXTRA_INFO;
+    r.label = g_strdup (label);
+    g_value_init (&r.value, G_VALUE_TYPE (data));
+    g_value_copy (data, &r.value);
+    g_array_append_val (test->priv->pending_results, r);
+    queue_results_flush_unlocked (test);
+  } else {
+    char *s = g_strdup_value_contents (data);
     g_critical ("Unsupported extra info: %s\n", s);
     g_free (s);
   }
@@ -666,6 +1242,10 @@ insanity_test_set_extra_info_internal (InsanityTest * test, const char *label,
  * Allows a test to supply any relevant information of interest.
  * As an example, Insanity uses this system to record the CPU load
  * used by a given test, the data here being an integer.
+ *
+ * An extra info holds a single value: setting it again replaces it.
+ * The runner records the extra infos of each iteration separately, so
+ * only the last iteration's value is left in standalone mode.
  */
 void
 insanity_test_set_extra_info (InsanityTest * test, const char *label,
@@ -681,6 +1261,142 @@ insanity_test_set_extra_info (InsanityTest * test, const char *label,
   insanity_test_set_extra_info_internal (test, label, data, FALSE);
 }
 
+/**
+ * insanity_test_get_sample_handle:
+ * @test: a #InsanityTest to operate on
+ * @label: the label of the sample, as declared with insanity_test_add_sample
+ *
+ * Resolves a sample label once, for use with
+ * insanity_test_emit_sample_handle.
+ *
+ * Returns: a handle for the sample, or -1 if there is no such sample.
+ */
+gint
+insanity_test_get_sample_handle (InsanityTest * test, const char *label)
+{
+  gpointer handle;
+
+  g_return_val_if_fail (INSANITY_IS_TEST (test), -1);
+  g_return_val_if_fail (label != NULL, -1);
+
+  handle = g_hash_table_lookup (test->priv->sample_handles, label);
+  g_return_val_if_fail (handle != NULL, -1);
+
+  return GPOINTER_TO_INT (handle) - 1;
+}
+
+/**
+ * insanity_test_emit_sample_handle:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_get_sample_handle
+ * @value: the value of the sample
+ *
+ * Records a timestamped value, for data reported too often to go through
+ * insanity_test_set_extra_info, like one value per buffer or frame.
+ * Samples are written to memory shared with the runner, without making
+ * any system call or taking any lock, and can be emitted from any thread.
+ * The runner collects them in the "samples-file" output file.
+ *
+ * Samples are dropped if the runner did not set up shared memory for
+ * them (as in standalone mode), or if it does not keep up.
+ */
+void
+insanity_test_emit_sample_handle (InsanityTest * test, gint handle,
+    double value)
+{
+#ifdef USE_SAMPLE_RING
+  SampleRingHeader *ring;
+  SampleRecord *r;
+  guint64 head, tail;
+#endif
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (handle >= 0
+      && (guint) handle < test->priv->sample_labels->len);
+
+#ifdef USE_SAMPLE_RING
+  /* Both are full barriers: unmap_sample_ring either sees us here, or
+     we see the ring is gone */
+  g_atomic_int_inc (&test->priv->sample_emitters);
+  ring = g_atomic_pointer_get (&test->priv->sample_ring);
+  if (!ring)
+    goto done;
+
+  head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+  do {
+    tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= ring->capacity) {
+      __atomic_fetch_add (&ring->dropped, 1, __ATOMIC_RELAXED);
+      goto done;
+    }
+  } while (!__atomic_compare_exchange_n (&ring->head, &head, head + 1, TRUE,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  r = (SampleRecord *) (ring + 1) + (head & (ring->capacity - 1));
+  r->timestamp = g_get_monotonic_time ();
+  r->value = value;
+  g_strlcpy (r->label, g_ptr_array_index (test->priv->sample_labels, handle),
+      sizeof (r->label));
+  __atomic_store_n (&r->seq, head + 1, __ATOMIC_RELEASE);
+
+done:
+  g_atomic_int_add (&test->priv->sample_emitters, -1);
+#else
+  (void) value;
+#endif
+}
+
+/**
+ * insanity_test_emit_sample:
+ * @test: a #InsanityTest to operate on
+ * @label: the label of the sample, as declared with insanity_test_add_sample
+ * @value: the value of the sample
+ *
+ * Records a timestamped value, like insanity_test_emit_sample_handle.
+ * Tests emitting samples at high frequency should resolve the label once
+ * with insanity_test_get_sample_handle instead.
+ */
+void
+insanity_test_emit_sample (InsanityTest * test, const char *label,
+    double value)
+{
+  gint handle;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (label != NULL);
+
+  handle = insanity_test_get_sample_handle (test, label);
+  if (handle >= 0)
+    insanity_test_emit_sample_handle (test, handle, value);
+}
+
+/**
+ * insanity_test_histogram_record:
+ * @test: a #InsanityTest instance to operate on.
+ * @label: the histogram's label
+ * @value: the value to record
+ *
+ * This function records a value in a histogram declared with
+ * insanity_test_add_histogram.
+ *
+ * It does not take any lock, and may be called from any thread
+ * while the test is running.
+ */
+void
+insanity_test_histogram_record (InsanityTest * test, const char *label,
+    guint64 value)
+{
+  Histogram *histogram;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (label != NULL);
+
+  histogram = g_hash_table_lookup (test->priv->test_histograms, label);
+  g_return_if_fail (histogram != NULL);
+
+  histogram_record (histogram, value);
+}
+
 void
 insanity_test_ping (InsanityTest * test)
 {
@@ -719,9 +1435,12 @@ insanity_test_done (InsanityTest * test)
   g_return_if_fail (INSANITY_IS_TEST (test));
 
   LOCK (test);
+  if (test->priv->runlevel == rl_started && !test->priv->done_time)
+    test->priv->done_time = monotonic_time_ns ();
   if (!test->priv->standalone) {
-    send_signal (test->priv->conn, "remoteDoneSignal", test->priv->name,
-        DBUS_TYPE_INVALID);
+    flush_results_unlocked (test);
+    send_signal (test->priv->conn, INSANITY_TEST_INTERFACE, "remoteDoneSignal",
+        test->priv->name, DBUS_TYPE_INVALID);
   }
   UNLOCK (test);
 
@@ -730,12 +1449,187 @@ insanity_test_done (InsanityTest * test)
   UNLOCK_SIGNAL (test);
 }
 
+#ifdef USE_SAMPLE_RING
+static void
+unmap_sample_ring (InsanityTest * test)
+{
+  gpointer ring;
+
+  LOCK (test);
+  ring = test->priv->sample_ring;
+  g_atomic_pointer_set (&test->priv->sample_ring, NULL);
+  /* streaming threads may still be emitting samples during teardown */
+  while (g_atomic_int_get (&test->priv->sample_emitters))
+    g_thread_yield ();
+  if (ring)
+    munmap (ring, test->priv->sample_ring_size);
+  test->priv->sample_ring_size = 0;
+  UNLOCK (test);
+}
+
+/* The ring is an optional third argument to remoteSetUp */
+static void
+map_sample_ring (InsanityTest * test, DBusMessage * msg)
+{
+  DBusMessageIter iter;
+  SampleRingHeader *ring;
+  struct stat st;
+  int fd = -1;
+  gsize size;
+
+  unmap_sample_ring (test);
+
+  if (!dbus_message_iter_init (msg, &iter) || !dbus_message_iter_next (&iter)
+      || !dbus_message_iter_next (&iter)
+      || dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_UNIX_FD)
+    return;
+  dbus_message_iter_get_basic (&iter, &fd);
+
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (SampleRingHeader)) {
+    g_critical ("Invalid sample ring\n");
+    close (fd);
+    return;
+  }
+  size = st.st_size;
+  ring = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (ring == MAP_FAILED) {
+    g_critical ("Failed to map sample ring (%s)\n", g_strerror (errno));
+    return;
+  }
+
+  if (ring->magic != SAMPLE_RING_MAGIC || ring->version != SAMPLE_RING_VERSION
+      || ring->record_size != sizeof (SampleRecord) || ring->capacity == 0
+      || (ring->capacity & (ring->capacity - 1))
+      || size < sizeof (SampleRingHeader)
+      + (gsize) ring->capacity * sizeof (SampleRecord)) {
+    g_critical ("Invalid sample ring\n");
+    munmap (ring, size);
+    return;
+  }
+
+  LOCK (test);
+  test->priv->sample_ring_size = size;
+  g_atomic_pointer_set (&test->priv->sample_ring, ring);
+  UNLOCK (test);
+}
+#endif
+
+static void update_log_categories (InsanityTest * test);
+
+static void
+close_log_writer (InsanityTest * test)
+{
+  LogWriter *writer = test->priv->log_writer;
+
+  if (!writer)
+    return;
+
+  /* Both are full barriers, see log_enabled_v */
+  g_atomic_pointer_set (&test->priv->log_writer, NULL);
+  while (g_atomic_int_get (&test->priv->log_emitters))
+    g_thread_yield ();
+  log_writer_free (writer);
+  if (test->priv->log_output != stdout && test->priv->log_output != stderr)
+    fclose (test->priv->log_output);
+  test->priv->log_output = NULL;
+  g_free (test->priv->log_filename);
+  test->priv->log_filename = NULL;
+}
+
+/* Logs are written by a LogWriter thread, which is kept from one setup
+   to the next if the log-file and log-format arguments stay the same */
+static void
+set_up_log_writer (InsanityTest * test, const char *filename,
+    const char *format)
+{
+  gboolean binary = FALSE;
+  /* stdout carries the benchmark report in benchmark mode */
+  FILE *out = test->priv->benchmark ? stderr : stdout;
+
+  if (!g_ascii_strcasecmp (format, "binary")) {
+    binary = TRUE;
+  } else if (g_ascii_strcasecmp (format, "text")) {
+    g_critical ("Invalid log format: %s - using text\n", format);
+  }
+
+  if (test->priv->log_writer && test->priv->log_binary == binary
+      && !g_strcmp0 (test->priv->log_filename, filename))
+    return;
+
+  close_log_writer (test);
+
+  if (*filename) {
+    out = g_fopen (filename, binary ? "wb" : "w");
+    if (!out) {
+      g_critical ("Failed to open log file %s: %s\n", filename,
+          g_strerror (errno));
+      return;
+    }
+  } else if (!test->priv->standalone) {
+    /* nowhere to log to */
+    return;
+  }
+
+  test->priv->log_output = out;
+  test->priv->log_filename = g_strdup (filename);
+  test->priv->log_binary = binary;
+  g_atomic_pointer_set (&test->priv->log_writer, log_writer_new (out, binary));
+}
+
+static void
+set_uint64_info (InsanityTest * test, const char *label, guint64 v)
+{
+  GValue value = { 0 };
+
+  g_value_init (&value, G_TYPE_UINT64);
+  g_value_set_uint64 (&value, v);
+  insanity_test_set_extra_info_internal (test, label, &value, TRUE);
+  g_value_unset (&value);
+}
+
+static void
+set_phase_duration (InsanityTest * test, const char *label, guint64 since)
+{
+  LOCK (test);
+  set_uint64_info (test, label, monotonic_time_ns () - since);
+  UNLOCK (test);
+}
+
+/* Called with the lock held, at the end of each iteration. Resource
+   usage is for the whole process, so includes other hosted instances. */
+static void
+report_iteration_usage (InsanityTest * test)
+{
+#ifdef USE_CPU_LOAD
+  struct rusage rusage;
+  const struct rusage *start = &test->priv->iteration_rusage;
+
+  getrusage (RUSAGE_SELF, &rusage);
+  set_uint64_info (test, "user-time",
+      tv_us_diff (&start->ru_utime, &rusage.ru_utime) * (guint64) 1000);
+  set_uint64_info (test, "system-time",
+      tv_us_diff (&start->ru_stime, &rusage.ru_stime) * (guint64) 1000);
+  set_uint64_info (test, "voluntary-context-switches",
+      rusage.ru_nvcsw - start->ru_nvcsw);
+  set_uint64_info (test, "involuntary-context-switches",
+      rusage.ru_nivcsw - start->ru_nivcsw);
+  set_uint64_info (test, "minor-faults", rusage.ru_minflt - start->ru_minflt);
+  set_uint64_info (test, "major-faults", rusage.ru_majflt - start->ru_majflt);
+#else
+  (void) test;
+#endif
+}
+
 static gboolean
 on_setup (InsanityTest * test)
 {
   GValue log_level = { 0 };
+  GValue log_file = { 0 };
+  GValue log_format = { 0 };
   gboolean ret = TRUE;
   const char *log_level_string, *ptr;
+  guint64 t0;
 
   LOCK (test);
   if (test->priv->runlevel != rl_idle) {
@@ -744,6 +1638,8 @@ on_setup (InsanityTest * test)
   }
   UNLOCK (test);
 
+  t0 = monotonic_time_ns ();
+
   insanity_test_get_argument (test, "log-level", &log_level);
   LOCK (test);
   log_level_string = g_value_get_string (&log_level);
@@ -789,7 +1685,16 @@ on_setup (InsanityTest * test)
   UNLOCK (test);
   g_value_unset (&log_level);
 
+  insanity_test_get_argument (test, "log-file", &log_file);
+  insanity_test_get_argument (test, "log-format", &log_format);
+  set_up_log_writer (test, g_value_get_string (&log_file),
+      g_value_get_string (&log_format));
+  g_value_unset (&log_file);
+  g_value_unset (&log_format);
+  update_log_categories (test);
+
   g_signal_emit (test, setup_signal, 0, &ret);
+  set_phase_duration (test, "setup-duration", t0);
 
   LOCK (test);
 
@@ -800,71 +1705,315 @@ on_setup (InsanityTest * test)
   return ret;
 }
 
-static gboolean
-on_start (InsanityTest * test)
+/* Called with the lock held */
+static void
+sample_usage_unlocked (InsanityTest * test)
 {
-  gboolean ret = TRUE;
-
-  if (test->priv->runlevel != rl_setup)
-    return FALSE;
+  MemoryStatus status;
 
-  g_signal_emit (test, start_signal, 0, &ret);
-  test->priv->runlevel = rl_started;
-  return ret;
+  if (memory_read_status (&status))
+    test->priv->peak_rss = MAX (test->priv->peak_rss, status.rss);
+  if (test->priv->thread_usage)
+    thread_usage_sample (test->priv->thread_usage);
 }
 
-static void
-on_stop (InsanityTest * test)
+/* /proc is read without the lock, which the test threads need */
+static gboolean
+sample_usage (gpointer data)
 {
-  if (test->priv->runlevel != rl_started)
-    return;
+  InsanityTest *test = data;
+  ThreadSnapshot *snapshot = NULL;
+  MemoryStatus status;
+  gboolean have_status, threads;
 
-  g_signal_emit (test, stop_signal, 0, NULL);
+  LOCK (test);
+  threads = test->priv->thread_usage != NULL;
+  UNLOCK (test);
+
+  have_status = memory_read_status (&status);
+  if (threads)
+    snapshot = thread_usage_read ();
 
   LOCK (test);
-  test->priv->runlevel = rl_setup;
-  test->priv->iteration++;
+  if (have_status)
+    test->priv->peak_rss = MAX (test->priv->peak_rss, status.rss);
+  if (test->priv->thread_usage)
+    thread_usage_add (test->priv->thread_usage, snapshot);
+  else if (snapshot)
+    thread_snapshot_free (snapshot);
   UNLOCK (test);
+
+  return TRUE;
 }
 
 static void
-on_teardown (InsanityTest * test)
+start_sampling (InsanityTest * test)
 {
-  if (test->priv->runlevel != rl_setup)
-    return;
+  GValue thread_cpu_usage = { 0 };
+  GValue interval = { 0 };
+  GValue perf_counters = { 0 };
+  PerfCounters *counters = NULL;
+  GSource *source;
+  MemoryStatus status;
+
+  insanity_test_get_argument (test, "thread-cpu-usage", &thread_cpu_usage);
+  insanity_test_get_argument (test, "sampling-interval", &interval);
+  insanity_test_get_argument (test, "perf-counters", &perf_counters);
+
+  /* counters are opened for every thread of the process, which takes a
+     while: not with the lock held. See insanityperf.c. */
+  if (g_value_get_boolean (&perf_counters))
+    counters = perf_counters_start ();
 
   LOCK (test);
-  gather_end_of_test_info (test);
-  UNLOCK (test);
+  test->priv->iteration_rss = 0;
+  test->priv->peak_rss = 0;
+  if (memory_read_status (&status)) {
+    test->priv->iteration_rss = status.rss;
+    test->priv->peak_rss = status.rss;
+  }
+  /* this is process wide, so VmHWM may be reset by another hosted
+     instance meanwhile, the samples taken below make up for it */
+  test->priv->peak_rss_reset = memory_reset_peak ();
+
+  if (g_value_get_boolean (&thread_cpu_usage)) {
+    if (!test->priv->thread_usage)
+      test->priv->thread_usage = thread_usage_new ();
+    thread_usage_reset (test->priv->thread_usage);
+    thread_usage_sample (test->priv->thread_usage);
+  }
 
-  g_signal_emit (test, teardown_signal, 0, NULL);
+  /* catch threads which will not live until the end of the iteration,
+     and memory peaks when VmHWM cannot be reset: only then is the
+     timer needed */
+  if (g_value_get_uint (&interval) > 0 && test->priv->context
+      && (test->priv->thread_usage || !test->priv->peak_rss_reset)) {
+    source = g_timeout_source_new (g_value_get_uint (&interval));
+    g_source_set_callback (source, &sample_usage, test, NULL);
+    g_source_attach (source, test->priv->context);
+    test->priv->sampling_source = source;
+  }
 
-  LOCK (test);
-  test->priv->runlevel = rl_idle;
-  test->priv->exit = TRUE;
+  test->priv->perf_counters = counters;
   UNLOCK (test);
+
+  g_value_unset (&thread_cpu_usage);
+  g_value_unset (&interval);
+  g_value_unset (&perf_counters);
 }
 
-static int
-foreach_dbus_array (DBusMessageIter * iter, int (*f) (const char *key,
-        const GValue * value, guintptr userdata), guintptr userdata)
+static void
+set_perf_counter_info (const char *label, guint64 value, gpointer user_data)
+{
+  set_uint64_info (user_data, label, value);
+}
+
+/* Called with the lock held */
+static void
+stop_sampling (InsanityTest * test)
 {
-  DBusMessageIter subiter, subsubiter, subsubsubiter;
-  const char *key;
-  const char *string_value;
-  dbus_uint32_t uint32_value;
-  dbus_int32_t int32_value;
-  int boolean_value;
-  dbus_uint64_t uint64_value;
-  dbus_int64_t int64_value;
-  double double_value;
   GValue value = { 0 };
-  int type;
-  int ret;
+  MemoryStatus status;
+  guint64 bytes;
+  char *report;
+
+  if (test->priv->sampling_source) {
+    g_source_destroy (test->priv->sampling_source);
+    g_source_unref (test->priv->sampling_source);
+    test->priv->sampling_source = NULL;
+  }
 
-  type = dbus_message_iter_get_arg_type (iter);
-  if (type != DBUS_TYPE_ARRAY) {
-    g_critical ("Expected array, got %c\n", type);
+  if (test->priv->perf_counters) {
+    perf_counters_stop (test->priv->perf_counters, &set_perf_counter_info,
+        test);
+    test->priv->perf_counters = NULL;
+  }
+
+  sample_usage_unlocked (test);
+
+  if (memory_read_status (&status)) {
+    if (test->priv->peak_rss_reset)
+      test->priv->peak_rss = MAX (test->priv->peak_rss, status.hwm);
+    set_uint64_info (test, "peak-rss", test->priv->peak_rss);
+    g_value_init (&value, G_TYPE_INT64);
+    g_value_set_int64 (&value,
+        (gint64) status.rss - (gint64) test->priv->iteration_rss);
+    insanity_test_set_extra_info_internal (test, "rss-delta", &value, TRUE);
+    g_value_unset (&value);
+  }
+  if (memory_read_pss (&bytes))
+    set_uint64_info (test, "pss", bytes);
+  if (memory_read_heap_in_use (&bytes))
+    set_uint64_info (test, "heap-in-use", bytes);
+
+  if (!test->priv->thread_usage)
+    return;
+
+  report = thread_usage_report (test->priv->thread_usage);
+  if (report) {
+    g_value_init (&value, G_TYPE_STRING);
+    g_value_take_string (&value, report);
+    insanity_test_set_extra_info_internal (test, "thread-cpu-times", &value,
+        TRUE);
+    g_value_unset (&value);
+  }
+  thread_usage_free (test->priv->thread_usage);
+  test->priv->thread_usage = NULL;
+}
+
+static gboolean
+on_start (InsanityTest * test)
+{
+  gboolean ret = TRUE;
+  guint64 t0;
+
+  if (test->priv->runlevel != rl_setup)
+    return FALSE;
+
+  start_sampling (test);
+
+  t0 = monotonic_time_ns ();
+  LOCK (test);
+  test->priv->iteration_start = t0;
+  test->priv->done_time = 0;
+#ifdef USE_CPU_LOAD
+  getrusage (RUSAGE_SELF, &test->priv->iteration_rusage);
+#endif
+  UNLOCK (test);
+
+  g_signal_emit (test, start_signal, 0, &ret);
+  set_phase_duration (test, "start-duration", t0);
+  test->priv->runlevel = rl_started;
+  return ret;
+}
+
+static void
+set_histogram_info (InsanityTest * test, const char *label,
+    const char *suffix, guint64 v)
+{
+  char *name;
+
+  name = g_strdup_printf ("%s-%s", label, suffix);
+  set_uint64_info (test, name, v);
+  g_free (name);
+}
+
+/* Called with the lock held, once the test has stopped recording */
+static void
+report_histograms (InsanityTest * test)
+{
+  GHashTableIter it;
+  gpointer label, histogram;
+  HistogramSummary summary;
+
+  g_hash_table_iter_init (&it, test->priv->test_histograms);
+  while (g_hash_table_iter_next (&it, &label, &histogram)) {
+    histogram_summarize (histogram, &summary);
+    set_histogram_info (test, label, "count", summary.count);
+    if (summary.count == 0)
+      continue;
+    set_histogram_info (test, label, "min", summary.min);
+    set_histogram_info (test, label, "max", summary.max);
+    set_histogram_info (test, label, "p50", summary.p50);
+    set_histogram_info (test, label, "p90", summary.p90);
+    set_histogram_info (test, label, "p99", summary.p99);
+    set_histogram_info (test, label, "p999", summary.p999);
+  }
+}
+
+static void
+on_stop (InsanityTest * test)
+{
+  guint64 t0;
+
+  if (test->priv->runlevel != rl_started)
+    return;
+
+  t0 = monotonic_time_ns ();
+  LOCK (test);
+  /* before the test gets a chance to stop its threads */
+  stop_sampling (test);
+  /* tests which do not call insanity_test_done run until stopped */
+  if (!test->priv->done_time)
+    test->priv->done_time = t0;
+  set_uint64_info (test, "run-duration",
+      test->priv->done_time - test->priv->iteration_start);
+  UNLOCK (test);
+
+  g_signal_emit (test, stop_signal, 0, NULL);
+
+  LOCK (test);
+  set_uint64_info (test, "stop-duration", monotonic_time_ns () - t0);
+  report_iteration_usage (test);
+  report_histograms (test);
+  test->priv->runlevel = rl_setup;
+  test->priv->iteration++;
+  UNLOCK (test);
+}
+
+static void host_remove_instance_later (InsanityTest * test);
+
+static void
+insanity_test_quit_unlocked (InsanityTest * test)
+{
+  test->priv->exit = TRUE;
+  if (test->priv->host)
+    host_remove_instance_later (test);
+  else if (test->priv->loop)
+    g_main_loop_quit (test->priv->loop);
+}
+
+static void
+on_teardown (InsanityTest * test)
+{
+  guint64 t0;
+
+  if (test->priv->runlevel != rl_setup)
+    return;
+
+  LOCK (test);
+  gather_end_of_test_info (test);
+  UNLOCK (test);
+
+  t0 = monotonic_time_ns ();
+  g_signal_emit (test, teardown_signal, 0, NULL);
+  set_phase_duration (test, "teardown-duration", t0);
+
+  if (test->priv->log_writer)
+    log_writer_flush (test->priv->log_writer);
+
+#ifdef USE_SAMPLE_RING
+  unmap_sample_ring (test);
+#endif
+
+  LOCK (test);
+  test->priv->runlevel = rl_idle;
+  /* workers stay around, waiting for remoteReset */
+  if (!test->priv->worker)
+    insanity_test_quit_unlocked (test);
+  UNLOCK (test);
+}
+
+static int
+foreach_dbus_array (DBusMessageIter * iter, int (*f) (const char *key,
+        const GValue * value, guintptr userdata), guintptr userdata)
+{
+  DBusMessageIter subiter, subsubiter, subsubsubiter;
+  const char *key;
+  const char *string_value;
+  dbus_uint32_t uint32_value;
+  dbus_int32_t int32_value;
+  int boolean_value;
+  dbus_uint64_t uint64_value;
+  dbus_int64_t int64_value;
+  double double_value;
+  GValue value = { 0 };
+  int type;
+  int ret;
+
+  type = dbus_message_iter_get_arg_type (iter);
+  if (type != DBUS_TYPE_ARRAY) {
+    g_critical ("Expected array, got %c\n", type);
     return -1;
   }
   dbus_message_iter_recurse (iter, &subiter);
@@ -1006,6 +2155,50 @@ free_gvalue (void *ptr)
   g_slice_free1 (sizeof (GValue), v);
 }
 
+static void
+free_arg_snapshot (ArgSnapshot * snapshot)
+{
+  guint n;
+
+  if (!snapshot)
+    return;
+  for (n = 0; n < snapshot->n; ++n)
+    g_value_unset (&snapshot->values[n]);
+  g_free (snapshot->values);
+  g_slice_free (ArgSnapshot, snapshot);
+}
+
+/* Publishes the current arguments for the lock free accessors. A
+   snapshot is freed when a second one replaces it, by which time the
+   iteration which used it is over. Called with the lock held. */
+static void
+update_arg_snapshot_unlocked (InsanityTest * test)
+{
+  ArgSnapshot *snapshot;
+  const Argument *arg;
+  const GValue *v;
+  const char *label;
+  guint n;
+
+  snapshot = g_slice_new (ArgSnapshot);
+  snapshot->n = test->priv->arg_labels->len;
+  snapshot->values = g_new0 (GValue, snapshot->n);
+  for (n = 0; n < snapshot->n; ++n) {
+    label = g_ptr_array_index (test->priv->arg_labels, n);
+    v = test->priv->args ? g_hash_table_lookup (test->priv->args, label) : NULL;
+    if (!v) {
+      arg = g_hash_table_lookup (test->priv->test_arguments, label);
+      v = &arg->default_value;
+    }
+    g_value_init (&snapshot->values[n], G_VALUE_TYPE (v));
+    g_value_copy (v, &snapshot->values[n]);
+  }
+
+  free_arg_snapshot (test->priv->retired_arg_snapshot);
+  test->priv->retired_arg_snapshot = test->priv->arg_snapshot;
+  g_atomic_pointer_set (&test->priv->arg_snapshot, snapshot);
+}
+
 static void
 insanity_test_set_args (InsanityTest * test, DBusMessage * msg)
 {
@@ -1029,25 +2222,21 @@ insanity_test_set_args (InsanityTest * test, DBusMessage * msg)
         g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
         &free_gvalue);
     ret = foreach_dbus_array (&iter, &arg_converter, (guintptr) test);
-    if (ret < 0) {
-      UNLOCK (test);
-      return;
-    }
+    if (ret < 0)
+      goto done;
 
     /* output files */
-    if (!dbus_message_iter_next (&iter)) {
-      UNLOCK (test);
-      return;
-    }
+    if (!dbus_message_iter_next (&iter))
+      goto done;
 
     ret =
         foreach_dbus_array (&iter, &output_filename_converter, (guintptr) test);
-    if (ret < 0) {
-      UNLOCK (test);
-      return;
-    }
+    if (ret < 0)
+      goto done;
   }
 
+done:
+  update_arg_snapshot_unlocked (test);
   UNLOCK (test);
 }
 
@@ -1114,6 +2303,160 @@ done:
   return ret;
 }
 
+/**
+ * insanity_test_arg_handle:
+ * @test: a #InsanityTest to operate on
+ * @label: the label of the argument
+ *
+ * Resolves an argument once, for use with the insanity_test_arg_get_*
+ * functions. Those read the values the argument has for the current
+ * iteration without locking nor allocating, so they may be called from
+ * streaming callbacks. Like with insanity_test_get_argument, non-global
+ * arguments only have their value for the iteration between
+ * InsanityTest::start and InsanityTest::stop.
+ *
+ * Returns: a handle for the argument, or -1 if there is no such argument.
+ */
+gint
+insanity_test_arg_handle (InsanityTest * test, const char *label)
+{
+  const Argument *arg;
+
+  g_return_val_if_fail (INSANITY_IS_TEST (test), -1);
+  g_return_val_if_fail (label != NULL, -1);
+
+  arg = g_hash_table_lookup (test->priv->test_arguments, label);
+  g_return_val_if_fail (arg != NULL, -1);
+
+  return arg->handle;
+}
+
+static const GValue *
+get_arg_value (InsanityTest * test, gint handle, GType type)
+{
+  const ArgSnapshot *snapshot;
+  const GValue *v;
+
+  g_return_val_if_fail (INSANITY_IS_TEST (test), NULL);
+
+  snapshot = g_atomic_pointer_get (&test->priv->arg_snapshot);
+  if (!snapshot) {
+    g_critical ("Argument requested but not set up yet\n");
+    return NULL;
+  }
+  g_return_val_if_fail (handle >= 0 && (guint) handle < snapshot->n, NULL);
+
+  v = &snapshot->values[handle];
+  g_return_val_if_fail (G_VALUE_HOLDS (v, type), NULL);
+  return v;
+}
+
+/**
+ * insanity_test_arg_get_string:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: (transfer none): the value of a string argument, which stays
+ * valid until the end of the iteration, or %NULL on error.
+ */
+const char *
+insanity_test_arg_get_string (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_STRING);
+
+  return v ? g_value_get_string (v) : NULL;
+}
+
+/**
+ * insanity_test_arg_get_int:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of an integer argument, or 0 on error.
+ */
+gint
+insanity_test_arg_get_int (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_INT);
+
+  return v ? g_value_get_int (v) : 0;
+}
+
+/**
+ * insanity_test_arg_get_uint:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of an unsigned integer argument, or 0 on error.
+ */
+guint
+insanity_test_arg_get_uint (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_UINT);
+
+  return v ? g_value_get_uint (v) : 0;
+}
+
+/**
+ * insanity_test_arg_get_int64:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of a 64 bit integer argument, or 0 on error.
+ */
+gint64
+insanity_test_arg_get_int64 (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_INT64);
+
+  return v ? g_value_get_int64 (v) : 0;
+}
+
+/**
+ * insanity_test_arg_get_uint64:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of an unsigned 64 bit integer argument, or 0 on error.
+ */
+guint64
+insanity_test_arg_get_uint64 (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_UINT64);
+
+  return v ? g_value_get_uint64 (v) : 0;
+}
+
+/**
+ * insanity_test_arg_get_double:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of a double argument, or 0 on error.
+ */
+gdouble
+insanity_test_arg_get_double (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_DOUBLE);
+
+  return v ? g_value_get_double (v) : 0;
+}
+
+/**
+ * insanity_test_arg_get_boolean:
+ * @test: a #InsanityTest to operate on
+ * @handle: a handle from insanity_test_arg_handle
+ *
+ * Returns: the value of a boolean argument, or %FALSE on error.
+ */
+gboolean
+insanity_test_arg_get_boolean (InsanityTest * test, gint handle)
+{
+  const GValue *v = get_arg_value (test, handle, G_TYPE_BOOLEAN);
+
+  return v ? g_value_get_boolean (v) : FALSE;
+}
+
 /**
  * insanity_test_get_output_filename:
  * @test: a #InsanityTest to operate on
@@ -1189,6 +2532,9 @@ insanity_test_dbus_handler_remoteSetup (InsanityTest * test, DBusMessage * msg,
   gboolean ret;
 
   insanity_test_set_args (test, msg);
+#ifdef USE_SAMPLE_RING
+  map_sample_ring (test, msg);
+#endif
   ret = on_setup (test);
 
   dbus_message_iter_init_append (reply, &iter);
@@ -1229,6 +2575,64 @@ insanity_test_dbus_handler_remoteTearDown (InsanityTest * test,
   on_teardown (test);
 }
 
+/* Worker mode: once torn down, a test can be handed over to a new test
+   instance on the runner side. State from the previous run is dropped,
+   and the test moves to the bus name and object path of the new uuid
+   once the reply has been sent. */
+static gboolean insanity_test_rename_idle (gpointer data);
+
+static void
+insanity_test_dbus_handler_remoteReset (InsanityTest * test,
+    DBusMessage * msg, DBusMessage * reply)
+{
+  DBusMessageIter iter;
+  const char *uuid = NULL;
+  gboolean ret = FALSE;
+  GSource *source;
+
+  if (dbus_message_iter_init (msg, &iter)
+      && dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)
+    dbus_message_iter_get_basic (&iter, &uuid);
+
+  LOCK (test);
+  if (!test->priv->worker) {
+    g_critical ("remoteReset called on a test not running as a worker\n");
+  } else if (test->priv->runlevel != rl_idle) {
+    g_critical ("remoteReset called before teardown\n");
+  } else if (!uuid || !*uuid) {
+    g_critical ("remoteReset called without a uuid\n");
+  } else {
+    if (test->priv->args) {
+      g_hash_table_destroy (test->priv->args);
+      test->priv->args = NULL;
+    }
+    g_hash_table_remove_all (test->priv->filename_cache);
+    update_arg_snapshot_unlocked (test);
+    g_hash_table_remove_all (test->priv->checklist_results);
+    memset ((guint *) test->priv->checklist_states, 0,
+        test->priv->checklist_labels->len * sizeof (guint));
+    memset (test->priv->checklist_reported, 0,
+        test->priv->checklist_labels->len * sizeof (guint));
+    clear_results_unlocked (test);
+    test->priv->cpu_load = -1;
+    test->priv->iteration = 0;
+
+    g_free (test->priv->next_uuid);
+    test->priv->next_uuid = g_strdup (uuid);
+    source = g_idle_source_new ();
+    g_source_set_callback (source, &insanity_test_rename_idle, test, NULL);
+    g_source_attach (source, test->priv->context);
+    g_source_unref (source);
+    ret = TRUE;
+  }
+  UNLOCK (test);
+
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &ret)) {
+    g_error ("Out Of Memory!\n");
+  }
+}
+
 static const struct
 {
   const char *method;
@@ -1238,7 +2642,8 @@ static const struct
   "remoteSetUp", &insanity_test_dbus_handler_remoteSetup}, {
   "remoteStart", &insanity_test_dbus_handler_remoteStart}, {
   "remoteStop", &insanity_test_dbus_handler_remoteStop}, {
-"remoteTearDown", &insanity_test_dbus_handler_remoteTearDown},};
+  "remoteTearDown", &insanity_test_dbus_handler_remoteTearDown}, {
+"remoteReset", &insanity_test_dbus_handler_remoteReset},};
 
 static gboolean
 insanity_call_interface (InsanityTest * test, DBusMessage * msg)
@@ -1256,6 +2661,8 @@ insanity_call_interface (InsanityTest * test, DBusMessage * msg)
         (*dbus_test_handlers[n].handler) (test, msg, reply);
 
       LOCK (test);
+      /* results must reach the runner before the method returns */
+      flush_results_unlocked (test);
       if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
         g_error ("Out Of Memory!\n");
       } else {
@@ -1264,30 +2671,870 @@ insanity_call_interface (InsanityTest * test, DBusMessage * msg)
       UNLOCK (test);
       dbus_message_unref (reply);
 
-      return TRUE;
-    }
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* libdbus main loop integration: the connection's watches and timeouts
+   are turned into GSources on the test's own GMainContext, so the remote
+   side sleeps until there is something to read or write, and replies go
+   out as soon as they are queued. */
+
+static gboolean
+dbus_watch_dispatch (GIOChannel * channel, GIOCondition condition,
+    gpointer data)
+{
+  DBusWatch *watch = data;
+  unsigned int flags = 0;
+
+  (void) channel;
+
+  if (condition & G_IO_IN)
+    flags |= DBUS_WATCH_READABLE;
+  if (condition & G_IO_OUT)
+    flags |= DBUS_WATCH_WRITABLE;
+  if (condition & G_IO_ERR)
+    flags |= DBUS_WATCH_ERROR;
+  if (condition & G_IO_HUP)
+    flags |= DBUS_WATCH_HANGUP;
+
+  dbus_watch_handle (watch, flags);
+  return TRUE;
+}
+
+static dbus_bool_t
+dbus_watch_add (DBusWatch * watch, void *data)
+{
+  GMainContext *context = data;
+  GIOChannel *channel;
+  GSource *source;
+  GIOCondition condition = G_IO_ERR | G_IO_HUP;
+  unsigned int flags;
+
+  if (!dbus_watch_get_enabled (watch))
+    return TRUE;
+
+  flags = dbus_watch_get_flags (watch);
+  if (flags & DBUS_WATCH_READABLE)
+    condition |= G_IO_IN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    condition |= G_IO_OUT;
+
+  channel = g_io_channel_unix_new (dbus_watch_get_unix_fd (watch));
+  source = g_io_create_watch (channel, condition);
+  g_source_set_callback (source, (GSourceFunc) & dbus_watch_dispatch, watch,
+      NULL);
+  g_source_attach (source, context);
+  g_io_channel_unref (channel);
+
+  dbus_watch_set_data (watch, source, NULL);
+  return TRUE;
+}
+
+static void
+dbus_watch_remove (DBusWatch * watch, void *data)
+{
+  GSource *source = dbus_watch_get_data (watch);
+
+  (void) data;
+
+  if (source) {
+    g_source_destroy (source);
+    g_source_unref (source);
+    dbus_watch_set_data (watch, NULL, NULL);
+  }
+}
+
+static void
+dbus_watch_toggled (DBusWatch * watch, void *data)
+{
+  dbus_watch_remove (watch, data);
+  dbus_watch_add (watch, data);
+}
+
+static gboolean
+dbus_timeout_dispatch (gpointer data)
+{
+  dbus_timeout_handle ((DBusTimeout *) data);
+  return TRUE;
+}
+
+static dbus_bool_t
+dbus_timeout_add (DBusTimeout * timeout, void *data)
+{
+  GMainContext *context = data;
+  GSource *source;
+
+  if (!dbus_timeout_get_enabled (timeout))
+    return TRUE;
+
+  source = g_timeout_source_new (dbus_timeout_get_interval (timeout));
+  g_source_set_callback (source, &dbus_timeout_dispatch, timeout, NULL);
+  g_source_attach (source, context);
+
+  dbus_timeout_set_data (timeout, source, NULL);
+  return TRUE;
+}
+
+static void
+dbus_timeout_remove (DBusTimeout * timeout, void *data)
+{
+  GSource *source = dbus_timeout_get_data (timeout);
+
+  (void) data;
+
+  if (source) {
+    g_source_destroy (source);
+    g_source_unref (source);
+    dbus_timeout_set_data (timeout, NULL, NULL);
+  }
+}
+
+static void
+dbus_timeout_toggled (DBusTimeout * timeout, void *data)
+{
+  dbus_timeout_remove (timeout, data);
+  dbus_timeout_add (timeout, data);
+}
+
+static gboolean
+dbus_dispatch_idle (gpointer data)
+{
+  DBusConnection *conn = data;
+
+  while (dbus_connection_dispatch (conn) == DBUS_DISPATCH_DATA_REMAINS);
+  return FALSE;
+}
+
+static void
+dbus_schedule_dispatch (DBusConnection * conn, GMainContext * context)
+{
+  GSource *source;
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, &dbus_dispatch_idle,
+      dbus_connection_ref (conn), (GDestroyNotify) & dbus_connection_unref);
+  g_source_attach (source, context);
+  g_source_unref (source);
+}
+
+static void
+dbus_dispatch_status_changed (DBusConnection * conn,
+    DBusDispatchStatus status, void *data)
+{
+  if (status == DBUS_DISPATCH_DATA_REMAINS)
+    dbus_schedule_dispatch (conn, (GMainContext *) data);
+}
+
+static void
+dbus_wakeup_main (void *data)
+{
+  g_main_context_wakeup ((GMainContext *) data);
+}
+
+static void
+dbus_connection_setup_with_context (DBusConnection * conn,
+    GMainContext * context)
+{
+  dbus_connection_set_watch_functions (conn, &dbus_watch_add,
+      &dbus_watch_remove, &dbus_watch_toggled, context, NULL);
+  dbus_connection_set_timeout_functions (conn, &dbus_timeout_add,
+      &dbus_timeout_remove, &dbus_timeout_toggled, context, NULL);
+  dbus_connection_set_dispatch_status_function (conn,
+      &dbus_dispatch_status_changed, context, NULL);
+  dbus_connection_set_wakeup_main_function (conn, &dbus_wakeup_main, context,
+      NULL);
+
+  /* Anything that arrived while we were registering */
+  if (dbus_connection_get_dispatch_status (conn) == DBUS_DISPATCH_DATA_REMAINS)
+    dbus_schedule_dispatch (conn, context);
+}
+
+static void
+dbus_connection_clear_context (DBusConnection * conn)
+{
+  dbus_connection_set_watch_functions (conn, NULL, NULL, NULL, NULL, NULL);
+  dbus_connection_set_timeout_functions (conn, NULL, NULL, NULL, NULL, NULL);
+  dbus_connection_set_dispatch_status_function (conn, NULL, NULL, NULL);
+  dbus_connection_set_wakeup_main_function (conn, NULL, NULL, NULL);
+}
+
+static void
+insanity_test_dbus_introspect (InsanityTest * test, DBusMessage * msg)
+{
+  DBusMessage *reply;
+  DBusMessageIter args;
+  dbus_uint32_t serial = 0;
+  char *introspect_response;
+
+  LOCK (test);
+  introspect_response =
+      g_strdup_printf (INTROSPECT_RESPONSE_TEMPLATE, test->priv->name);
+  reply = dbus_message_new_method_return (msg);
+  dbus_message_iter_init_append (reply, &args);
+  if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING,
+          &introspect_response)) {
+    g_error ("Out Of Memory!\n");
+  } else if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  UNLOCK (test);
+  g_free (introspect_response);
+  dbus_message_unref (reply);
+}
+
+static DBusHandlerResult
+insanity_test_dbus_message (DBusConnection * conn, DBusMessage * msg,
+    void *data)
+{
+  InsanityTest *test = data;
+  const char *interface = dbus_message_get_interface (msg);
+
+  (void) conn;
+
+  /* check this is a method call for the right interface & method */
+  if (dbus_message_is_method_call (msg, "org.freedesktop.DBus.Introspectable",
+          "Introspect")) {
+    insanity_test_dbus_introspect (test, msg);
+  } else if (interface && !strcmp (interface, INSANITY_TEST_INTERFACE)) {
+    if (!insanity_call_interface (test, msg))
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  } else {
+    /*printf("Got unhandled method call: interface %s, method %s\n", dbus_message_get_interface(msg), dbus_message_get_member(msg)); */
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable insanity_test_dbus_vtable = {
+  NULL, &insanity_test_dbus_message, NULL, NULL, NULL, NULL
+};
+
+static DBusHandlerResult
+insanity_test_dbus_filter (DBusConnection * conn, DBusMessage * msg,
+    void *data)
+{
+  InsanityTest *test = data;
+
+  (void) conn;
+
+  /* The runner went away, there is nobody left to tell us to exit */
+  if (dbus_message_is_signal (msg, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+    LOCK (test);
+    insanity_test_quit_unlocked (test);
+    UNLOCK (test);
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static gboolean
+request_name (DBusConnection * conn, const char *bus_name)
+{
+  DBusError err;
+  int ret;
+
+  /* request our name on the bus and check for errors */
+  dbus_error_init (&err);
+  ret =
+      dbus_bus_request_name (conn, bus_name, DBUS_NAME_FLAG_REPLACE_EXISTING,
+      &err);
+  if (dbus_error_is_set (&err)) {
+    g_error ("Name Error (%s)\n", err.message);
+    dbus_error_free (&err);
+    /* Is this supposed to be fatal ? */
+  }
+  if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != ret) {
+    g_error ("Not Primary Owner (%d)\n", ret);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* On a peer-to-peer connection there are no bus names, and so no
+   NameOwnerChanged for the runner to watch: objects announce themselves
+   with these signals instead. */
+static void
+announce (InsanityTest * test, DBusConnection * conn, const char *interface,
+    gboolean connected)
+{
+  send_signal (conn, interface,
+      connected ? "remoteConnectedSignal" : "remoteDisconnectedSignal",
+      test->priv->name, DBUS_TYPE_INVALID);
+}
+
+static gboolean
+insanity_test_claim_name (InsanityTest * test, DBusConnection * conn,
+    const char *uuid)
+{
+  insanity_test_connect (test, conn, uuid);
+
+  if (!test->priv->peer && !request_name (conn, test->priv->bus_name))
+    return FALSE;
+
+  if (!dbus_connection_register_object_path (conn, test->priv->name,
+          &insanity_test_dbus_vtable, test)) {
+    g_error ("Out Of Memory!\n");
+  }
+
+  if (test->priv->peer)
+    announce (test, conn, INSANITY_TEST_INTERFACE, TRUE);
+
+  return TRUE;
+}
+
+static void
+insanity_test_release_name (InsanityTest * test, DBusConnection * conn)
+{
+  DBusError err;
+
+  dbus_connection_unregister_object_path (conn, test->priv->name);
+
+  if (test->priv->peer) {
+    announce (test, conn, INSANITY_TEST_INTERFACE, FALSE);
+    return;
+  }
+
+  dbus_error_init (&err);
+  dbus_bus_release_name (conn, test->priv->bus_name, &err);
+  if (dbus_error_is_set (&err)) {
+    g_critical ("Failed to release name (%s)\n", err.message);
+    dbus_error_free (&err);
+  }
+}
+
+static gboolean
+insanity_test_rename_idle (gpointer data)
+{
+  InsanityTest *test = data;
+  DBusConnection *conn = test->priv->conn;
+  char *uuid;
+
+  LOCK (test);
+  uuid = test->priv->next_uuid;
+  test->priv->next_uuid = NULL;
+  UNLOCK (test);
+
+  if (uuid) {
+    insanity_test_release_name (test, conn);
+    if (!insanity_test_claim_name (test, conn, uuid)) {
+      LOCK (test);
+      insanity_test_quit_unlocked (test);
+      UNLOCK (test);
+    }
+    g_free (uuid);
+  }
+
+  return FALSE;
+}
+
+#ifdef USE_ZYGOTE
+/* Zygote mode: the process loads the test and connects to the bus once,
+   then forks a child for each test instance the runner asks for. The
+   child leaves the zygote's connection and main loop alone, and listens
+   again with a connection of its own under the requested uuid.
+   SIGCHLD is forwarded to a pipe watched from the main loop rather than
+   to a GLib child watch, so the zygote never starts any GLib helper
+   thread a child would inherit in an unknown state. */
+
+/* SIGCHLD pipe, there is only one zygote in a process */
+static int zygote_sigchld_pipe[2] = { -1, -1 };
+
+typedef struct _ForkRequest
+{
+  InsanityTest *test;
+  DBusMessage *msg;
+  char *uuid;
+} ForkRequest;
+
+static void
+zygote_reap_children (InsanityTest * test)
+{
+  pid_t pid;
+  int status;
+  dbus_uint32_t upid;
+  dbus_int32_t returncode;
+
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+    /* same convention as python's subprocess */
+    if (WIFEXITED (status))
+      returncode = WEXITSTATUS (status);
+    else if (WIFSIGNALED (status))
+      returncode = -WTERMSIG (status);
+    else
+      continue;
+
+    upid = pid;
+    LOCK (test);
+    /* the runner is told once, and keeps the status from there */
+    g_hash_table_remove (test->priv->children, GINT_TO_POINTER (pid));
+    send_signal (test->priv->conn, INSANITY_LAUNCHER_INTERFACE,
+        "remoteChildExitSignal", test->priv->name, DBUS_TYPE_UINT32, &upid,
+        DBUS_TYPE_INT32, &returncode, DBUS_TYPE_INVALID);
+    UNLOCK (test);
+  }
+}
+
+static void
+zygote_sigchld_handler (int signum)
+{
+  int saved_errno = errno;
+  char c = 0;
+  ssize_t ret;
+
+  (void) signum;
+
+  /* if the pipe is full, a wakeup is pending anyway */
+  ret = write (zygote_sigchld_pipe[1], &c, 1);
+  (void) ret;
+  errno = saved_errno;
+}
+
+static gboolean
+zygote_sigchld_readable (GIOChannel * channel, GIOCondition condition,
+    gpointer data)
+{
+  char buffer[64];
+
+  (void) channel;
+  (void) condition;
+
+  while (read (zygote_sigchld_pipe[0], buffer, sizeof (buffer)) > 0);
+  zygote_reap_children ((InsanityTest *) data);
+  return TRUE;
+}
+
+static void
+zygote_watch_children (InsanityTest * test)
+{
+  struct sigaction sa;
+  GIOChannel *channel;
+  int n;
+
+  if (pipe (zygote_sigchld_pipe) < 0)
+    g_error ("Failed to create SIGCHLD pipe (%s)\n", g_strerror (errno));
+  for (n = 0; n < 2; n++) {
+    fcntl (zygote_sigchld_pipe[n], F_SETFL,
+        fcntl (zygote_sigchld_pipe[n], F_GETFL) | O_NONBLOCK);
+    fcntl (zygote_sigchld_pipe[n], F_SETFD, FD_CLOEXEC);
+  }
+
+  LOCK (test);
+  test->priv->children = g_hash_table_new (&g_direct_hash, &g_direct_equal);
+  channel = g_io_channel_unix_new (zygote_sigchld_pipe[0]);
+  test->priv->children_source = g_io_create_watch (channel, G_IO_IN);
+  g_source_set_callback (test->priv->children_source,
+      (GSourceFunc) & zygote_sigchld_readable, test, NULL);
+  g_source_attach (test->priv->children_source, test->priv->context);
+  g_io_channel_unref (channel);
+  UNLOCK (test);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = &zygote_sigchld_handler;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &sa, NULL);
+}
+
+/* Also called in each child, which must not keep any of it */
+static void
+zygote_close_sigchld_pipe (void)
+{
+  signal (SIGCHLD, SIG_DFL);
+  close (zygote_sigchld_pipe[0]);
+  close (zygote_sigchld_pipe[1]);
+  zygote_sigchld_pipe[0] = zygote_sigchld_pipe[1] = -1;
+}
+
+static void
+zygote_unwatch_children (InsanityTest * test)
+{
+  LOCK (test);
+  g_source_destroy (test->priv->children_source);
+  g_source_unref (test->priv->children_source);
+  test->priv->children_source = NULL;
+  UNLOCK (test);
+
+  zygote_close_sigchld_pipe ();
+}
+
+static gboolean
+zygote_fork_idle (gpointer data)
+{
+  ForkRequest *req = data;
+  InsanityTest *test = req->test;
+  DBusMessage *reply;
+  dbus_uint32_t serial = 0, upid;
+  pid_t pid;
+  gboolean zygote;
+
+  /* Several fork requests can be dispatched in one main context
+     iteration, which goes on in the child after it quit the loop:
+     the child must not serve the ones left. */
+  LOCK (test);
+  zygote = test->priv->zygote;
+  UNLOCK (test);
+  if (!zygote) {
+    g_free (req->uuid);
+    g_slice_free (ForkRequest, req);
+    return FALSE;
+  }
+
+  pid = fork ();
+  if (pid == 0) {
+    /* The request belongs to the zygote's connection, leave it be */
+    LOCK (test);
+    test->priv->zygote = FALSE;
+    test->priv->fork_uuid = req->uuid;
+    g_main_loop_quit (test->priv->loop);
+    UNLOCK (test);
+    g_slice_free (ForkRequest, req);
+    return FALSE;
+  }
+
+  if (pid < 0) {
+    reply =
+        dbus_message_new_error (req->msg, DBUS_ERROR_SPAWN_FORK_FAILED,
+        g_strerror (errno));
+  } else {
+    LOCK (test);
+    g_hash_table_insert (test->priv->children, GINT_TO_POINTER (pid), NULL);
+    UNLOCK (test);
+
+    upid = pid;
+    reply = dbus_message_new_method_return (req->msg);
+    if (!dbus_message_append_args (reply, DBUS_TYPE_UINT32, &upid,
+            DBUS_TYPE_INVALID)) {
+      g_error ("Out Of Memory!\n");
+    }
+  }
+
+  LOCK (test);
+  if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  UNLOCK (test);
+
+  dbus_message_unref (reply);
+  dbus_message_unref (req->msg);
+  g_free (req->uuid);
+  g_slice_free (ForkRequest, req);
+  return FALSE;
+}
+
+static void
+zygote_handle_fork (InsanityTest * test, DBusMessage * msg)
+{
+  const char *uuid = NULL;
+  ForkRequest *req;
+  GSource *source;
+  DBusMessage *reply;
+  dbus_uint32_t serial = 0;
+
+  if (!dbus_message_get_args (msg, NULL, DBUS_TYPE_STRING, &uuid,
+          DBUS_TYPE_INVALID) || !*uuid) {
+    reply =
+        dbus_message_new_error (msg, DBUS_ERROR_INVALID_ARGS,
+        "remoteFork expects a uuid");
+    LOCK (test);
+    if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+      g_error ("Out Of Memory!\n");
+    }
+    UNLOCK (test);
+    dbus_message_unref (reply);
+    return;
+  }
+
+  /* Fork outside of message dispatching, the child must not find
+     the connection in the middle of it. The reply is sent from there. */
+  req = g_slice_new (ForkRequest);
+  req->test = test;
+  req->msg = dbus_message_ref (msg);
+  req->uuid = g_strdup (uuid);
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, &zygote_fork_idle, req, NULL);
+  g_source_attach (source, test->priv->context);
+  g_source_unref (source);
+}
+
+static void
+zygote_handle_child_status (InsanityTest * test, DBusMessage * msg)
+{
+  dbus_uint32_t upid = 0, serial = 0;
+  dbus_int32_t returncode = -1;
+  dbus_bool_t exited = TRUE;
+  DBusMessage *reply;
+
+  zygote_reap_children (test);
+
+  dbus_message_get_args (msg, NULL, DBUS_TYPE_UINT32, &upid,
+      DBUS_TYPE_INVALID);
+
+  /* The status of children which exited was sent with
+     remoteChildExitSignal, and is not kept */
+  LOCK (test);
+  if (g_hash_table_lookup_extended (test->priv->children,
+          GINT_TO_POINTER (upid), NULL, NULL)) {
+    exited = FALSE;
+    returncode = 0;
+  }
+
+  reply = dbus_message_new_method_return (msg);
+  if (!dbus_message_append_args (reply, DBUS_TYPE_BOOLEAN, &exited,
+          DBUS_TYPE_INT32, &returncode, DBUS_TYPE_INVALID)) {
+    g_error ("Out Of Memory!\n");
+  }
+  if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  UNLOCK (test);
+  dbus_message_unref (reply);
+}
+
+#endif
+
+/* Host mode: the process serves several test instances at once, each
+   with its own bus name and object path on the host's connection. The
+   instances are made by the factory set with
+   insanity_test_set_instance_factory(), and all their method calls are
+   dispatched from the host's main loop. An instance goes away after
+   its teardown. */
+
+static gboolean
+host_remove_instance_idle (gpointer data)
+{
+  InsanityTest *test = data;
+  InsanityTest *host = test->priv->host;
+
+  insanity_test_release_name (test, test->priv->conn);
+
+  LOCK (test);
+  clear_results_unlocked (test);
+  g_main_context_unref (test->priv->context);
+  test->priv->context = NULL;
+  UNLOCK (test);
+
+  LOCK (host);
+  g_hash_table_remove (host->priv->instances, test->priv->name);
+  UNLOCK (host);
+
+  return FALSE;
+}
+
+static void
+host_remove_instance_later (InsanityTest * test)
+{
+  GSource *source;
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, &host_remove_instance_idle, test, NULL);
+  g_source_attach (source, test->priv->context);
+  g_source_unref (source);
+}
+
+static gboolean
+host_create_instance (InsanityTest * host, const char *uuid)
+{
+  InsanityTest *test;
+
+  test = (*host->priv->factory) (host->priv->factory_data);
+  if (!test || !INSANITY_IS_TEST (test)) {
+    g_critical ("Instance factory did not return a test\n");
+    return FALSE;
+  }
+
+  LOCK (test);
+  test->priv->host = host;
+  test->priv->context = g_main_context_ref (host->priv->context);
+  test->priv->keep_unnamed_output_files =
+      host->priv->keep_unnamed_output_files;
+  test->priv->peer = host->priv->peer;
+  test->priv->exit = FALSE;
+  UNLOCK (test);
+
+  if (!insanity_test_claim_name (test, host->priv->conn, uuid)) {
+    g_object_unref (test);
+    return FALSE;
+  }
+
+  LOCK (host);
+  g_hash_table_insert (host->priv->instances, g_strdup (test->priv->name),
+      test);
+  UNLOCK (host);
+
+  return TRUE;
+}
+
+/* The launcher object, exported instead of a test in zygote and host
+   modes */
+
+static void
+launcher_reply_error (InsanityTest * test, DBusMessage * msg,
+    const char *name, const char *message)
+{
+  DBusMessage *reply;
+  dbus_uint32_t serial = 0;
+
+  reply = dbus_message_new_error (msg, name, message);
+  LOCK (test);
+  if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  UNLOCK (test);
+  dbus_message_unref (reply);
+}
+
+static void
+launcher_handle_create_instance (InsanityTest * test, DBusMessage * msg)
+{
+  const char *uuid = NULL;
+  dbus_bool_t ret;
+  DBusMessage *reply;
+  dbus_uint32_t serial = 0;
+
+  if (!dbus_message_get_args (msg, NULL, DBUS_TYPE_STRING, &uuid,
+          DBUS_TYPE_INVALID) || !*uuid) {
+    launcher_reply_error (test, msg, DBUS_ERROR_INVALID_ARGS,
+        "remoteCreateInstance expects a uuid");
+    return;
+  }
+
+  ret = host_create_instance (test, uuid);
+
+  reply = dbus_message_new_method_return (msg);
+  if (!dbus_message_append_args (reply, DBUS_TYPE_BOOLEAN, &ret,
+          DBUS_TYPE_INVALID)) {
+    g_error ("Out Of Memory!\n");
+  }
+  LOCK (test);
+  if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+    g_error ("Out Of Memory!\n");
+  }
+  UNLOCK (test);
+  dbus_message_unref (reply);
+}
+
+static DBusHandlerResult
+launcher_dbus_message (DBusConnection * conn, DBusMessage * msg, void *data)
+{
+  InsanityTest *test = data;
+  DBusMessage *reply;
+  DBusMessageIter args;
+  dbus_uint32_t serial = 0;
+  char *introspect_response;
+
+  (void) conn;
+
+  if (dbus_message_is_method_call (msg, "org.freedesktop.DBus.Introspectable",
+          "Introspect")) {
+    LOCK (test);
+    introspect_response =
+        g_strdup_printf (LAUNCHER_INTROSPECT_RESPONSE_TEMPLATE,
+        test->priv->name);
+    reply = dbus_message_new_method_return (msg);
+    dbus_message_iter_init_append (reply, &args);
+    if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING,
+            &introspect_response)) {
+      g_error ("Out Of Memory!\n");
+    } else if (!dbus_connection_send (test->priv->conn, reply, &serial)) {
+      g_error ("Out Of Memory!\n");
+    }
+    UNLOCK (test);
+    g_free (introspect_response);
+    dbus_message_unref (reply);
+  } else if (dbus_message_is_method_call (msg, INSANITY_LAUNCHER_INTERFACE,
+          "remoteFork")
+      || dbus_message_is_method_call (msg, INSANITY_LAUNCHER_INTERFACE,
+          "remoteChildStatus")) {
+#ifdef USE_ZYGOTE
+    if (test->priv->zygote) {
+      if (!strcmp (dbus_message_get_member (msg), "remoteFork"))
+        zygote_handle_fork (test, msg);
+      else
+        zygote_handle_child_status (test, msg);
+    } else
+#endif
+      launcher_reply_error (test, msg, DBUS_ERROR_NOT_SUPPORTED,
+          "Not running as a zygote");
+  } else if (dbus_message_is_method_call (msg, INSANITY_LAUNCHER_INTERFACE,
+          "remoteCreateInstance")) {
+    if (test->priv->hosting)
+      launcher_handle_create_instance (test, msg);
+    else
+      launcher_reply_error (test, msg, DBUS_ERROR_NOT_SUPPORTED,
+          "Not running as a host");
+  } else {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable launcher_dbus_vtable = {
+  NULL, &launcher_dbus_message, NULL, NULL, NULL, NULL
+};
+
+static gboolean
+launcher_claim_name (InsanityTest * test, DBusConnection * conn,
+    const char *uuid)
+{
+  LOCK (test);
+  test->priv->standalone = FALSE;
+  test->priv->conn = dbus_connection_ref (conn);
+  test->priv->name =
+      g_strdup_printf ("/net/gstreamer/Insanity/Launcher/Launcher%s", uuid);
+  test->priv->bus_name =
+      g_strdup_printf (INSANITY_LAUNCHER_INTERFACE ".Launcher%s", uuid);
+  if (test->priv->hosting) {
+    test->priv->instances =
+        g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
+        &g_object_unref);
+  }
+  UNLOCK (test);
+
+  if (!test->priv->peer && !request_name (conn, test->priv->bus_name))
+    return FALSE;
+
+  if (!dbus_connection_register_object_path (conn, test->priv->name,
+          &launcher_dbus_vtable, test)) {
+    g_error ("Out Of Memory!\n");
   }
-  return FALSE;
+
+  if (test->priv->peer)
+    announce (test, conn, INSANITY_LAUNCHER_INTERFACE, TRUE);
+
+#ifdef USE_ZYGOTE
+  if (test->priv->zygote)
+    zygote_watch_children (test);
+#endif
+
+  return TRUE;
 }
 
 static gboolean
 listen (InsanityTest * test, const char *bus_address, const char *uuid)
 {
-  DBusMessage *msg;
-  DBusMessage *reply;
-  DBusMessageIter args;
   DBusConnection *conn;
   DBusError err;
-  int ret;
-  char *object_name;
-  dbus_uint32_t serial = 0;
+  gboolean claimed;
 
   test->priv->standalone = FALSE;
 
+  /* Test threads send signals while the main loop reads */
+  dbus_threads_init_default ();
+
   dbus_error_init (&err);
 
-  /* connect to the bus and check for errors */
-  conn = dbus_connection_open (bus_address, &err);
+  /* connect to the bus and check for errors. The connection is private,
+     so a forked child never gets handed its zygote's shared one. */
+  conn = dbus_connection_open_private (bus_address, &err);
   if (dbus_error_is_set (&err)) {
     g_error ("Connection Error (%s)\n", err.message);
     dbus_error_free (&err);
@@ -1298,102 +3545,137 @@ listen (InsanityTest * test, const char *bus_address, const char *uuid)
     return FALSE;
   }
 
-  ret = dbus_bus_register (conn, &err);
-  if (dbus_error_is_set (&err)) {
-    g_error ("Failed to register bus (%s)\n", err.message);
-    dbus_error_free (&err);
-    /* Is this supposed to be fatal ? */
-  }
-  /* request our name on the bus and check for errors */
-  object_name = g_strdup_printf (INSANITY_TEST_INTERFACE ".Test%s", uuid);
-  ret =
-      dbus_bus_request_name (conn, object_name, DBUS_NAME_FLAG_REPLACE_EXISTING,
-      &err);
-  if (dbus_error_is_set (&err)) {
-    g_error ("Name Error (%s)\n", err.message);
-    dbus_error_free (&err);
-    /* Is this supposed to be fatal ? */
+  /* A peer-to-peer connection goes straight to the runner, which has
+     no bus to register with */
+  if (!test->priv->peer) {
+    dbus_bus_register (conn, &err);
+    if (dbus_error_is_set (&err)) {
+      g_error ("Failed to register bus (%s)\n", err.message);
+      dbus_error_free (&err);
+      /* Is this supposed to be fatal ? */
+    }
   }
-  if (DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER != ret) {
-    g_error ("Not Primary Owner (%d)\n", ret);
+
+  LOCK (test);
+  test->priv->exit = FALSE;
+  test->priv->context = g_main_context_new ();
+  test->priv->loop = g_main_loop_new (test->priv->context, FALSE);
+  UNLOCK (test);
+
+  if (test->priv->zygote || test->priv->hosting)
+    claimed = launcher_claim_name (test, conn, uuid);
+  else
+    claimed = insanity_test_claim_name (test, conn, uuid);
+  if (!claimed) {
+    dbus_connection_close (conn);
+    dbus_connection_unref (conn);
     return FALSE;
   }
+  dbus_connection_add_filter (conn, &insanity_test_dbus_filter, test, NULL);
+  dbus_connection_setup_with_context (conn, test->priv->context);
+
+  /* sleep until the bus wakes us up, and handle messages until teardown */
+  g_main_loop_run (test->priv->loop);
+
+#ifdef USE_ZYGOTE
+  if (test->priv->fork_uuid) {
+    char *child_uuid;
+    gboolean ret;
+    int fd;
+
+    /* We are a new child of the zygote. Everything here is shared with
+       the zygote, so it is dropped without being cleaned up, but the
+       zygote's file descriptors are closed so the child does not keep
+       its connection open. */
+    zygote_close_sigchld_pipe ();
+    if (dbus_connection_get_socket (conn, &fd))
+      close (fd);
 
-  insanity_test_connect (test, conn, uuid);
-
-  /* loop, testing for new messages */
-  test->priv->exit = FALSE;
-  while (1) {
     LOCK (test);
-    /* barely blocking update of dbus */
-    dbus_connection_read_write (conn, 1);
+    child_uuid = test->priv->fork_uuid;
+    test->priv->fork_uuid = NULL;
+    test->priv->conn = NULL;
+    test->priv->loop = NULL;
+    test->priv->context = NULL;
+    test->priv->children = NULL;
+    test->priv->children_source = NULL;
+    UNLOCK (test);
 
-    if (test->priv->exit) {
-      UNLOCK (test);
-      break;
-    }
+    ret = listen (test, bus_address, child_uuid);
+    g_free (child_uuid);
+    return ret;
+  }
+#endif
 
-    /* see if we have a message to handle */
-    msg = dbus_connection_pop_message (conn);
-    UNLOCK (test);
-    if (NULL == msg) {
-      g_usleep (10000);         /* Not good */
-      continue;
-    }
-#if 0
-    printf ("Got message:\n");
-    printf ("  type %d\n", dbus_message_get_type (msg));
-    printf ("  path %s\n", dbus_message_get_path (msg));
-    printf ("  interface %s\n", dbus_message_get_interface (msg));
-    printf ("  member %s\n", dbus_message_get_member (msg));
-    printf ("  sender %s\n", dbus_message_get_sender (msg));
-    printf ("  destination %s\n", dbus_message_get_destination (msg));
-    printf ("  signature %s\n", dbus_message_get_signature (msg));
+#ifdef USE_ZYGOTE
+  if (test->priv->zygote)
+    zygote_unwatch_children (test);
 #endif
 
-    /* check this is a method call for the right interface & method */
-    if (dbus_message_is_method_call (msg, "org.freedesktop.DBus.Introspectable",
-            "Introspect")) {
-      char *introspect_response =
-          g_strdup_printf (INTROSPECT_RESPONSE_TEMPLATE, uuid);
-      reply = dbus_message_new_method_return (msg);
-      dbus_message_iter_init_append (reply, &args);
-      if (!dbus_message_iter_append_basic (&args, DBUS_TYPE_STRING,
-              &introspect_response)) {
-        g_error ("Out Of Memory!\n");
-        dbus_message_unref (reply);
-        goto msg_error;
-      }
-      g_free (introspect_response);
-      LOCK (test);
-      if (!dbus_connection_send (conn, reply, &serial)) {
-        UNLOCK (test);
-        g_error ("Out Of Memory!\n");
-        dbus_message_unref (reply);
-        goto msg_error;
-      }
-      dbus_connection_flush (conn);
-      UNLOCK (test);
-      dbus_message_unref (reply);
-    } else if (!strcmp (dbus_message_get_interface (msg),
-            INSANITY_TEST_INTERFACE)) {
-      insanity_call_interface (test, msg);
-    } else {
-      /*printf("Got unhandled method call: interface %s, method %s\n", dbus_message_get_interface(msg), dbus_message_get_member(msg)); */
-    }
+  dbus_connection_flush (conn);
+  dbus_connection_clear_context (conn);
+  dbus_connection_remove_filter (conn, &insanity_test_dbus_filter, test);
+  dbus_connection_unregister_object_path (conn, test->priv->name);
 
-  msg_error:
-    dbus_message_unref (msg);
+  LOCK (test);
+  clear_results_unlocked (test);
+  if (test->priv->instances) {
+    g_hash_table_destroy (test->priv->instances);
+    test->priv->instances = NULL;
   }
+  g_main_loop_unref (test->priv->loop);
+  test->priv->loop = NULL;
+  g_main_context_unref (test->priv->context);
+  test->priv->context = NULL;
+  UNLOCK (test);
 
+  dbus_connection_close (conn);
   dbus_connection_unref (conn);
-  g_free (object_name);
 
   return TRUE;
 }
 
+/* The metadata is written as JSON with every string escaped, as labels
+   and descriptions may contain quotes or control characters */
+static void
+output_key (GString * s, const char *indent, const char *key)
+{
+  g_string_append (s, indent);
+  json_append_string (s, key);
+  g_string_append (s, ": ");
+}
+
+/* Most of the metadata comes from the library rather than from the test,
+   so the runner has to know which build of the library it came from */
+static void
+output_library (GString * s)
+{
+#ifdef USE_LIBRARY_IDENTITY
+  Dl_info info;
+  struct stat st;
+#endif
+
+  g_string_append (s, ",\n");
+  output_key (s, "  ", "__library__");
+  g_string_append (s, "{ ");
+  output_key (s, "", "version");
+  json_append_string (s, VERSION);
+#ifdef USE_LIBRARY_IDENTITY
+  if (dladdr ((void *) &insanity_test_get_type, &info) && info.dli_fname
+      && stat (info.dli_fname, &st) == 0) {
+    g_string_append (s, ", ");
+    output_key (s, "", "filename");
+    json_append_string (s, info.dli_fname);
+    g_string_append_printf (s, ", \"size\": %" G_GUINT64_FORMAT
+        ", \"mtime\": %" G_GINT64_FORMAT, (guint64) st.st_size,
+        (gint64) st.st_mtime);
+  }
+#endif
+  g_string_append (s, " }");
+}
+
 static void
-output_table (InsanityTest * test, FILE * f, GHashTable * table,
+output_table (InsanityTest * test, GString * s, GHashTable * table,
     const char *name, const char *(*getname) (void *))
 {
   GHashTableIter it;
@@ -1403,7 +3685,9 @@ output_table (InsanityTest * test, FILE * f, GHashTable * table,
   if (g_hash_table_size (table) == 0)
     return;
 
-  fprintf (f, ",\n  \"%s\": {\n", name);
+  g_string_append (s, ",\n");
+  output_key (s, "  ", name);
+  g_string_append (s, "{\n");
   g_hash_table_iter_init (&it, table);
   while (g_hash_table_iter_next (&it, (gpointer) & label, (gpointer) & data)) {
     const char *str_value = (*getname) (data);
@@ -1411,10 +3695,12 @@ output_table (InsanityTest * test, FILE * f, GHashTable * table,
     if (!str_value)
       continue;
 
-    fprintf (f, "%s    \"%s\" : \"%s\"", comma, label, str_value);
+    g_string_append (s, comma);
+    output_key (s, "    ", label);
+    json_append_string (s, str_value);
     comma = ",\n";
   }
-  fprintf (f, "\n  }");
+  g_string_append (s, "\n  }");
 }
 
 static const char *
@@ -1447,7 +3733,7 @@ get_argument_type_char (const GValue * v)
 }
 
 static void
-output_checklist_table (InsanityTest * test, FILE * f)
+output_checklist_table (InsanityTest * test, GString * s)
 {
   GHashTableIter it;
   const char *label, *comma = "";
@@ -1456,26 +3742,30 @@ output_checklist_table (InsanityTest * test, FILE * f)
   if (g_hash_table_size (test->priv->test_checklist) == 0)
     return;
 
-  fprintf (f, ",\n  \"__checklist__\": {\n");
+  g_string_append (s, ",\n  \"__checklist__\": {\n");
   g_hash_table_iter_init (&it, test->priv->test_checklist);
   while (g_hash_table_iter_next (&it, (gpointer) & label, (gpointer) & data)) {
     ChecklistItem *i = data;
 
-    fprintf (f, "%s    \"%s\" : \n", comma, label);
-    fprintf (f, "    {\n");
-    fprintf (f, "        \"description\" : \"%s\"", i->description);
+    g_string_append (s, comma);
+    output_key (s, "    ", label);
+    g_string_append (s, "\n    {\n");
+    output_key (s, "        ", "description");
+    json_append_string (s, i->description);
     if (i->likely_error) {
-      fprintf (f, ",\n        \"likely_error\" : \"%s\"", i->likely_error);
+      g_string_append (s, ",\n");
+      output_key (s, "        ", "likely_error");
+      json_append_string (s, i->likely_error);
     }
-    fprintf (f, "\n    }");
+    g_string_append (s, "\n    }");
 
     comma = ",\n";
   }
-  fprintf (f, "\n  }");
+  g_string_append (s, "\n  }");
 }
 
 static void
-output_arguments_table (InsanityTest * test, FILE * f)
+output_arguments_table (InsanityTest * test, GString * s)
 {
   GHashTableIter it;
   const char *label, *comma = "";
@@ -1484,7 +3774,7 @@ output_arguments_table (InsanityTest * test, FILE * f)
   if (g_hash_table_size (test->priv->test_arguments) == 0)
     return;
 
-  fprintf (f, ",\n  \"__arguments__\": {\n");
+  g_string_append (s, ",\n  \"__arguments__\": {\n");
   g_hash_table_iter_init (&it, test->priv->test_arguments);
   while (g_hash_table_iter_next (&it, (gpointer) & label, (gpointer) & data)) {
     Argument *a = data;
@@ -1495,25 +3785,32 @@ output_arguments_table (InsanityTest * test, FILE * f)
     else
       default_value = g_strdup_value_contents (&a->default_value);
 
-    fprintf (f, "%s    \"%s\" : \n", comma, label);
-    fprintf (f, "    {\n");
-    fprintf (f, "        \"global\" : %s,\n", (a->global ? "true" : "false"));
-    fprintf (f, "        \"description\" : \"%s\",\n", a->description);
-    fprintf (f, "        \"full_description\" : \"%s\",\n",
+    g_string_append (s, comma);
+    output_key (s, "    ", label);
+    g_string_append (s, "\n    {\n");
+    g_string_append_printf (s, "        \"global\": %s,\n",
+        (a->global ? "true" : "false"));
+    output_key (s, "        ", "description");
+    json_append_string (s, a->description);
+    g_string_append (s, ",\n");
+    output_key (s, "        ", "full_description");
+    json_append_string (s,
         a->full_description ? a->full_description : a->description);
-    fprintf (f, "        \"type\" : \"%s\",\n",
+    g_string_append (s, ",\n");
+    g_string_append_printf (s, "        \"type\": \"%s\",\n",
         get_argument_type_char (&a->default_value));
-    fprintf (f, "        \"default_value\" : \"%s\"\n", default_value);
-    fprintf (f, "    }");
+    output_key (s, "        ", "default_value");
+    json_append_string (s, default_value ? default_value : "");
+    g_string_append (s, "\n    }");
     g_free (default_value);
 
     comma = ",\n";
   }
-  fprintf (f, "\n  }");
+  g_string_append (s, "\n  }");
 }
 
 static void
-output_output_files_table (InsanityTest * test, FILE * f)
+output_output_files_table (InsanityTest * test, GString * s)
 {
   GHashTableIter it;
   const char *label, *comma = "";
@@ -1522,44 +3819,77 @@ output_output_files_table (InsanityTest * test, FILE * f)
   if (g_hash_table_size (test->priv->test_output_files) == 0)
     return;
 
-  fprintf (f, ",\n  \"__output_files__\": {\n");
+  g_string_append (s, ",\n  \"__output_files__\": {\n");
   g_hash_table_iter_init (&it, test->priv->test_output_files);
   while (g_hash_table_iter_next (&it, (gpointer) & label, (gpointer) & data)) {
     OutputFileItem *of = data;
 
-    fprintf (f, "%s    \"%s\" : \n", comma, label);
-    fprintf (f, "    {\n");
-    fprintf (f, "        \"description\" : \"%s\",\n", of->description);
-    fprintf (f, "        \"global\" : %s\n", (of->global ? "true" : "false"));
-    fprintf (f, "    }");
+    g_string_append (s, comma);
+    output_key (s, "    ", label);
+    g_string_append (s, "\n    {\n");
+    output_key (s, "        ", "description");
+    json_append_string (s, of->description);
+    g_string_append_printf (s, ",\n        \"global\": %s\n",
+        (of->global ? "true" : "false"));
+    g_string_append (s, "    }");
 
     comma = ",\n";
   }
-  fprintf (f, "\n  }");
+  g_string_append (s, "\n  }");
 }
 
+/* The metadata follows a magic line, which the runner looks for when
+   probing the binary. The build embeds the same JSON in the
+   .insanity_metadata section of test binaries, so the runner can read
+   it without running them. */
 static void
 insanity_test_write_metadata (InsanityTest * test)
 {
-  FILE *f = stdout;
-  char *name, *desc;
-
-  g_object_get (G_OBJECT (test), "name", &name, NULL);
-  g_object_get (G_OBJECT (test), "description", &desc, NULL);
-
-  fprintf (f, "Insanity test metadata:\n");
-  fprintf (f, "{\n");
-  fprintf (f, "  \"__name__\": \"%s\",\n", name);
-  fprintf (f, "  \"__description__\": \"%s\"", desc);
-  output_checklist_table (test, f);
-  output_arguments_table (test, f);
-  output_table (test, f, test->priv->test_extra_infos, "__extra_infos__",
+  GString *s;
+  char *name, *desc, *full_desc;
+
+  g_object_get (G_OBJECT (test), "name", &name, "description", &desc,
+      "full-description", &full_desc, NULL);
+
+  s = g_string_new ("{\n");
+  output_key (s, "  ", "__name__");
+  json_append_string (s, name);
+  g_string_append (s, ",\n");
+  output_key (s, "  ", "__description__");
+  json_append_string (s, desc);
+  if (full_desc) {
+    g_string_append (s, ",\n");
+    output_key (s, "  ", "__full_description__");
+    json_append_string (s, full_desc);
+  }
+  output_checklist_table (test, s);
+  output_arguments_table (test, s);
+  output_table (test, s, test->priv->test_extra_infos, "__extra_infos__",
       &get_raw_string);
-  output_output_files_table (test, f);
-  fprintf (f, "\n}\n");
+  output_table (test, s, test->priv->test_samples, "__samples__",
+      &get_raw_string);
+  output_output_files_table (test, s);
+  output_library (s);
+  /* lets the runner know which --run modes this binary supports */
+  g_string_append (s, ",\n  \"__launch_modes__\": [ \"spawn\"");
+  if (test->priv->reusable)
+    g_string_append (s, ", \"worker\"");
+#ifdef USE_ZYGOTE
+  g_string_append (s, ", \"zygote\"");
+#endif
+  if (test->priv->factory)
+    g_string_append (s, ", \"host\"");
+  g_string_append (s, " ]");
+  g_string_append (s, "\n}\n");
 
+  fprintf (stdout, "Insanity test metadata:\n");
+  fwrite (s->str, s->len, 1, stdout);
+  fflush (stdout);
+
+  g_string_free (s, TRUE);
   g_free (name);
   g_free (desc);
+  g_free (full_desc);
 }
 
 static void
@@ -1705,24 +4035,145 @@ insanity_report_failed_tests (InsanityTest * test, gboolean verbose)
 }
 
 static gboolean
-insanity_test_run_standalone (InsanityTest * test)
+write_benchmark_report (InsanityTest * test, const char *filename,
+    guint iterations, guint warmup)
+{
+  FILE *out = stdout;
+  gboolean ret;
+
+  if (filename && *filename) {
+    out = fopen (filename, "w");
+    if (!out) {
+      g_critical ("Failed to open %s: %s\n", filename, g_strerror (errno));
+      return FALSE;
+    }
+  }
+
+  /* logs go to stderr, let them all out before the report */
+  if (test->priv->log_writer)
+    log_writer_flush (test->priv->log_writer);
+
+  LOCK (test);
+  ret = benchmark_write_report (test->priv->benchmark, out,
+      test->priv->test_name, iterations, warmup);
+  UNLOCK (test);
+
+  if (out != stdout)
+    ret = (fclose (out) == 0) && ret;
+  else
+    fflush (out);
+  return ret;
+}
+
+/* In benchmark mode, the start/stop cycle is run warmup times, then
+   iterations times while collecting numeric extra infos */
+static gboolean
+insanity_test_run_standalone (InsanityTest * test, guint iterations,
+    guint warmup, const char *report)
 {
-  gboolean timeout = FALSE, started;
+  gboolean timeout = FALSE, started, benchmark = iterations > 0;
+  guint n;
+  guint64 t0;
+
+  if (benchmark) {
+    test->priv->benchmark = benchmark_new ();
+  } else {
+    iterations = 1;
+  }
 
   if (on_setup (test)) {
-    LOCK_SIGNAL (test);
-    started = on_start (test);
-    if (started) {
-      timeout = WAIT_TIMEOUT (test);
+    for (n = 0; n < warmup + iterations && !timeout; ++n) {
+      LOCK (test);
+      test->priv->benchmark_collecting = benchmark && n >= warmup;
+      UNLOCK (test);
+
+      t0 = monotonic_time_ns ();
+      LOCK_SIGNAL (test);
+      started = on_start (test);
+      if (started) {
+        timeout = WAIT_TIMEOUT (test);
+      }
+      UNLOCK_SIGNAL (test);
+      on_stop (test);
+
+      LOCK (test);
+      if (test->priv->benchmark_collecting)
+        benchmark_record (test->priv->benchmark, "iteration-duration",
+            monotonic_time_ns () - t0);
+      test->priv->benchmark_collecting = FALSE;
+      UNLOCK (test);
+
+      if (!started)
+        break;
     }
-    UNLOCK_SIGNAL (test);
-    on_stop (test);
   }
   on_teardown (test);
 
+  if (benchmark) {
+    if (!write_benchmark_report (test, report, iterations, warmup))
+      timeout = TRUE;
+    LOCK (test);
+    benchmark_free (test->priv->benchmark);
+    test->priv->benchmark = NULL;
+    UNLOCK (test);
+  }
+
   return (!timeout && insanity_report_failed_tests (test, TRUE) == 0);
 }
 
+/**
+ * insanity_test_set_instance_factory:
+ * @test: a #InsanityTest to operate on
+ * @factory: (scope notified): a function creating a new, fully set up,
+ *   instance of the test
+ * @user_data: (closure): data to pass to @factory
+ * @notify: (allow-none): function to call on @user_data when it is no
+ *   longer needed
+ *
+ * Declares that several instances of this test can run at the same time
+ * in a single process. When the test is run with --host, the runner asks
+ * for new instances as needed, and @factory is called to make each of
+ * them. @factory must return a new #InsanityTest with the same metadata
+ * and handlers as @test.
+ */
+void
+insanity_test_set_instance_factory (InsanityTest * test,
+    InsanityTestFactory factory, gpointer user_data, GDestroyNotify notify)
+{
+  g_return_if_fail (INSANITY_IS_TEST (test));
+
+  LOCK (test);
+  if (test->priv->factory_notify)
+    (*test->priv->factory_notify) (test->priv->factory_data);
+  test->priv->factory = factory;
+  test->priv->factory_data = user_data;
+  test->priv->factory_notify = notify;
+  UNLOCK (test);
+}
+
+/**
+ * insanity_test_set_reusable:
+ * @test: a #InsanityTest to operate on
+ * @reusable: whether the test can be reused
+ *
+ * Declares that the process running this test can be reused for other
+ * instances of the test once torn down, which saves starting a new one
+ * each time. When the test is run with --worker, the runner may hand it
+ * over to a new instance: the arguments, output files and results are
+ * then reset, but any other state the test keeps is not. Only tests
+ * which leave nothing behind in the process after teardown should be
+ * declared reusable.
+ */
+void
+insanity_test_set_reusable (InsanityTest * test, gboolean reusable)
+{
+  g_return_if_fail (INSANITY_IS_TEST (test));
+
+  LOCK (test);
+  test->priv->reusable = reusable;
+  UNLOCK (test);
+}
+
 /**
  * insanity_test_run:
  * @test: a #InsanityTest to operate on
@@ -1738,12 +4189,19 @@ gboolean
 insanity_test_run (InsanityTest * test, int *argc, char ***argv)
 {
   const char *private_dbus_address;
+  const char *private_dbus_peer;
   const char *opt_uuid = NULL;
   gboolean opt_run = FALSE;
   gboolean opt_metadata = FALSE;
   gint opt_timeout = TEST_TIMEOUT;
   const char *opt_output_directory = NULL;
   gboolean opt_keep_unnamed_output_files = FALSE;
+  gboolean opt_worker = FALSE;
+  gboolean opt_zygote = FALSE;
+  gboolean opt_host = FALSE;
+  gint opt_benchmark = 0;
+  gint opt_warmup = 0;
+  const char *opt_benchmark_report = NULL;
   const GOptionEntry options[] = {
     {"run", 0, 0, G_OPTION_ARG_NONE, &opt_run, "Run the test standalone", NULL},
     {"insanity-metadata", 0, 0, G_OPTION_ARG_NONE, &opt_metadata,
@@ -1759,6 +4217,26 @@ insanity_test_run (InsanityTest * test, int *argc, char ***argv)
           &opt_keep_unnamed_output_files,
           "Keep unnamed output files after program ends (by default, only named ones are kept)",
         NULL},
+    {"worker", 0, 0, G_OPTION_ARG_NONE, &opt_worker,
+        "Keep running after teardown, and accept remoteReset (remote mode only)",
+        NULL},
+    {"host", 0, 0, G_OPTION_ARG_NONE, &opt_host,
+          "Serve several test instances at once from this process, created with remoteCreateInstance (remote mode only)",
+        NULL},
+    {"benchmark", 0, 0, G_OPTION_ARG_INT, &opt_benchmark,
+          "Run the test N times and report statistics on its extra infos (standalone mode only)",
+        "N"},
+    {"warmup", 0, 0, G_OPTION_ARG_INT, &opt_warmup,
+          "Run the test M more times before measuring (benchmark mode only)",
+        "M"},
+    {"benchmark-report", 0, 0, G_OPTION_ARG_STRING, &opt_benchmark_report,
+          "Write the JSON benchmark report to this file instead of stdout",
+        "FILE"},
+#ifdef USE_ZYGOTE
+    {"zygote", 0, 0, G_OPTION_ARG_NONE, &opt_zygote,
+          "Fork a new process for each test instance requested with remoteFork (remote mode only)",
+        NULL},
+#endif
     {NULL}
   };
   GOptionContext *ctx;
@@ -1829,8 +4307,12 @@ insanity_test_run (InsanityTest * test, int *argc, char ***argv)
         }
       }
     }
+    LOCK (test);
+    update_arg_snapshot_unlocked (test);
+    UNLOCK (test);
 
-    ret = insanity_test_run_standalone (test);
+    ret = insanity_test_run_standalone (test, MAX (opt_benchmark, 0),
+        MAX (opt_warmup, 0), opt_benchmark_report);
   }
 
   else if (opt_run && opt_uuid) {
@@ -1843,7 +4325,20 @@ insanity_test_run (InsanityTest * test, int *argc, char ***argv)
       printf ("uuid: %s\n", opt_uuid);
       printf ("PRIVATE_DBUS_ADDRESS: %s\n", private_dbus_address);
 #endif
-      ret = listen (test, private_dbus_address, opt_uuid);
+      test->priv->worker = opt_worker;
+      test->priv->zygote = opt_zygote;
+      test->priv->hosting = opt_host;
+      private_dbus_peer = getenv ("PRIVATE_DBUS_PEER");
+      test->priv->peer = private_dbus_peer && !strcmp (private_dbus_peer, "1");
+      if (opt_host && !test->priv->factory) {
+        g_critical ("--host needs an instance factory\n");
+        ret = FALSE;
+      } else if (opt_worker && !test->priv->reusable) {
+        g_critical ("--worker needs a reusable test\n");
+        ret = FALSE;
+      } else {
+        ret = listen (test, private_dbus_address, opt_uuid);
+      }
     }
   }
 
@@ -1867,10 +4362,22 @@ insanity_test_finalize (GObject * gobject)
 
   if (priv->args)
     g_hash_table_destroy (priv->args);
+  free_arg_snapshot (priv->arg_snapshot);
+  free_arg_snapshot (priv->retired_arg_snapshot);
+  g_ptr_array_free (priv->arg_labels, TRUE);
   if (priv->conn)
     dbus_connection_unref (priv->conn);
   if (test->priv->name)
     g_free (test->priv->name);
+  g_free (priv->bus_name);
+  g_free (priv->next_uuid);
+  g_free (priv->fork_uuid);
+  if (priv->children)
+    g_hash_table_destroy (priv->children);
+  if (priv->instances)
+    g_hash_table_destroy (priv->instances);
+  if (priv->factory_notify)
+    (*priv->factory_notify) (priv->factory_data);
   if (priv->filename_cache) {
     if (!priv->conn) {          /* unreffed, but value still set */
       if (!priv->keep_unnamed_output_files) {
@@ -1889,6 +4396,11 @@ insanity_test_finalize (GObject * gobject)
     g_hash_table_destroy (priv->filename_cache);
   }
   g_hash_table_destroy (priv->checklist_results);
+  g_ptr_array_free (priv->checklist_labels, TRUE);
+  g_free ((guint *) priv->checklist_states);
+  g_free (priv->checklist_reported);
+  clear_results_unlocked (test);
+  g_array_free (priv->pending_results, TRUE);
   if (priv->tmpdir) {
     /* Will fail if there are files left, this is expected */
     g_rmdir (priv->tmpdir);
@@ -1902,6 +4414,21 @@ insanity_test_finalize (GObject * gobject)
   g_hash_table_destroy (priv->test_arguments);
   g_hash_table_destroy (priv->test_extra_infos);
   g_hash_table_destroy (priv->test_output_files);
+  g_hash_table_destroy (priv->test_samples);
+  g_hash_table_destroy (priv->test_histograms);
+  g_hash_table_destroy (priv->sample_handles);
+  g_ptr_array_free (priv->sample_labels, TRUE);
+  if (priv->sampling_source) {
+    g_source_destroy (priv->sampling_source);
+    g_source_unref (priv->sampling_source);
+  }
+  if (priv->thread_usage)
+    thread_usage_free (priv->thread_usage);
+  if (priv->perf_counters)
+    perf_counters_stop (priv->perf_counters, NULL, NULL);
+#ifdef USE_SAMPLE_RING
+  unmap_sample_ring (test);
+#endif
 #ifdef USE_NEW_GLIB_MUTEX_API
   g_mutex_clear (&priv->lock);
   g_mutex_clear (&priv->signal_lock);
@@ -1912,6 +4439,7 @@ insanity_test_finalize (GObject * gobject)
   g_cond_free (priv->cond);
 #endif
 
+  close_log_writer (test);
   g_hash_table_destroy (test->priv->log_levels);
 
   G_OBJECT_CLASS (insanity_test_parent_class)->finalize (gobject);
@@ -1937,8 +4465,28 @@ insanity_test_init (InsanityTest * test)
 #endif
   test->priv = priv;
   priv->conn = NULL;
+  priv->context = NULL;
+  priv->loop = NULL;
   priv->name = NULL;
+  priv->bus_name = NULL;
+  priv->reusable = FALSE;
+  priv->worker = FALSE;
+  priv->peer = FALSE;
+  priv->next_uuid = NULL;
+  priv->zygote = FALSE;
+  priv->fork_uuid = NULL;
+  priv->children = NULL;
+  priv->children_source = NULL;
+  priv->hosting = FALSE;
+  priv->instances = NULL;
+  priv->host = NULL;
+  priv->factory = NULL;
+  priv->factory_data = NULL;
+  priv->factory_notify = NULL;
   priv->args = NULL;
+  priv->arg_labels = g_ptr_array_new ();
+  priv->arg_snapshot = NULL;
+  priv->retired_arg_snapshot = NULL;
   priv->cpu_load = -1;
   priv->standalone = TRUE;
   priv->tmpdir = NULL;
@@ -1946,8 +4494,14 @@ insanity_test_init (InsanityTest * test)
   priv->runlevel = rl_idle;
   priv->filename_cache =
       g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free, g_free);
+  priv->checklist_labels = g_ptr_array_new ();
+  priv->checklist_states = NULL;
+  priv->checklist_reported = NULL;
   priv->checklist_results =
       g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free, NULL);
+  priv->pending_results = g_array_new (FALSE, FALSE, sizeof (ResultRecord));
+  priv->pending_ping = FALSE;
+  priv->result_flush_source = NULL;
 
   priv->test_name = NULL;
   priv->test_desc = NULL;
@@ -1963,6 +4517,13 @@ insanity_test_init (InsanityTest * test)
   priv->test_output_files =
       g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
       &free_output_file_item);
+  priv->test_samples =
+      g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free, g_free);
+  priv->sample_labels = g_ptr_array_new_with_free_func (&g_free);
+  priv->sample_handles = g_hash_table_new (&g_str_hash, &g_str_equal);
+  priv->test_histograms =
+      g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
+      (GDestroyNotify) & histogram_free);
 
   test->priv->log_levels = g_hash_table_new (&g_str_hash, &g_str_equal);
 
@@ -1974,6 +4535,98 @@ insanity_test_init (InsanityTest * test)
       "Amount of extra information on stdout",
       "0: no output; 1: info; 2: debug; 3: verbose traces", TRUE, &vdef);
   g_value_unset (&vdef);
+
+  g_value_init (&vdef, G_TYPE_STRING);
+  g_value_set_string (&vdef, "");
+  insanity_test_add_argument (test, "log-file",
+      "File to write logs to",
+      "Logs go to stdout in standalone mode if empty (stderr in benchmark mode), and nowhere otherwise",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
+
+  g_value_init (&vdef, G_TYPE_STRING);
+  g_value_set_string (&vdef, "text");
+  insanity_test_add_argument (test, "log-format",
+      "Format of the logs",
+      "text, or binary for the fastest logging (to be read with insanity-logformat)",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
+
+  /* Those about the iteration are set again at each one. The runner
+     keeps the values of each iteration, and benchmark mode aggregates
+     them, but otherwise only the last iteration's value is kept. */
+  insanity_test_add_extra_info (test, "setup-duration",
+      "Time spent setting up, in nanoseconds");
+  insanity_test_add_extra_info (test, "start-duration",
+      "Time spent starting the iteration, in nanoseconds");
+  insanity_test_add_extra_info (test, "run-duration",
+      "Time from the start of the iteration until the test was done, in nanoseconds");
+  insanity_test_add_extra_info (test, "stop-duration",
+      "Time spent stopping the iteration, in nanoseconds");
+  insanity_test_add_extra_info (test, "teardown-duration",
+      "Time spent tearing down, in nanoseconds");
+  insanity_test_add_extra_info (test, "user-time",
+      "CPU time spent in user mode during the iteration, in nanoseconds");
+  insanity_test_add_extra_info (test, "system-time",
+      "CPU time spent in the kernel during the iteration, in nanoseconds");
+  insanity_test_add_extra_info (test, "voluntary-context-switches",
+      "Times the process waited for something during the iteration");
+  insanity_test_add_extra_info (test, "involuntary-context-switches",
+      "Times the process was preempted during the iteration");
+  insanity_test_add_extra_info (test, "minor-faults",
+      "Page faults serviced without I/O during the iteration");
+  insanity_test_add_extra_info (test, "major-faults",
+      "Page faults which needed I/O during the iteration");
+  insanity_test_add_extra_info (test, "thread-cpu-times",
+      "CPU time used by threads of each name during the iteration, as JSON (needs thread-cpu-usage)");
+  insanity_test_add_extra_info (test, "peak-rss",
+      "Highest resident set size of the process during the iteration, in bytes");
+  insanity_test_add_extra_info (test, "rss-delta",
+      "Growth of the resident set size of the process during the iteration, in bytes");
+  insanity_test_add_extra_info (test, "pss",
+      "Proportional set size of the process at the end of the iteration, in bytes");
+  insanity_test_add_extra_info (test, "heap-in-use",
+      "Memory allocated with malloc at the end of the iteration, in bytes");
+  insanity_test_add_extra_info (test, "perf-cycles",
+      "CPU cycles spent in user space during the iteration (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-instructions",
+      "Instructions executed in user space during the iteration (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-branch-misses",
+      "Mispredicted branches during the iteration (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-cache-misses",
+      "Last level cache misses during the iteration (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-task-clock",
+      "CPU time spent by the process during the iteration, in user space and in the kernel, in nanoseconds (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-context-switches",
+      "Context switches during the iteration, without hardware counters (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-cpu-migrations",
+      "Migrations to another CPU during the iteration, without hardware counters (needs perf-counters)");
+  insanity_test_add_extra_info (test, "perf-page-faults",
+      "Page faults during the iteration, without hardware counters (needs perf-counters)");
+
+  g_value_init (&vdef, G_TYPE_BOOLEAN);
+  g_value_set_boolean (&vdef, FALSE);
+  insanity_test_add_argument (test, "thread-cpu-usage",
+      "Report the CPU time used by each thread",
+      "Samples the threads of the process during each iteration, and reports their CPU time grouped by thread name in the thread-cpu-times extra info",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
+
+  g_value_init (&vdef, G_TYPE_BOOLEAN);
+  g_value_set_boolean (&vdef, FALSE);
+  insanity_test_add_argument (test, "perf-counters",
+      "Report hardware performance counters",
+      "Counts cycles, instructions, branch and cache misses in all threads during each iteration with perf_event_open, or software events where there is no hardware counter",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
+
+  g_value_init (&vdef, G_TYPE_UINT);
+  g_value_set_uint (&vdef, 100);
+  insanity_test_add_argument (test, "sampling-interval",
+      "Interval between thread and memory samples, in milliseconds",
+      "Threads exiting during an iteration are accounted up to their last sample, and memory peaks are caught by samples where VmHWM cannot be reset. Only used with thread-cpu-usage, or where VmHWM cannot be reset. 0 only samples when the iteration starts and stops",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
 }
 
 static gboolean
@@ -2154,6 +4807,7 @@ insanity_test_add_checklist_item (InsanityTest * test, const char *label,
     const char *description, const char *error_hint)
 {
   ChecklistItem *i;
+  char *key;
 
   g_return_if_fail (INSANITY_IS_TEST (test));
   g_return_if_fail (label != NULL);
@@ -2166,7 +4820,19 @@ insanity_test_add_checklist_item (InsanityTest * test, const char *label,
   i->description = g_strdup (description);
   i->likely_error = g_strdup (error_hint);
 
-  g_hash_table_insert (test->priv->test_checklist, g_strdup (label), i);
+  key = g_strdup (label);
+  g_hash_table_insert (test->priv->test_checklist, key, i);
+
+  /* items are declared before the test runs, so nothing is validated
+     through handles while these grow */
+  i->handle = test->priv->checklist_labels->len;
+  g_ptr_array_add (test->priv->checklist_labels, key);
+  test->priv->checklist_states = g_renew (guint,
+      (guint *) test->priv->checklist_states, i->handle + 1);
+  test->priv->checklist_states[i->handle] = 0;
+  test->priv->checklist_reported = g_renew (guint,
+      test->priv->checklist_reported, i->handle + 1);
+  test->priv->checklist_reported[i->handle] = 0;
 }
 
 /**
@@ -2197,6 +4863,7 @@ insanity_test_add_argument (InsanityTest * test, const char *label,
     gboolean global, const GValue * default_value)
 {
   Argument *arg;
+  char *key;
 
   g_return_if_fail (INSANITY_IS_TEST (test));
   g_return_if_fail (label != NULL);
@@ -2215,7 +4882,10 @@ insanity_test_add_argument (InsanityTest * test, const char *label,
   arg->full_description = full_description ? g_strdup (full_description) : NULL;
   g_value_init (&arg->default_value, G_VALUE_TYPE (default_value));
   g_value_copy (default_value, &arg->default_value);    /* Source is first */
-  g_hash_table_insert (test->priv->test_arguments, g_strdup (label), arg);
+  key = g_strdup (label);
+  arg->handle = test->priv->arg_labels->len;
+  g_ptr_array_add (test->priv->arg_labels, key);
+  g_hash_table_insert (test->priv->test_arguments, key, arg);
 }
 
 /**
@@ -2244,6 +4914,93 @@ insanity_test_add_extra_info (InsanityTest * test, const char *label,
       description);
 }
 
+/**
+ * insanity_test_add_sample:
+ * @test: a #InsanityTest instance to operate on.
+ * @label: the new sample's label, shorter than 40 characters
+ * @description: a one line description of what the sample measures
+ *
+ * This function adds a sample declaration to the test.
+ *
+ * Samples are timestamped values a test can report at high frequency
+ * using insanity_test_emit_sample_handle. Longer labels would not fit
+ * in a sample record, and are rejected.
+ */
+void
+insanity_test_add_sample (InsanityTest * test, const char *label,
+    const char *description)
+{
+  char *key;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (label != NULL);
+  g_return_if_fail (check_valid_label (label));
+  g_return_if_fail (g_hash_table_lookup (test->priv->test_samples,
+          label) == NULL);
+  g_return_if_fail (description != NULL);
+
+  if (strlen (label) >= SAMPLE_LABEL_SIZE) {
+    g_critical ("Sample label '%s' is longer than %d characters\n", label,
+        SAMPLE_LABEL_SIZE - 1);
+    return;
+  }
+
+  insanity_add_metadata_entry (test->priv->test_samples, label, description);
+  key = g_strdup (label);
+  g_ptr_array_add (test->priv->sample_labels, key);
+  g_hash_table_insert (test->priv->sample_handles, key,
+      GINT_TO_POINTER (test->priv->sample_labels->len));
+}
+
+/**
+ * insanity_test_add_histogram:
+ * @test: a #InsanityTest instance to operate on.
+ * @label: the new histogram's label
+ * @description: a one line description of what the histogram measures
+ *
+ * This function adds a histogram declaration to the test.
+ *
+ * A histogram collects values recorded with insanity_test_histogram_record,
+ * typically latencies. When the test stops, it is summarized into the
+ * extra infos @label-count, @label-min, @label-max, @label-p50,
+ * @label-p90, @label-p99 and @label-p999, then emptied for the next
+ * iteration. Percentiles are accurate to about 3%.
+ */
+void
+insanity_test_add_histogram (InsanityTest * test, const char *label,
+    const char *description)
+{
+  static const char *const suffixes[] = {
+    "count", "min", "max", "p50", "p90", "p99", "p999"
+  };
+  static const char *const descriptions[] = {
+    "Number of values recorded", "Lowest value", "Highest value",
+    "Median value", "90th percentile", "99th percentile",
+    "99.9th percentile"
+  };
+  char *name, *desc;
+  size_t n;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (label != NULL);
+  g_return_if_fail (check_valid_label (label));
+  g_return_if_fail (g_hash_table_lookup (test->priv->test_histograms,
+          label) == NULL);
+  g_return_if_fail (description != NULL);
+
+  for (n = 0; n < G_N_ELEMENTS (suffixes); ++n) {
+    name = g_strdup_printf ("%s-%s", label, suffixes[n]);
+    desc = g_strdup_printf ("%s: %s", description, descriptions[n]);
+    if (g_hash_table_lookup (test->priv->test_extra_infos, name) == NULL)
+      insanity_add_metadata_entry (test->priv->test_extra_infos, name, desc);
+    g_free (desc);
+    g_free (name);
+  }
+
+  g_hash_table_insert (test->priv->test_histograms, g_strdup (label),
+      histogram_new ());
+}
+
 /**
  * insanity_test_add_output_file:
  * @test: a #InsanityTest instance to operate on.
@@ -2333,13 +5090,82 @@ find_log_level (InsanityTest * test, const char *category)
 {
   gpointer p;
 
-  if (g_hash_table_lookup_extended (test->priv->log_levels, category, NULL, &p)) {
-    printf ("category '%s' has log level %u\n", category, (InsanityLogLevel) p);
+  if (g_hash_table_lookup_extended (test->priv->log_levels, category, NULL, &p))
     return (InsanityLogLevel) p;
-  }
   return test->priv->default_log_level;
 }
 
+/* Log categories are added to this list the first time they are used,
+   and their levels are updated whenever a test is set up */
+G_LOCK_DEFINE_STATIC (log_categories);
+static InsanityLogCategory *log_categories = NULL;
+
+INSANITY_LOG_CATEGORY_DEFINE (insanity_log_category_default, "default");
+
+static gint
+resolve_log_category (InsanityTest * test, InsanityLogCategory * category)
+{
+  if (!g_atomic_pointer_get (&test->priv->log_writer))
+    return INSANITY_LOG_LEVEL_NONE;
+  return find_log_level (test, category->name);
+}
+
+/* A process hosting several tests keeps the highest level any of them
+   asked for, the exact level of each test is checked when logging */
+static void
+update_log_categories (InsanityTest * test)
+{
+  InsanityLogCategory *category;
+  gint level;
+
+  G_LOCK (log_categories);
+  for (category = log_categories; category; category = category->next) {
+    level = resolve_log_category (test, category);
+    if (test->priv->host && category->level > level)
+      level = category->level;
+    g_atomic_int_set (&category->level, level);
+  }
+  G_UNLOCK (log_categories);
+}
+
+static void
+register_log_category (InsanityTest * test, InsanityLogCategory * category)
+{
+  G_LOCK (log_categories);
+  if (category->level == INSANITY_LOG_CATEGORY_UNRESOLVED) {
+    category->next = log_categories;
+    log_categories = category;
+    if (check_valid_label (category->name)) {
+      g_atomic_int_set (&category->level, resolve_log_category (test,
+              category));
+    } else {
+      g_critical ("Invalid category name: %s - disabled\n", category->name);
+      g_atomic_int_set (&category->level, INSANITY_LOG_LEVEL_NONE);
+    }
+  }
+  G_UNLOCK (log_categories);
+}
+
+/* Logs a message whose level was already checked against its category */
+static void
+log_enabled_v (InsanityTest * test, const char *category,
+    InsanityLogLevel level, const char *file, unsigned int line,
+    const char *format, va_list args)
+{
+  LogWriter *writer;
+  guint64 dt;
+
+  /* Both are full barriers: close_log_writer either sees us here, or
+     we see the writer is gone */
+  g_atomic_int_inc (&test->priv->log_emitters);
+  writer = g_atomic_pointer_get (&test->priv->log_writer);
+  if (writer) {
+    dt = g_get_monotonic_time () - test->priv->start_time;
+    log_writer_logv (writer, dt, level, category, file, line, format, args);
+  }
+  g_atomic_int_add (&test->priv->log_emitters, -1);
+}
+
 /**
  * insanity_test_logv:
  * @test: a #InsanityTest instance to operate on.
@@ -2350,43 +5176,80 @@ find_log_level (InsanityTest * test, const char *category)
  * @format: a printf(3) format string, followed by optional arguments as per printf(3)
  * @args: the parameters to insert into the format string
  *
- * This function outputs messages on stdout when some conditions are met.
+ * This function outputs messages when some conditions are met.
  * The semantics of these messages may be debugging, or informative, but
  * which are not intended to be stored. If you want a message to be stored,
  * use a extra-info string for this.
  *
  * Currently, the output conditions are:
- *  - the test is running in standalone mode
+ *  - the test is running in standalone mode (logs go to stdout), or the
+ *    log-file argument is set (logs go to that file)
  *  - the log-level property is set to higher or equal to the log's level
  *
  * These conditions may change to match a "when it makes sense" ideal.
+ *
+ * Messages are written by a separate thread, so logging does not block
+ * on the output. With the log-format argument set to "binary", they are
+ * written in a binary format, to be read with insanity-logformat.
  */
 void
 insanity_test_logv (InsanityTest * test, const char *category,
     InsanityLogLevel level, const char *file, unsigned int line,
     const char *format, va_list args)
 {
-  guint64 dt;
-  gchar *msg;
-
   g_return_if_fail (INSANITY_IS_TEST (test));
   g_return_if_fail (check_valid_label (category));
 
-  if (!test->priv->standalone)
-    return;
   if (level == INSANITY_LOG_LEVEL_NONE)
     return;
+  if (!g_atomic_pointer_get (&test->priv->log_writer))
+    return;
   if (level > find_log_level (test, category))
     return;
 
-  dt = g_get_monotonic_time () - test->priv->start_time;
+  log_enabled_v (test, category, level, file, line, format, args);
+}
+
+/**
+ * insanity_test_log_category:
+ * @test: a #InsanityTest instance to operate on.
+ * @category: a log category
+ * @level: log level of this log
+ * @file: the filename where the log call is located
+ * @line: the line number in that file where the log call is located
+ * @format: a printf(3) format string, followed by optional arguments as per printf(3)
+ * @...: the parameters to insert into the format string
+ *
+ * Same as insanity_test_log, for a category defined with
+ * INSANITY_LOG_CATEGORY_DEFINE or INSANITY_LOG_CATEGORY_STATIC.
+ * This is usually called through INSANITY_CLOG, which only evaluates
+ * its arguments if @category is enabled for @level.
+ */
+void
+insanity_test_log_category (InsanityTest * test,
+    InsanityLogCategory * category, InsanityLogLevel level, const char *file,
+    unsigned int line, const char *format, ...)
+{
+  va_list ap;
+
+  g_return_if_fail (INSANITY_IS_TEST (test));
+  g_return_if_fail (category != NULL);
 
-  msg = g_strdup_vprintf (format, args);
+  if (G_UNLIKELY (g_atomic_int_get (&category->level) ==
+          INSANITY_LOG_CATEGORY_UNRESOLVED))
+    register_log_category (test, category);
+  if (level == INSANITY_LOG_LEVEL_NONE
+      || (gint) level > g_atomic_int_get (&category->level))
+    return;
+  /* the category level is the highest of all the hosted tests, which
+     may not have asked for the same */
+  if (test->priv->host && level > find_log_level (test, category->name))
+    return;
 
-  printf ("%" TIME_FORMAT "\t%p\t%s\t%s\t%s:%u\t%s",
-      TIME_ARGS (dt), g_thread_self (), log_level_names[level], category, file,
-      line, msg);
-  g_free (msg);
+  /* the name was checked when registering */
+  va_start (ap, format);
+  log_enabled_v (test, category->name, level, file, line, format, ap);
+  va_end (ap);
 }
 
 /**
@@ -2399,16 +5262,21 @@ insanity_test_logv (InsanityTest * test, const char *category,
  * @format: a printf(3) format string, followed by optional arguments as per printf(3)
  * @...: the parameters to insert into the format string
  *
- * This function outputs messages on stdout when some conditions are met.
+ * This function outputs messages when some conditions are met.
  * The semantics of these messages may be debugging, or informative, but
  * which are not intended to be stored. If you want a message to be stored,
  * use a extra-info string for this.
  *
  * Currently, the output conditions are:
- *  - the test is running in standalone mode
+ *  - the test is running in standalone mode (logs go to stdout), or the
+ *    log-file argument is set (logs go to that file)
  *  - the log-level property is set to higher or equal to the log's level
  *
  * These conditions may change to match a "when it makes sense" ideal.
+ *
+ * Messages are written by a separate thread, so logging does not block
+ * on the output. With the log-format argument set to "binary", they are
+ * written in a binary format, to be read with insanity-logformat.
  */
 void
 insanity_test_log (InsanityTest * test, const char *category,
@@ -39,6 +39,23 @@ typedef enum {
 typedef struct _InsanityTest InsanityTest;
 typedef struct _InsanityTestClass InsanityTestClass;
 typedef struct _InsanityTestPrivateData InsanityTestPrivateData;
+typedef struct _InsanityLogCategory InsanityLogCategory;
+
+/**
+ * InsanityLogCategory:
+ *
+ * A log category, defined with INSANITY_LOG_CATEGORY_DEFINE or
+ * INSANITY_LOG_CATEGORY_STATIC and used with INSANITY_CLOG.
+ *
+ * It caches the log level set for it with the log-level argument, so
+ * that disabled logs cost a single comparison.
+ */
+struct _InsanityLogCategory {
+  /*< private >*/
+  const char *name;
+  volatile gint level;
+  InsanityLogCategory *next;
+};
 
 /**
  * InsanityTest:
@@ -92,17 +109,36 @@ struct _InsanityTestClass
 
 GType insanity_test_get_type (void);
 
+/**
+ * InsanityTestFactory:
+ * @user_data: the data passed to insanity_test_set_instance_factory()
+ *
+ * Creates a new instance of a test, for tests which can run several
+ * instances in the same process.
+ *
+ * Returns: (transfer full): a new #InsanityTest
+ */
+typedef InsanityTest *(*InsanityTestFactory) (gpointer user_data);
+
 InsanityTest *insanity_test_new(const char *name, const char *description, const char *full_description);
 void insanity_test_add_checklist_item(InsanityTest *test, const char *label, const char *description, const char *error_hint);
 void insanity_test_add_argument(InsanityTest *test, const char *label, const char *description, const char *full_description, gboolean global, const GValue *default_value);
 void insanity_test_add_output_file(InsanityTest *test, const char *label, const char *description, gboolean global);
 void insanity_test_add_extra_info(InsanityTest *test, const char *label, const char *description);
+void insanity_test_add_sample(InsanityTest *test, const char *label, const char *description);
+void insanity_test_add_histogram(InsanityTest *test, const char *label, const char *description);
 
 gboolean insanity_test_get_argument(InsanityTest *test, const char *label, GValue *value);
 const char *insanity_test_get_output_filename(InsanityTest *test, const char *label);
 void insanity_test_done(InsanityTest *test);
 void insanity_test_validate_checklist_item(InsanityTest *test, const char *label, gboolean success, const char *description);
+gint insanity_test_get_checklist_handle(InsanityTest *test, const char *label);
+void insanity_test_validate_checklist_handle(InsanityTest *test, gint handle, gboolean success);
 void insanity_test_set_extra_info(InsanityTest *test, const char *label, const GValue *data);
+void insanity_test_emit_sample(InsanityTest *test, const char *label, double value);
+gint insanity_test_get_sample_handle(InsanityTest *test, const char *label);
+void insanity_test_emit_sample_handle(InsanityTest *test, gint handle, double value);
+void insanity_test_histogram_record(InsanityTest *test, const char *label, guint64 value);
 void insanity_test_ping(InsanityTest *test);
 
 gboolean insanity_test_check (InsanityTest *test, const char *label, gboolean expr, const char *msg, ...);
@@ -113,9 +149,26 @@ void insanity_test_logv (InsanityTest *test, const char *category, InsanityLogLe
 void insanity_test_log (InsanityTest *test, const char *category, InsanityLogLevel level, const char *file, unsigned int line, const char *format, ...);
 #define INSANITY_LOG(test, category, loglevel, format, args...) \
   insanity_test_log(test, category, loglevel, __FILE__, __LINE__, format, ##args)
+
+#define INSANITY_LOG_CATEGORY_UNRESOLVED G_MAXINT
+#define INSANITY_LOG_CATEGORY_INIT(name) { (name), INSANITY_LOG_CATEGORY_UNRESOLVED, NULL }
+#define INSANITY_LOG_CATEGORY_DEFINE(var, name) \
+  InsanityLogCategory var = INSANITY_LOG_CATEGORY_INIT (name)
+#define INSANITY_LOG_CATEGORY_STATIC(var, name) \
+  static InsanityLogCategory var = INSANITY_LOG_CATEGORY_INIT (name)
+
+extern InsanityLogCategory insanity_log_category_default;
+
+void insanity_test_log_category (InsanityTest *test, InsanityLogCategory *category, InsanityLogLevel level, const char *file, unsigned int line, const char *format, ...);
+#define INSANITY_CLOG(test, category, loglevel, format, args...) G_STMT_START { \
+  if (G_UNLIKELY ((gint) (loglevel) <= (category).level)) \
+    insanity_test_log_category(test, &(category), loglevel, __FILE__, __LINE__, format, ##args); \
+} G_STMT_END
 #define insanity_test_printf(test,format,args...) \
-  INSANITY_LOG(test, "default", INSANITY_LOG_LEVEL_INFO, format, ##args)
+  INSANITY_CLOG(test, insanity_log_category_default, INSANITY_LOG_LEVEL_INFO, format, ##args)
 
+void insanity_test_set_instance_factory(InsanityTest *test, InsanityTestFactory factory, gpointer user_data, GDestroyNotify notify);
+void insanity_test_set_reusable(InsanityTest *test, gboolean reusable);
 gboolean insanity_test_run(InsanityTest *test, int *argc, char ***argv);
 
 /* convenience functions to avoid the heavy GValue use on common uses */
@@ -135,6 +188,15 @@ gboolean insanity_test_get_uint64_argument(InsanityTest *test, const char *label
 gboolean insanity_test_get_double_argument(InsanityTest *test, const char *label, gdouble *value);
 gboolean insanity_test_get_boolean_argument(InsanityTest *test, const char *label, gboolean *value);
 
+gint insanity_test_arg_handle(InsanityTest *test, const char *label);
+const char *insanity_test_arg_get_string(InsanityTest *test, gint handle);
+gint insanity_test_arg_get_int(InsanityTest *test, gint handle);
+guint insanity_test_arg_get_uint(InsanityTest *test, gint handle);
+gint64 insanity_test_arg_get_int64(InsanityTest *test, gint handle);
+guint64 insanity_test_arg_get_uint64(InsanityTest *test, gint handle);
+gdouble insanity_test_arg_get_double(InsanityTest *test, gint handle);
+gboolean insanity_test_arg_get_boolean(InsanityTest *test, gint handle);
+
 void insanity_test_set_string_extra_info (InsanityTest * test, const char *label, const char *data);
 void insanity_test_set_int_extra_info (InsanityTest * test, const char *label, gint data);
 void insanity_test_set_uint_extra_info (InsanityTest * test, const char *label, guint data);
@@ -31,63 +31,352 @@
 #include "config.h"
 #endif
 
+#ifdef USE_WORKER_AFFINITY
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#ifdef USE_PTHREAD_WORKER
+#include <pthread.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "insanitythreadedtest.h"
 #include "insanityprivate.h"
 
+#if GLIB_CHECK_VERSION(2,31,0)
+#define USE_NEW_GLIB_MUTEX_API
+#endif
+
 /* if global vars are good enough for gstreamer, it's good enough for insanity */
 static guint test_signal;
 
 G_DEFINE_TYPE (InsanityThreadedTest, insanity_threaded_test,
     INSANITY_TYPE_TEST);
 
+/* The test signal is emitted from a worker thread, which is created at
+   the first start and waits for the next one until teardown. A worker
+   still running the test at teardown, usually after a timeout, is left
+   to exit on its own: it quits once worker_id is not its own anymore. */
 struct _InsanityThreadedTestPrivateData
 {
+#ifdef USE_PTHREAD_WORKER
+  pthread_t thread;
+#else
   GThread *thread;
+#endif
+  gboolean has_thread;
+  guint worker_id;
+
+#ifdef USE_NEW_GLIB_MUTEX_API
+  GMutex lock;
+  GCond cond;
+#else
+  GMutex *lock;
+  GCond *cond;
+#endif
+  gboolean pending;             /* start was called, the worker did not run yet */
+  gboolean running;
+
+  char *cpu_mask;
 };
 
+#ifdef USE_NEW_GLIB_MUTEX_API
+#define LOCK(test) g_mutex_lock(&(test)->priv->lock)
+#define UNLOCK(test) g_mutex_unlock(&(test)->priv->lock)
+#define WAIT(test) g_cond_wait(&(test)->priv->cond, &(test)->priv->lock)
+#define SIGNAL(test) g_cond_broadcast(&(test)->priv->cond)
+#else
+#define LOCK(test) g_mutex_lock((test)->priv->lock)
+#define UNLOCK(test) g_mutex_unlock((test)->priv->lock)
+#define WAIT(test) g_cond_wait((test)->priv->cond, (test)->priv->lock)
+#define SIGNAL(test) g_cond_broadcast((test)->priv->cond)
+#endif
+
+#ifdef USE_WORKER_AFFINITY
+/* Parses a list of CPUs and ranges, like "0,2-3" */
+static gboolean
+parse_cpu_mask (const char *s, cpu_set_t * set)
+{
+  unsigned long first, last;
+  char *end;
+
+  CPU_ZERO (set);
+  while (*s) {
+    first = strtoul (s, &end, 10);
+    if (end == s)
+      return FALSE;
+    last = first;
+    if (*end == '-') {
+      s = end + 1;
+      last = strtoul (s, &end, 10);
+      if (end == s || last < first)
+        return FALSE;
+    }
+    if (last >= CPU_SETSIZE)
+      return FALSE;
+    for (; first <= last; ++first)
+      CPU_SET (first, set);
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return FALSE;
+    s = end;
+  }
+  return TRUE;
+}
+#endif
+
+static void
+set_worker_affinity (InsanityThreadedTest * test)
+{
+#ifdef USE_WORKER_AFFINITY
+  cpu_set_t set;
+
+  if (!test->priv->cpu_mask || !*test->priv->cpu_mask)
+    return;
+  if (!parse_cpu_mask (test->priv->cpu_mask, &set)) {
+    insanity_test_printf (INSANITY_TEST (test), "Invalid CPU mask: %s\n",
+        test->priv->cpu_mask);
+    return;
+  }
+  /* 0 is the calling thread */
+  if (sched_setaffinity (0, sizeof (set), &set) < 0)
+    insanity_test_printf (INSANITY_TEST (test),
+        "Failed to set the worker CPU affinity\n");
+#else
+  (void) test;
+#endif
+}
+
+typedef struct
+{
+  InsanityThreadedTest *test;
+  guint id;
+} Worker;
+
+/* The worker holds a reference to the test, as it may outlive teardown */
 static gpointer
 test_thread_func (gpointer data)
 {
-  InsanityThreadedTest *test = INSANITY_THREADED_TEST (data);
+  Worker *worker = data;
+  InsanityThreadedTest *test = worker->test;
 
-  g_signal_emit (test, test_signal, 0, NULL);
+  set_worker_affinity (test);
 
-  test->priv->thread = NULL;
+  LOCK (test);
+  while (TRUE) {
+    while (!test->priv->pending && test->priv->worker_id == worker->id)
+      WAIT (test);
+    if (test->priv->worker_id != worker->id)
+      break;
+    test->priv->pending = FALSE;
+    test->priv->running = TRUE;
+    UNLOCK (test);
+
+    g_signal_emit (test, test_signal, 0, NULL);
 
+    LOCK (test);
+    if (test->priv->worker_id == worker->id) {
+      test->priv->running = FALSE;
+      SIGNAL (test);
+    }
+  }
+  UNLOCK (test);
+
+  g_object_unref (test);
+  g_slice_free (Worker, worker);
   return NULL;
 }
 
+#ifdef USE_PTHREAD_WORKER
+static void *
+test_pthread_func (void *data)
+{
+  return test_thread_func (data);
+}
+#endif
+
+static gboolean
+start_worker (InsanityThreadedTest * test)
+{
+  GValue stack_size = { 0 };
+  GValue cpu_mask = { 0 };
+  Worker *worker;
+  gboolean ret;
+#ifdef USE_PTHREAD_WORKER
+  pthread_attr_t attr;
+#endif
+
+  insanity_test_get_argument (INSANITY_TEST (test), "worker-stack-size",
+      &stack_size);
+  insanity_test_get_argument (INSANITY_TEST (test), "worker-cpu-mask",
+      &cpu_mask);
+  g_free (test->priv->cpu_mask);
+  test->priv->cpu_mask = g_value_dup_string (&cpu_mask);
+  g_value_unset (&cpu_mask);
+
+  worker = g_slice_new (Worker);
+  worker->test = g_object_ref (test);
+  LOCK (test);
+  worker->id = test->priv->worker_id;
+  UNLOCK (test);
+
+#ifdef USE_PTHREAD_WORKER
+  pthread_attr_init (&attr);
+  if (g_value_get_uint (&stack_size) > 0
+      && pthread_attr_setstacksize (&attr, g_value_get_uint (&stack_size)))
+    insanity_test_printf (INSANITY_TEST (test),
+        "Invalid worker stack size: %u\n", g_value_get_uint (&stack_size));
+  ret = !pthread_create (&test->priv->thread, &attr, &test_pthread_func, worker);
+  pthread_attr_destroy (&attr);
+#elif GLIB_CHECK_VERSION(2,31,2)
+  test->priv->thread =
+      g_thread_new ("insanity_worker", test_thread_func, worker);
+  ret = test->priv->thread != NULL;
+#else
+  test->priv->thread =
+      g_thread_create_full (test_thread_func, worker,
+      g_value_get_uint (&stack_size), TRUE, FALSE, G_THREAD_PRIORITY_NORMAL,
+      NULL);
+  ret = test->priv->thread != NULL;
+#endif
+  g_value_unset (&stack_size);
+
+  if (!ret) {
+    g_object_unref (test);
+    g_slice_free (Worker, worker);
+  }
+  test->priv->has_thread = ret;
+  return ret;
+}
+
+/* Joins the worker if it is idle, and lets it go otherwise: a test
+   which timed out must still be able to report */
+static void
+stop_worker (InsanityThreadedTest * test)
+{
+  gboolean running;
+
+  if (!test->priv->has_thread)
+    return;
+
+  LOCK (test);
+  running = test->priv->running;
+  test->priv->worker_id++;
+  test->priv->pending = FALSE;
+  test->priv->running = FALSE;
+  SIGNAL (test);
+  UNLOCK (test);
+
+#ifdef USE_PTHREAD_WORKER
+  if (running)
+    pthread_detach (test->priv->thread);
+  else
+    pthread_join (test->priv->thread, NULL);
+#else
+  if (!running)
+    g_thread_join (test->priv->thread);
+#if GLIB_CHECK_VERSION(2,32,0)
+  else
+    g_thread_unref (test->priv->thread);
+#endif
+  test->priv->thread = NULL;
+#endif
+  test->priv->has_thread = FALSE;
+}
+
 static gboolean
 insanity_threaded_test_start (InsanityTest * itest)
 {
   InsanityThreadedTest *test = INSANITY_THREADED_TEST (itest);
+  gboolean busy;
 
-  if (test->priv->thread)
+  /* the previous iteration may be done, with its handler still
+     returning */
+  LOCK (test);
+  while (test->priv->running)
+    WAIT (test);
+  busy = test->priv->pending;
+  UNLOCK (test);
+  if (busy)
     return FALSE;
 
   if (!INSANITY_TEST_CLASS (insanity_threaded_test_parent_class)->start (itest))
     return FALSE;
 
-  test->priv->thread =
-#if GLIB_CHECK_VERSION(2,31,2)
-      g_thread_new ("insanity_worker", test_thread_func, test);
-#else
-      g_thread_create (test_thread_func, test, TRUE, NULL);
-#endif
-
-  if (!test->priv->thread)
+  if (!test->priv->has_thread && !start_worker (test))
     return FALSE;
 
+  LOCK (test);
+  test->priv->pending = TRUE;
+  SIGNAL (test);
+  UNLOCK (test);
+
   return TRUE;
 }
 
+static void
+insanity_threaded_test_teardown (InsanityTest * itest)
+{
+  InsanityThreadedTest *test = INSANITY_THREADED_TEST (itest);
+
+  stop_worker (test);
+
+  INSANITY_TEST_CLASS (insanity_threaded_test_parent_class)->teardown (itest);
+}
+
+static void
+insanity_threaded_test_finalize (GObject * gobject)
+{
+  InsanityThreadedTest *test = INSANITY_THREADED_TEST (gobject);
+
+  stop_worker (test);
+  g_free (test->priv->cpu_mask);
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_clear (&test->priv->lock);
+  g_cond_clear (&test->priv->cond);
+#else
+  g_mutex_free (test->priv->lock);
+  g_cond_free (test->priv->cond);
+#endif
+
+  G_OBJECT_CLASS (insanity_threaded_test_parent_class)->finalize (gobject);
+}
+
 static void
 insanity_threaded_test_init (InsanityThreadedTest * test)
 {
   InsanityThreadedTestPrivateData *priv = G_TYPE_INSTANCE_GET_PRIVATE (test,
       INSANITY_TYPE_THREADED_TEST, InsanityThreadedTestPrivateData);
 
+  GValue vdef = { 0 };
+
   test->priv = priv;
+#ifdef USE_NEW_GLIB_MUTEX_API
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->cond);
+#else
+  priv->lock = g_mutex_new ();
+  priv->cond = g_cond_new ();
+#endif
+
+  g_value_init (&vdef, G_TYPE_UINT);
+  g_value_set_uint (&vdef, 0);
+  insanity_test_add_argument (INSANITY_TEST (test), "worker-stack-size",
+      "Stack size of the worker thread, in bytes",
+      "0 for the system default", TRUE, &vdef);
+  g_value_unset (&vdef);
+
+  g_value_init (&vdef, G_TYPE_STRING);
+  g_value_set_string (&vdef, "");
+  insanity_test_add_argument (INSANITY_TEST (test), "worker-cpu-mask",
+      "CPUs the worker thread may run on",
+      "A list of CPUs and ranges, like 0,2-3, or empty for any CPU",
+      TRUE, &vdef);
+  g_value_unset (&vdef);
 }
 
 static void
@@ -96,7 +385,9 @@ insanity_threaded_test_class_init (InsanityThreadedTestClass * klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   InsanityTestClass *test_class = INSANITY_TEST_CLASS (klass);
 
+  gobject_class->finalize = &insanity_threaded_test_finalize;
   test_class->start = &insanity_threaded_test_start;
+  test_class->teardown = &insanity_threaded_test_teardown;
 
   g_type_class_add_private (klass, sizeof (InsanityThreadedTestPrivateData));
 
@@ -116,8 +407,12 @@ insanity_threaded_test_class_init (InsanityThreadedTestClass * klass)
  *
  * This function creates a new threaded test with the given properties.
  *
- * Threaded tests create a thread, and the test signal which will be called
- * in the new thread.
+ * Threaded tests create a worker thread at the first start, and the test
+ * signal is called in that thread at each start. The worker is kept
+ * until teardown, when it is joined, or left to exit on its own if it
+ * is still running the test. Its stack size and the CPUs it may
+ * run on can be set with the worker-stack-size and worker-cpu-mask
+ * arguments.
  *
  * Returns: (transfer full): a new #InsanityThreadedTest instance.
  */
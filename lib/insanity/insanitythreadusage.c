@@ -0,0 +1,285 @@
+/* Insanity QA system
+
+       insanitythreadusage.c
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+/* CPU time used by each thread of the process during an iteration.
+
+   Threads are sampled from /proc/self/task/<tid>/stat. The CPU time
+   of a thread is accounted from its first sample in the iteration (or
+   from zero if it started during the iteration) to its last one, so a
+   thread which exits between two samples loses what it used since the
+   previous sample. Threads are then grouped by name, which is what is
+   meaningful to compare between runs. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "insanityprivate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_THREAD_CPU_USAGE
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+  char name[16];
+  guint64 start_utime;
+  guint64 start_stime;
+  guint64 utime;
+  guint64 stime;
+} ThreadTimes;
+
+struct _ThreadUsage
+{
+  /* tid -> ThreadTimes */
+  GHashTable *threads;
+  gboolean started;
+};
+
+typedef struct
+{
+  guint64 utime;
+  guint64 stime;
+  guint nthreads;
+} NameTimes;
+
+typedef struct
+{
+  gint tid;
+  char name[16];
+  guint64 utime;
+  guint64 stime;
+} ThreadSample;
+
+/* GArray of ThreadSample */
+struct _ThreadSnapshot
+{
+  GArray *threads;
+};
+
+ThreadUsage *
+thread_usage_new (void)
+{
+  ThreadUsage *usage;
+
+  usage = g_slice_new (ThreadUsage);
+  usage->threads = g_hash_table_new_full (&g_direct_hash, &g_direct_equal,
+      NULL, g_free);
+  usage->started = FALSE;
+  return usage;
+}
+
+void
+thread_usage_free (ThreadUsage * usage)
+{
+  g_hash_table_destroy (usage->threads);
+  g_slice_free (ThreadUsage, usage);
+}
+
+#ifdef USE_THREAD_CPU_USAGE
+static gboolean
+read_thread_times (const char *tid, char *name, guint64 * utime,
+    guint64 * stime)
+{
+  char *filename, *contents, *open, *close;
+  unsigned long long u, s;
+  gboolean ret = FALSE;
+
+  filename = g_build_filename ("/proc/self/task", tid, "stat", NULL);
+  if (!g_file_get_contents (filename, &contents, NULL, NULL)) {
+    /* the thread exited meanwhile */
+    g_free (filename);
+    return FALSE;
+  }
+  g_free (filename);
+
+  /* the name is within parentheses, and may contain some */
+  open = strchr (contents, '(');
+  close = strrchr (contents, ')');
+  if (open && close && close > open) {
+    g_strlcpy (name, open + 1, MIN (16, close - open));
+    if (sscanf (close + 1,
+            " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+            &u, &s) == 2) {
+      *utime = u;
+      *stime = s;
+      ret = TRUE;
+    }
+  }
+
+  g_free (contents);
+  return ret;
+}
+#endif
+
+/* Reads the times of all threads, which needs no ThreadUsage, so
+   callers do not have to hold their lock meanwhile. Returns NULL if
+   threads cannot be sampled. */
+ThreadSnapshot *
+thread_usage_read (void)
+{
+#ifdef USE_THREAD_CPU_USAGE
+  ThreadSnapshot *snapshot;
+  ThreadSample sample;
+  GDir *dir;
+  const char *tid;
+
+  dir = g_dir_open ("/proc/self/task", 0, NULL);
+  if (!dir)
+    return NULL;
+
+  snapshot = g_slice_new (ThreadSnapshot);
+  snapshot->threads = g_array_new (FALSE, FALSE, sizeof (ThreadSample));
+  while ((tid = g_dir_read_name (dir))) {
+    if (!read_thread_times (tid, sample.name, &sample.utime, &sample.stime))
+      continue;
+    sample.tid = atoi (tid);
+    g_array_append_val (snapshot->threads, sample);
+  }
+  g_dir_close (dir);
+
+  return snapshot;
+#else
+  return NULL;
+#endif
+}
+
+/* Adds a snapshot from thread_usage_read, which is freed. The first
+   one after thread_usage_reset marks the start of the iteration. */
+void
+thread_usage_add (ThreadUsage * usage, ThreadSnapshot * snapshot)
+{
+  ThreadSample *sample;
+  ThreadTimes *times;
+  gpointer key;
+  guint n;
+
+  if (snapshot) {
+    for (n = 0; n < snapshot->threads->len; ++n) {
+      sample = &g_array_index (snapshot->threads, ThreadSample, n);
+      key = GINT_TO_POINTER (sample->tid);
+      times = g_hash_table_lookup (usage->threads, key);
+      if (!times) {
+        times = g_new0 (ThreadTimes, 1);
+        if (!usage->started) {
+          times->start_utime = sample->utime;
+          times->start_stime = sample->stime;
+        }
+        g_hash_table_insert (usage->threads, key, times);
+      }
+      /* threads may rename themselves */
+      memcpy (times->name, sample->name, sizeof (times->name));
+      times->utime = sample->utime;
+      times->stime = sample->stime;
+    }
+    thread_snapshot_free (snapshot);
+  }
+
+  usage->started = TRUE;
+}
+
+void
+thread_snapshot_free (ThreadSnapshot * snapshot)
+{
+  g_array_free (snapshot->threads, TRUE);
+  g_slice_free (ThreadSnapshot, snapshot);
+}
+
+/* Samples all threads */
+void
+thread_usage_sample (ThreadUsage * usage)
+{
+  thread_usage_add (usage, thread_usage_read ());
+}
+
+void
+thread_usage_reset (ThreadUsage * usage)
+{
+  g_hash_table_remove_all (usage->threads);
+  usage->started = FALSE;
+}
+
+/* Returns the CPU time used by threads of each name since the start of
+   the iteration, as a JSON object mapping the name to an object with
+   the user and system times in nanoseconds and the number of threads.
+   Returns NULL if threads could not be sampled. */
+char *
+thread_usage_report (ThreadUsage * usage)
+{
+#ifdef USE_THREAD_CPU_USAGE
+  GHashTable *names;
+  GHashTableIter it;
+  gpointer key, value;
+  ThreadTimes *times;
+  NameTimes *nt;
+  GString *s;
+  guint64 ns_per_tick;
+  long ticks;
+  gboolean first = TRUE;
+
+  if (g_hash_table_size (usage->threads) == 0)
+    return NULL;
+
+  ticks = sysconf (_SC_CLK_TCK);
+  if (ticks <= 0)
+    return NULL;
+  ns_per_tick = 1000000000 / ticks;
+
+  names = g_hash_table_new_full (&g_str_hash, &g_str_equal, NULL, g_free);
+  g_hash_table_iter_init (&it, usage->threads);
+  while (g_hash_table_iter_next (&it, &key, &value)) {
+    times = value;
+    nt = g_hash_table_lookup (names, times->name);
+    if (!nt) {
+      nt = g_new0 (NameTimes, 1);
+      g_hash_table_insert (names, times->name, nt);
+    }
+    nt->utime += times->utime - times->start_utime;
+    nt->stime += times->stime - times->start_stime;
+    nt->nthreads++;
+  }
+
+  s = g_string_new ("{");
+  g_hash_table_iter_init (&it, names);
+  while (g_hash_table_iter_next (&it, &key, &value)) {
+    nt = value;
+    if (!first)
+      g_string_append (s, ", ");
+    first = FALSE;
+    json_append_string (s, key);
+    g_string_append_printf (s,
+        ": {\"user\": %" G_GUINT64_FORMAT ", \"system\": %" G_GUINT64_FORMAT
+        ", \"threads\": %u}", nt->utime * ns_per_tick,
+        nt->stime * ns_per_tick, nt->nthreads);
+  }
+  g_string_append_c (s, '}');
+  g_hash_table_destroy (names);
+
+  return g_string_free (s, FALSE);
+#else
+  (void) usage;
+  return NULL;
+#endif
+}
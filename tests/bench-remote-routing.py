@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+# GStreamer QA system
+#
+#       bench-remote-routing.py
+#
+# Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this program; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+"""
+Benchmark for routing bus name changes from the TestRun to its tests
+
+Each of N concurrent tests sees its remote counterpart appear and go
+away, either:
+* broadcast: every test listens to the new-remote-test and
+  removed-remote-test signals and filters on its uuid,
+* routed: tests are added with TestRun.addRemoteTest() and only the
+  one concerned is told.
+
+No bus is involved, the name changes are fed to the TestRun directly.
+"""
+
+import sys
+import time
+from insanity.testrun import TestRun
+
+TEST_NAME = "net.gstreamer.Insanity.Test.Test"
+
+class BenchTestRun(TestRun):
+
+    def _setupPrivateBus(self):
+        pass
+
+class BroadcastTest(object):
+
+    def __init__(self, testrun, uuid):
+        self.uuid = uuid
+        self.events = 0
+        testrun.connect("new-remote-test", self._newRemoteTest)
+        testrun.connect("removed-remote-test", self._removedRemoteTest)
+
+    def _newRemoteTest(self, testrun, uuid):
+        if not uuid == self.uuid:
+            return
+        self.events += 1
+
+    def _removedRemoteTest(self, testrun, uuid):
+        if not uuid == self.uuid:
+            return
+        self.events += 1
+
+class RoutedTest(object):
+
+    def __init__(self, testrun, uuid):
+        self.uuid = uuid
+        self.events = 0
+        testrun.addRemoteTest(self)
+
+    def remoteAppeared(self):
+        self.events += 1
+
+    def remoteRemoved(self):
+        self.events += 1
+
+def bench(testclass, nbtests, rounds):
+    testrun = BenchTestRun(workingdir="/tmp")
+    tests = [testclass(testrun, "%d" % i) for i in range(nbtests)]
+    start = time.time()
+    for r in range(rounds):
+        for test in tests:
+            name = TEST_NAME + test.uuid
+            testrun._dbusNameOwnerChangedSignal(name, "", ":1.%d" % r)
+            testrun._dbusNameOwnerChangedSignal(name, ":1.%d" % r, "")
+    delay = time.time() - start
+    for test in tests:
+        assert test.events == 2 * rounds
+    return delay / (2 * rounds * nbtests)
+
+def main(args):
+    rounds = 10
+    if len(args) > 1:
+        rounds = int(args[1])
+    print "%10s %16s %16s" % ("tests", "broadcast (us)", "routed (us)")
+    for nbtests in (64, 256):
+        broadcast = bench(BroadcastTest, nbtests, rounds)
+        routed = bench(RoutedTest, nbtests, rounds)
+        print "%10d %16.2f %16.2f" % (nbtests, broadcast * 1e6, routed * 1e6)
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <insanity/insanity.h>
 
+INSANITY_LOG_CATEGORY_STATIC (cat3, "cat3");
+
 static gboolean
 blank_test_setup (InsanityTest * test)
 {
@@ -107,20 +109,21 @@ blank_test_test (InsanityTest * test)
   insanity_test_printf(test,"log:via-test\n");
   INSANITY_LOG(test,"cat1",INSANITY_LOG_LEVEL_INFO,"log:cat1\n");
   INSANITY_LOG(test,"cat2",INSANITY_LOG_LEVEL_INFO,"log:cat2\n");
+  INSANITY_CLOG(test,cat3,INSANITY_LOG_LEVEL_INFO,"log:cat3\n");
+  INSANITY_CLOG(test,cat3,INSANITY_LOG_LEVEL_SPAM,"log:cat3:spam\n");
 
 done:
   /* Must be called when the test is done */
   insanity_test_done (test);
 }
 
-int
-main (int argc, char **argv)
+static InsanityTest *
+blank_test_new (gpointer user_data)
 {
   InsanityTest *test;
-  gboolean ret;
   GValue def = { 0 };
 
-  g_type_init ();
+  (void) user_data;
 
   test =
       INSANITY_TEST (insanity_threaded_test_new ("blank-c-test",
@@ -156,6 +159,23 @@ main (int argc, char **argv)
   g_signal_connect (test, "teardown", G_CALLBACK (&blank_test_teardown), 0);
   g_signal_connect_after (test, "test", G_CALLBACK (&blank_test_test), 0);
 
+  return test;
+}
+
+int
+main (int argc, char **argv)
+{
+  InsanityTest *test;
+  gboolean ret;
+
+  g_type_init ();
+
+  test = blank_test_new (NULL);
+
+  /* Instances don't share any state, so they can run side by side,
+     or one after the other in the same process */
+  insanity_test_set_instance_factory (test, &blank_test_new, NULL, NULL);
+  insanity_test_set_reusable (test, TRUE);
 
   ret = insanity_test_run (test, &argc, &argv);
 
@@ -0,0 +1,60 @@
+/* Insanity QA system
+
+ Copyright (c) 2012, Collabora Ltd <vincent@collabora.co.uk>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this program; if not, write to the
+ Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ Boston, MA 02111-1307, USA.
+*/
+
+#include <glib.h>
+#include <glib-object.h>
+#include <insanity/insanity.h>
+
+static void
+parallel_fail_test_test (InsanityParallelTest * test, guint worker)
+{
+  /* Worker 1 passes before worker 0 fails, and the others pass after
+     that: the item must fail whatever the order. */
+  if (worker == 0) {
+    g_usleep (20000);
+  } else if (worker > 1) {
+    g_usleep (50000);
+  }
+  insanity_test_validate_checklist_item (INSANITY_TEST (test),
+      "all-workers-passed", worker != 0, NULL);
+}
+
+int
+main (int argc, char **argv)
+{
+  InsanityParallelTest *test;
+  gboolean ret;
+
+  g_type_init ();
+
+  test = insanity_parallel_test_new ("parallel-fail-c-test",
+      "Parallel test where one worker fails", NULL);
+  insanity_test_add_checklist_item (INSANITY_TEST (test),
+      "all-workers-passed", "The item passed in every worker",
+      "It failed in worker 0, as it should");
+  g_signal_connect_after (test, "test",
+      G_CALLBACK (&parallel_fail_test_test), 0);
+
+  ret = insanity_test_run (INSANITY_TEST (test), &argc, &argv);
+
+  g_object_unref (test);
+
+  return ret ? 0 : 1;
+}